@@ -0,0 +1,359 @@
+/*
+ * Author: Konrad Słoniewski
+ * Date:   18 August 2013
+ */
+
+/* Frame backends of slijent other than TAP: frames are read from and
+ * written to pcap files, or pcap streams on stdin/stdout or on a Unix
+ * stream socket, so that captures can be pushed through a switch and
+ * its output recorded without root or kernel devices. */
+
+#include "backend.h"
+
+/* Functions */
+
+/* Kind of an interface name, BACKEND_TAP for a plain TAP name */
+int backend_kind(const char* spec) {
+  if (!strncmp(spec, "pcap:", 5))
+    return BACKEND_PCAP;
+  if (!strcmp(spec, "pipe:"))
+    return BACKEND_PIPE;
+  if (!strncmp(spec, "unix:", 5))
+    return BACKEND_UNIX;
+  return BACKEND_TAP;
+}
+
+
+static struct pcap_reader* new_reader(int fd, int nonblocking) {
+  struct pcap_reader* reader;
+  struct stat info;
+
+  reader = calloc(1, sizeof(struct pcap_reader));
+  if (!reader)
+    fatal("Allocating pcap reader.");
+  reader->buf = malloc(PCAP_BUF_SIZE);
+  if (!reader->buf)
+    fatal("Allocating pcap buffer.");
+  reader->fd = fd;
+
+  if (fstat(fd, &info) == -1)
+    syserr("fstat");
+  reader->is_file = S_ISREG(info.st_mode);
+  if (!reader->is_file && nonblocking &&
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1)
+    syserr("Making pcap input nonblocking.");
+
+  return reader;
+}
+
+
+/* Writer of a pcap stream to file, or to socket fd if file is NULL,
+ * starting with the file header */
+static struct pcap_writer* new_writer(FILE* file, int fd, int is_stream) {
+  struct pcap_file_header header;
+  struct pcap_writer* writer;
+
+  writer = calloc(1, sizeof(struct pcap_writer));
+  if (!writer)
+    fatal("Allocating pcap writer.");
+  writer->file = file;
+  writer->fd = fd;
+  writer->is_stream = is_stream;
+  if (file != NULL)
+    setvbuf(file, NULL, _IOFBF, PCAP_WRITE_BUF);
+  else if ((writer->buf = malloc(PCAP_WRITE_BUF)) == NULL)
+    fatal("Allocating pcap buffer.");
+
+  memset(&header, 0, sizeof(header));
+  header.magic = PCAP_MAGIC;
+  header.version_major = 2;
+  header.version_minor = 4;
+  header.snaplen = PCAP_SNAPLEN;
+  header.linktype = PCAP_LINKTYPE_ETHERNET;
+  if (file != NULL) {
+    if (fwrite(&header, sizeof(header), 1, file) != 1)
+      syserr("Writing pcap header.");
+  } else {
+    memcpy(writer->buf, &header, sizeof(header));
+    writer->len = sizeof(header);
+  }
+  pcap_flush(writer);
+
+  return writer;
+}
+
+
+/* Opens pcap:<in>[,<out>], pipe: or unix:<path>; in or out of pcap: may
+ * be empty */
+void open_backend(const char* spec, struct frame_backend* backend) {
+  struct sockaddr_un addr;
+  const char* path;
+  const char* comma;
+  char in[PATH_MAX];
+  FILE* file;
+  int fd;
+
+  memset(backend, 0, sizeof(*backend));
+  backend->kind = backend_kind(spec);
+
+  switch (backend->kind) {
+    case BACKEND_PCAP:
+      path = spec + 5;
+      comma = strchr(path, ',');
+      if (comma == NULL)
+        comma = path + strlen(path);
+      if (comma - path >= PATH_MAX)
+        fatal("Too long file name %s.", spec);
+      memcpy(in, path, comma - path);
+      in[comma - path] = '\0';
+
+      if (strlen(in) > 0) {
+        fd = open(in, O_RDONLY);
+        if (fd == -1)
+          syserr("Opening %s", in);
+        backend->reader = new_reader(fd, 1);
+      }
+      if (*comma == ',' && strlen(comma + 1) > 0) {
+        file = fopen(comma + 1, "w");
+        if (!file)
+          syserr("Creating %s", comma + 1);
+        backend->writer = new_writer(file, -1, 0);
+      }
+      if (backend->reader == NULL && backend->writer == NULL)
+        fatal("No file in %s.", spec);
+      break;
+
+    case BACKEND_PIPE:
+      backend->reader = new_reader(STDIN_FILENO, 1);
+      backend->writer = new_writer(stdout, -1, 1);
+      break;
+
+    case BACKEND_UNIX:
+      path = spec + 5;
+      memset(&addr, 0, sizeof(addr));
+      addr.sun_family = AF_UNIX;
+      if (strlen(path) == 0 || strlen(path) >= sizeof(addr.sun_path))
+        fatal("Wrong Unix socket path %s.", spec);
+      strcpy(addr.sun_path, path);
+
+      fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (fd == -1)
+        syserr("socket");
+      if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1)
+        syserr("Connecting to %s", path);
+
+      /* Both ways use MSG_DONTWAIT, a reader that does not keep up
+       * loses frames instead of stopping slijent */
+      backend->reader = new_reader(fd, 0);
+      backend->writer = new_writer(NULL, dup(fd), 1);
+      if (backend->writer->fd == -1)
+        syserr("dup");
+      break;
+
+    default:
+      fatal("%s is not a pcap backend.", spec);
+  }
+}
+
+
+/* Reads more data after the unread bytes, sets eof at the end */
+static void read_more(struct pcap_reader* reader) {
+  ssize_t r;
+
+  if (reader->start > 0) {
+    memmove(reader->buf, reader->buf + reader->start,
+      reader->end - reader->start);
+    reader->end -= reader->start;
+    reader->start = 0;
+  }
+
+  r = recv(reader->fd, reader->buf + reader->end,
+    PCAP_BUF_SIZE - reader->end, MSG_DONTWAIT);
+  if (r < 0 && errno == ENOTSOCK)
+    r = read(reader->fd, reader->buf + reader->end,
+      PCAP_BUF_SIZE - reader->end);
+
+  if (r == 0)
+    reader->eof = 1;
+  else if (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+    syserr("Reading pcap input");
+  else if (r > 0)
+    reader->end += r;
+}
+
+
+static uint32_t host_order(const struct pcap_reader* reader, uint32_t value) {
+  return reader->swapped ? __builtin_bswap32(value) : value;
+}
+
+
+/* Checks the file header once it has been read */
+static void read_file_header(struct pcap_reader* reader) {
+  struct pcap_file_header header;
+
+  memcpy(&header, reader->buf + reader->start, sizeof(header));
+  reader->start += sizeof(header);
+
+  if (header.magic == PCAP_MAGIC || header.magic == PCAP_MAGIC_NSEC) {
+    reader->swapped = 0;
+  } else if (__builtin_bswap32(header.magic) == PCAP_MAGIC ||
+             __builtin_bswap32(header.magic) == PCAP_MAGIC_NSEC) {
+    reader->swapped = 1;
+  } else {
+    fatal("Input is not a pcap file (pcapng is not supported).");
+  }
+  reader->nsec = (host_order(reader, header.magic) == PCAP_MAGIC_NSEC);
+  if (host_order(reader, header.linktype) != PCAP_LINKTYPE_ETHERNET)
+    fatal("Capture of link type %u, only Ethernet is supported.",
+      host_order(reader, header.linktype));
+  reader->header_done = 1;
+}
+
+
+/* Returns 1 and the next frame without consuming it, 0 if no whole frame
+ * can be read now (then eof tells whether more will come) */
+int pcap_peek(struct pcap_reader* reader, char** frame, int* len,
+  uint64_t* time_ns) {
+  struct pcap_record_header record;
+  int size;
+
+  for (;;) {
+    size = reader->end - reader->start;
+    if (!reader->header_done) {
+      if (size >= (int) sizeof(struct pcap_file_header)) {
+        read_file_header(reader);
+        continue;
+      }
+    } else if (size >= (int) sizeof(record)) {
+      memcpy(&record, reader->buf + reader->start, sizeof(record));
+      *len = host_order(reader, record.incl_len);
+      if (*len > PCAP_BUF_SIZE - (int) sizeof(record) || *len < 0)
+        fatal("Damaged pcap record of %d bytes.", *len);
+      if (size >= (int) sizeof(record) + *len) {
+        *frame = reader->buf + reader->start + sizeof(record);
+        *time_ns = host_order(reader, record.ts_sec) * 1000000000ULL +
+          host_order(reader, record.ts_frac) * (reader->nsec ? 1 : 1000);
+        return 1;
+      }
+    }
+
+    /* read_more() moves unread bytes to the front, so progress is in
+     * their count, not in end */
+    if (reader->eof)
+      return 0;
+    size = reader->end - reader->start;
+    read_more(reader);
+    if (reader->end - reader->start == size && !reader->eof)
+      return 0;
+  }
+}
+
+
+/* Drops the frame returned by pcap_peek */
+void pcap_consume(struct pcap_reader* reader) {
+  struct pcap_record_header record;
+
+  memcpy(&record, reader->buf + reader->start, sizeof(record));
+  reader->start += sizeof(record) + host_order(reader, record.incl_len);
+  reader->frames += 1;
+}
+
+
+/* Sends what the socket takes now of the unsent bytes, waiting up to
+ * PCAP_CLOSE_SEC if wait is set */
+static void send_pending(struct pcap_writer* writer, int wait) {
+  struct timeval timeout = { PCAP_CLOSE_SEC, 0 };
+  ssize_t sent;
+  int done = 0;
+
+  if (wait && setsockopt(writer->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+      sizeof(timeout)) == -1)
+    syserr("Setting pcap output timeout");
+
+  while (done < writer->len) {
+    sent = send(writer->fd, writer->buf + done, writer->len - done,
+      MSG_NOSIGNAL | (wait ? 0 : MSG_DONTWAIT));
+    if (sent == -1 && errno == EINTR)
+      continue;
+    if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      if (wait)
+        fprintf(stderr, "Dropping %d bytes of pcap output.\n",
+          writer->len - done);
+      break;
+    }
+    if (sent == -1)
+      syserr("Writing pcap output");
+    done += sent;
+  }
+  memmove(writer->buf, writer->buf + done, writer->len - done);
+  writer->len -= done;
+}
+
+
+/* Appends frame with the current time. Returns 0, or -1 if a socket has
+ * no room for it and it is dropped */
+int pcap_write(struct pcap_writer* writer, const char* frame, int len) {
+  struct pcap_record_header record;
+  struct timespec now;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  record.ts_sec = now.tv_sec;
+  record.ts_frac = now.tv_nsec / 1000;
+  record.incl_len = len;
+  record.orig_len = len;
+
+  if (writer->file == NULL) {
+    if (writer->len + (int) sizeof(record) + len > PCAP_WRITE_BUF)
+      send_pending(writer, 0);
+    if (writer->len + (int) sizeof(record) + len > PCAP_WRITE_BUF) {
+      writer->drops += 1;
+      return -1;
+    }
+    memcpy(writer->buf + writer->len, &record, sizeof(record));
+    memcpy(writer->buf + writer->len + sizeof(record), frame, len);
+    writer->len += sizeof(record) + len;
+  } else if (fwrite(&record, sizeof(record), 1, writer->file) != 1 ||
+             fwrite(frame, len, 1, writer->file) != 1) {
+    syserr("Writing pcap record");
+  }
+  writer->frames += 1;
+  writer->dirty = 1;
+  return 0;
+}
+
+
+/* Writes buffered records; a socket keeps what it does not take now and
+ * stays dirty */
+void pcap_flush(struct pcap_writer* writer) {
+  if (writer->file == NULL) {
+    send_pending(writer, 0);
+    writer->dirty = (writer->len > 0);
+    return;
+  }
+  if (fflush(writer->file) != 0)
+    syserr("Writing pcap output");
+  writer->dirty = 0;
+}
+
+
+void close_backend(struct frame_backend* backend) {
+  if (backend->reader != NULL) {
+    if (backend->reader->fd != STDIN_FILENO)
+      close(backend->reader->fd);
+    free(backend->reader->buf);
+    free(backend->reader);
+  }
+  if (backend->writer != NULL && backend->writer->file == NULL) {
+    send_pending(backend->writer, 1);
+    close(backend->writer->fd);
+    free(backend->writer->buf);
+    free(backend->writer);
+  } else if (backend->writer != NULL) {
+    pcap_flush(backend->writer);
+    if (backend->writer->file != stdout)
+      fclose(backend->writer->file);
+    free(backend->writer);
+  }
+  backend->reader = NULL;
+  backend->writer = NULL;
+}
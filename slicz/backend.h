@@ -0,0 +1,102 @@
+/*
+ * Author: Konrad Słoniewski
+ * Date:   18 August 2013
+ */
+
+#ifndef _BACKEND_H
+#define _BACKEND_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "err.h"
+
+/* Definitions */
+#define BACKEND_TAP 0              /* kinds of frame backends */
+#define BACKEND_PCAP 1             /* pcap:<in>[,<out>], files */
+#define BACKEND_PIPE 2             /* pipe:, pcap streams on stdin/stdout */
+#define BACKEND_UNIX 3             /* unix:<path>, pcap streams both ways */
+#define PCAP_MAGIC 0xa1b2c3d4      /* microsecond timestamps */
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+#define PCAP_LINKTYPE_ETHERNET 1
+#define PCAP_SNAPLEN 65535
+#define PCAP_BUF_SIZE (256 * 1024) /* read at once, bigger than a record */
+#define PCAP_WRITE_BUF (64 * 1024)
+#define PCAP_CLOSE_SEC 1           /* for a socket reader to take the rest */
+
+/* Structures */
+
+/* pcap file format, https://wiki.wireshark.org/Development/LibpcapFileFormat */
+struct pcap_file_header {
+  uint32_t magic;
+  uint16_t version_major;
+  uint16_t version_minor;
+  int32_t thiszone;
+  uint32_t sigfigs;
+  uint32_t snaplen;
+  uint32_t linktype;
+};
+
+struct pcap_record_header {
+  uint32_t ts_sec;
+  uint32_t ts_frac;                /* microseconds or nanoseconds */
+  uint32_t incl_len;
+  uint32_t orig_len;
+};
+
+/* Frames of a pcap file or stream, in order */
+struct pcap_reader {
+  int fd;
+  int is_file;                     /* regular file, read without polling */
+  char* buf;
+  int start;                       /* unread bytes are buf[start, end) */
+  int end;
+  int header_done;
+  int swapped;                     /* written on a host of other byte order */
+  int nsec;
+  int eof;
+  unsigned long long frames;
+};
+
+/* Writer of a file or stdout, or of a Unix socket (file is NULL then).
+ * A socket is never waited for: frames its reader has no room for are
+ * dropped whole, so the stream stays valid */
+struct pcap_writer {
+  FILE* file;
+  int fd;                          /* socket, -1 for a file */
+  char* buf;                       /* unsent bytes of the socket */
+  int len;
+  int is_stream;                   /* flushed after every batch */
+  int dirty;
+  unsigned long long frames;
+  unsigned long long drops;
+};
+
+/* Frames of an interface that is not a TAP */
+struct frame_backend {
+  int kind;
+  struct pcap_reader* reader;      /* to the switch, NULL if none */
+  struct pcap_writer* writer;      /* from the switch, NULL if none */
+};
+
+/* Functions */
+int backend_kind(const char* spec);
+void open_backend(const char* spec, struct frame_backend* backend);
+int pcap_peek(struct pcap_reader* reader, char** frame, int* len,
+  uint64_t* time_ns);
+void pcap_consume(struct pcap_reader* reader);
+int pcap_write(struct pcap_writer* writer, const char* frame, int len);
+void pcap_flush(struct pcap_writer* writer);
+void close_backend(struct frame_backend* backend);
+
+#endif
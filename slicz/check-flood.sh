@@ -0,0 +1,51 @@
+#!/bin/sh
+#
+# Author: Konrad Słoniewski
+# Date:   18 August 2013
+#
+# Broadcast between two interfaces of one slijent: both send from one UDP
+# address, and the switch has to flood to the other one anyway.
+# Needs no root: the interfaces are pcap files. Run by "make check-flood".
+
+DIR=$(mktemp -d)
+CONTROL=42599
+trap 'kill $SWITCH $CLIENT 2>/dev/null; rm -rf $DIR' EXIT
+
+# pcap file header and 60 byte records at second <ts> (little endian)
+header() {
+  printf '\324\303\262\241\002\000\004\000\000\000\000\000\000\000\000\000'
+  printf '\377\377\000\000\001\000\000\000'
+}
+record() {
+  printf "\\$1\\000\\000\\000\\000\\000\\000\\000"
+  printf '\074\000\000\000\074\000\000\000'
+  printf "$2$3\\010\\000"
+  head -c 46 /dev/zero
+}
+A='\002\000\000\000\000\001'
+B='\002\000\000\000\000\002'
+NOBODY='\002\000\000\000\000\011'
+BROADCAST='\377\377\377\377\377\377'
+
+# Both say hello first, so the switch learns them; then A broadcasts
+{ header; record 000 $NOBODY $A; record 002 $BROADCAST $A; } > $DIR/a.pcap
+{ header; record 000 $NOBODY $B; } > $DIR/b.pcap
+
+./slicz -c $CONTROL -p 42501//1 -p 42502//1 > $DIR/slicz.log 2>&1 &
+SWITCH=$!
+sleep 0.5
+./slijent -i pcap:$DIR/a.pcap,$DIR/a.out=localhost:42501 \
+  -i pcap:$DIR/b.pcap,$DIR/b.out=localhost:42502 > $DIR/slijent.log 2>&1 &
+CLIENT=$!
+sleep 3
+kill -INT $CLIENT
+sleep 0.5
+
+if od -An -tx1 -v $DIR/b.out | tr -d ' \n' |
+    grep -q ffffffffffff020000000001; then
+  echo "OK: broadcast of one interface reached the other one"
+else
+  echo "FAILED: broadcast of one interface did not reach the other one"
+  cat $DIR/slicz.log $DIR/slijent.log
+  exit 1
+fi
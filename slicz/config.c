@@ -0,0 +1,326 @@
+/*
+ * Author: Konrad Słoniewski
+ * Date:   18 August 2013
+ */
+
+#include "config.h"
+#include "control.h"
+
+/* Structs */
+
+/* Port whose client name is being resolved */
+struct pending_name {
+  struct transaction* tx;
+  int entry;
+};
+
+/* Transaction being applied by forwarding thread */
+struct commit {
+  struct transaction* tx;
+  int* last;                 /* entry of a port number that counts */
+};
+
+
+/* Attributes */
+
+static char message[256];    /* error with line or port number */
+
+
+/* Functions */
+
+struct transaction* new_transaction() {
+  struct transaction* tx;
+
+  tx = calloc(1, sizeof(*tx));
+  if (tx == NULL)
+    syserr("Allocating transaction.");
+  return tx;
+}
+
+
+/* Transaction waiting for names is freed by the last of them */
+void free_transaction(struct transaction* tx) {
+  if (tx->pending > 0) {
+    tx->orphan = 1;
+    tx->ready = NULL;
+    return;
+  }
+  free(tx->ports);
+  free(tx);
+}
+
+
+/* Client name of a staged port is resolved */
+static void name_resolved(int ok, unsigned long s_addr, void* arg) {
+  struct pending_name* name = (struct pending_name*) arg;
+  struct transaction* tx = name->tx;
+  void (*ready)(struct transaction* tx, void* arg);
+
+  tx->pending -= 1;
+  if (tx->orphan) {
+    if (tx->pending == 0)
+      free_transaction(tx);
+    free(name);
+    return;
+  }
+
+  if (ok) {
+    tx->ports[name->entry].sender_addr = s_addr;
+  } else if (!tx->failed) {
+    snprintf(tx->message, sizeof(tx->message),
+      "Cannot resolve client of port %d", tx->ports[name->entry].number);
+    tx->failed = 1;
+  }
+  free(name);
+
+  if (tx->pending == 0 && tx->ready != NULL) {
+    ready = tx->ready;
+    tx->ready = NULL;
+    ready(tx, tx->ready_arg);
+  }
+}
+
+
+/* Calls ready once client names of all staged ports are resolved, at
+ * once if none is pending */
+void when_resolved(struct transaction* tx,
+  void (*ready)(struct transaction* tx, void* arg), void* arg) {
+  if (tx->pending == 0) {
+    ready(tx, arg);
+    return;
+  }
+  tx->ready = ready;
+  tx->ready_arg = arg;
+}
+
+
+/* Room for one more entry of the transaction */
+static port_t* next_entry(struct transaction* tx) {
+  port_t* ports;
+  int capacity;
+
+  if (tx->count == tx->capacity) {
+    capacity = (tx->capacity == 0) ? 64 : tx->capacity * 2;
+    ports = realloc(tx->ports, capacity * sizeof(port_t));
+    if (ports == NULL)
+      syserr("Allocating configuration.");
+    tx->ports = ports;
+    tx->capacity = capacity;
+  }
+  return &tx->ports[tx->count];
+}
+
+
+/* Validates one "number/[client_addr:client_port]/VLANs" configuration and
+ * adds it to the transaction. Returns 0, or -1 and sets error */
+int stage_port(struct transaction* tx, const char* raw, const char** error) {
+  char host[NI_MAXHOST];
+  struct pending_name* name;
+  port_t *port;
+  int result;
+
+  port = next_entry(tx);
+  if (read_port(raw, port, host, error) == -1) {
+    tx->failed = 1;
+    return -1;
+  }
+
+  if (host[0] != '\0') {
+    name = malloc(sizeof(*name));
+    if (name == NULL)
+      syserr("Allocating configuration.");
+    name->tx = tx;
+    name->entry = tx->count;
+    result = resolve_name(host, &port->sender_addr, name_resolved, name);
+    if (result == -1) {
+      free(name);
+      *error = "Cannot resolve client address";
+      tx->failed = 1;
+      return -1;
+    }
+    if (result == 0)
+      free(name);
+    else
+      tx->pending += 1;
+  }
+
+  tx->count += 1;
+  return 0;
+}
+
+
+/* Adds a port read and checked elsewhere, with resolved client address */
+void stage_entry(struct transaction* tx, const port_t* port) {
+  *next_entry(tx) = *port;
+  tx->count += 1;
+}
+
+
+/* Stages every port of a configuration file, one port per line like for
+ * setconfig. Blank lines and lines starting with '#' are skipped */
+int stage_file(struct transaction* tx, const char* path, const char** error) {
+  FILE* file;
+  char *line = NULL, *start;
+  size_t size = 0;
+  ssize_t len;
+  int number = 0;
+  const char* port_error;
+
+  file = fopen(path, "r");
+  if (file == NULL) {
+    snprintf(message, sizeof(message), "Cannot open %s (%s)", path,
+      strerror(errno));
+    *error = message;
+    tx->failed = 1;
+    return -1;
+  }
+
+  while ((len = getline(&line, &size, file)) != -1) {
+    number += 1;
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+      line[--len] = '\0';
+    start = line;
+    while (*start == ' ' || *start == '\t')
+      start += 1;
+    if (*start == '\0' || *start == '#')
+      continue;
+    if (!strncmp(start, "setconfig ", 10))
+      start += 10;
+
+    if (stage_port(tx, start, &port_error) == -1) {
+      snprintf(message, sizeof(message), "Line %d: %s", number, port_error);
+      *error = message;
+      free(line);
+      fclose(file);
+      return -1;
+    }
+  }
+
+  free(line);
+  fclose(file);
+  return 0;
+}
+
+
+/* Socket of a port with its transport. Returns socket index, or -1 */
+static int open_socket(const port_t* entry) {
+  switch (entry->type) {
+    case PORT_SHM:
+      return init_shm_port(entry->number);
+    case PORT_TAP:
+      return init_tap_port(entry->number, entry->device);
+    case PORT_PACKET:
+      return init_packet_port(entry->number, entry->device);
+    default:
+      return init_socket(entry->number);
+  }
+}
+
+
+/* Changes ports as staged, on forwarding thread */
+static void apply_ports(void* arg) {
+  struct commit* commit = (struct commit*) arg;
+  struct transaction* tx = commit->tx;
+  int* last = commit->last;
+  int i, index;
+  port_t *entry, *port;
+
+  for (i = 0; i < tx->count; i += 1) {
+    entry = &tx->ports[i];
+    if (last[entry->number] != i)
+      continue;
+    port = get_port(entry->number);
+
+    if (port_removed(entry)) {
+      if (port != NULL) {
+        index = port->index;
+        del_port(entry->number);
+        if (index != -1)
+          delete_event(index);
+      }
+      continue;
+    }
+
+    if (port == NULL) {
+      port = create_port(entry->number);
+      port->index = entry->index;
+      start_event(port->index, base, udp_manage);
+    } else if (entry->index != -1) {
+      /* Transport changed, frames queued on the old one are dropped */
+      if (port->index != -1)
+        delete_event(port->index);
+      port->index = entry->index;
+      start_event(port->index, base, udp_manage);
+    }
+    port->type = entry->type;
+    memcpy(port->device, entry->device, sizeof(port->device));
+    port->status = entry->status;
+    port->sender_addr = entry->sender_addr;
+    port->sender_port = entry->sender_port;
+    port->untagged_vlan = entry->untagged_vlan;
+    set_vlans(port, entry->vlans);
+  }
+
+  flows_config_changed();
+}
+
+
+/* Applies all staged ports, client names must be resolved. Sockets of new
+ * ports are bound first, so a busy UDP port leaves the switch unchanged.
+ * The transaction is empty afterwards. Returns 0, or -1 and sets error */
+int commit_transaction(struct transaction* tx, const char** error) {
+  struct commit commit;
+  int *last;
+  int i;
+  port_t *entry;
+
+  if (tx->failed || tx->pending > 0) {
+    *error = (tx->message[0] != '\0') ? tx->message :
+      "Transaction has errors";
+    tx->count = 0;
+    return -1;
+  }
+
+  /* Only the last configuration of a port counts */
+  last = malloc((MAX_PORT_NUMBER + 1) * sizeof(int));
+  if (last == NULL)
+    syserr("Allocating configuration.");
+  for (i = 0; i < tx->count; i += 1)
+    last[tx->ports[i].number] = i;
+
+  /* Sockets of new ports and of ports changing transport */
+  for (i = 0; i < tx->count; i += 1) {
+    entry = &tx->ports[i];
+    entry->index = -1;
+    if (last[entry->number] != i || port_removed(entry) ||
+        (get_port(entry->number) != NULL &&
+         same_transport(get_port(entry->number), entry)))
+      continue;
+
+    entry->index = open_socket(entry);
+    if (entry->index == -1) {
+      snprintf(message, sizeof(message), "Cannot open port %d",
+        entry->number);
+      *error = message;
+      while (--i >= 0)
+        if (tx->ports[i].index != -1)
+          release_socket(tx->ports[i].index);
+      free(last);
+      tx->count = 0;
+      return -1;
+    }
+  }
+
+  /* Nothing can fail now */
+  commit.tx = tx;
+  commit.last = last;
+  data_plane_call(apply_ports, &commit);
+
+  for (i = 0; i < tx->count; i += 1)
+    if (last[tx->ports[i].number] == i)
+      watch_config(tx->ports[i].number);
+
+  free(last);
+  tx->count = 0;
+  return 0;
+}
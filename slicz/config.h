@@ -0,0 +1,51 @@
+/*
+ * Author: Konrad Słoniewski
+ * Date:   18 August 2013
+ */
+
+#ifndef _CONFIG_H
+#define _CONFIG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ports.h"
+#include "forward.h"
+#include "flows.h"
+#include "resolve.h"
+#include "planes.h"
+#include "watch.h"
+#include "shmport.h"
+#include "tapport.h"
+#include "packetport.h"
+#include "err.h"
+
+/* Structures */
+
+/* Port configurations validated but not applied yet. The last entry of a
+ * port wins. Client names are resolved in background, the transaction can
+ * be committed once none is pending */
+struct transaction {
+  int count;
+  int capacity;
+  port_t* ports;
+  int failed;                /* an entry was rejected, commit refuses */
+  int pending;               /* client names being resolved */
+  int orphan;                /* freed while names were being resolved */
+  void (*ready)(struct transaction* tx, void* arg);
+  void* ready_arg;
+  char message[256];         /* why a name could not be resolved */
+};
+
+/* Functions */
+struct transaction* new_transaction();
+void free_transaction(struct transaction* tx);
+int stage_port(struct transaction* tx, const char* raw, const char** error);
+void stage_entry(struct transaction* tx, const port_t* port);
+int stage_file(struct transaction* tx, const char* path, const char** error);
+void when_resolved(struct transaction* tx,
+  void (*ready)(struct transaction* tx, void* arg), void* arg);
+int commit_transaction(struct transaction* tx, const char** error);
+
+#endif
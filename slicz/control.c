@@ -5,6 +5,37 @@
 
 #include "control.h"
 
+struct connection_description clients[MAX_CONTROL_CONNECTIONS];
+struct event_base* control_base;
+
+/* Control commands, chosen by prefix of a line */
+struct command {
+  const char* name;
+  size_t len;
+  void (*handler)(struct connection_description* cl, struct evbuffer* out,
+    const char* command);
+};
+
+#define COMMAND(name, handler) { name, sizeof(name) - 1, handler }
+
+static const struct command commands[] = {
+  COMMAND("setconfig", set_config),
+  COMMAND("getconfig", get_config),
+  COMMAND("loadconfig", load_config),
+  COMMAND("begin", begin_config),
+  COMMAND("commit", commit_config),
+  COMMAND("abort", abort_config),
+  COMMAND("shutdown!", shutdown_switch),
+  COMMAND("counters", counters),
+  COMMAND("macs", macs),
+  COMMAND("latency", latency),
+  COMMAND("priority", priority),
+  COMMAND("watch", watch),
+  COMMAND("unwatch", unwatch),
+  { NULL, 0, NULL }
+};
+
+
 /* Initializes clients table */
 void init_clients() {
   memset(clients, 0, sizeof(clients));
@@ -14,97 +45,145 @@ void init_clients() {
 struct connection_description *get_client_slot() {
   int i;
   for (i = 0; i < MAX_CONTROL_CONNECTIONS; i++)
-    if (!clients[i].ev)
+    if (!clients[i].bev)
       return &clients[i];
   return NULL;
 }
 
 
-/* Service control connection */
-void client_manage(evutil_socket_t sock, short ev, void *arg) {
-  int bytes_read;
-  char buf[BUF_SIZE+1];
+/* Commit of a closed connection, nobody gets the reply */
+static void commit_detached(struct transaction* tx, void* arg) {
+  const char* error;
+
+  if (commit_transaction(tx, &error) == -1)
+    fprintf(stderr, "Configuration not applied (%s).\n", error);
+  free_transaction(tx);
+}
+
+
+/* Ends control connection, unsent replies are dropped. Commit waiting for
+ * client names is still applied */
+static void close_client(struct connection_description *cl) {
+  if (cl->watcher != NULL)
+    watch_stop(cl->watcher);
+  cl->watcher = NULL;
+  bufferevent_free(cl->bev);
+  cl->bev = NULL;
+  if (cl->tx != NULL)
+    free_transaction(cl->tx);
+  cl->tx = NULL;
+  if (cl->committing != NULL)
+    when_resolved(cl->committing, commit_detached, NULL);
+  cl->committing = NULL;
+  cl->closing = 0;
+  cl->held = 0;
+}
+
+
+/* Closes connection whose client is gone once all replies are sent */
+static void client_flushed(struct bufferevent *bev, void *arg) {
+  close_client((struct connection_description *) arg);
+}
+
+
+/* Client has closed its side, replies are still sent */
+static void finish_client(struct connection_description *cl) {
+  if (evbuffer_get_length(bufferevent_get_output(cl->bev)) == 0) {
+    close_client(cl);
+  } else {
+    bufferevent_disable(cl->bev, EV_READ);
+    bufferevent_setcb(cl->bev, NULL, client_flushed, client_event, cl);
+  }
+}
+
+
+/* Executes one command line, reply goes to out */
+static void run_command(struct connection_description* cl,
+  struct evbuffer* out, const char* line) {
+  const struct command* command;
+  struct timespec started;
+
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  for (command = commands; command->name != NULL; command += 1)
+    if (!strncmp(line, command->name, command->len))
+      break;
+
+  if (command->handler != NULL)
+    command->handler(cl, out, line);
+  else
+    evbuffer_add(out, "ERR: Unknown command\n", 21);
+  metrics_command_done(&started);
+}
+
+
+/* Executes complete command lines. A commit waiting for client names
+ * stops it, later commands wait for its reply */
+static void run_commands(struct connection_description *cl,
+  int acknowledged) {
+  struct evbuffer *in, *out;
+  char *line;
+  size_t len;
+
+  in = bufferevent_get_input(cl->bev);
+  out = bufferevent_get_output(cl->bev);
+
+  while (cl->committing == NULL &&
+         (line = evbuffer_readln(in, &len, EVBUFFER_EOL_LF)) != NULL) {
+    /* Sending response */
+    if (!acknowledged)
+      evbuffer_add(out, "OK\n", 3);
+    acknowledged = 1;
+
+    run_command(cl, out, line);
+    free(line);
+  }
+}
+
+
+/* Service control connection - every complete line is a command, the
+ * rest waits for more data */
+void client_manage(struct bufferevent *bev, void *arg) {
   struct connection_description *cl;
-  int command_count;
-  regex_t reg_set, reg_get, reg_count, reg_shut;
-  char **commands;
-  char *command;
-  int i;
 
   cl = (struct connection_description *) arg;
+  if (cl->committing == NULL)
+    run_commands(cl, 0);
+
+  if (evbuffer_get_length(bufferevent_get_input(bev)) > MAX_COMMAND_LEN) {
+    fprintf(stderr, "Too long command from %s:%d. Closing connection.\n",
+      inet_ntoa(cl->address.sin_addr), ntohs(cl->address.sin_port));
+    close_client(cl);
+  }
+}
 
-  /* Checking read */
-  bytes_read = read(sock, buf, BUF_SIZE);
-  if (bytes_read <= 0) {
-    if (bytes_read < 0) {
-      fprintf(stderr,
-        "Error (%s) while reading data from %s:%d. Closing connection.\n",
-        strerror(errno), inet_ntoa(cl->address.sin_addr),
-        ntohs(cl->address.sin_port));
-    } else {
-      fprintf(stderr, "Connection from %s:%d closed.\n",
-        inet_ntoa(cl->address.sin_addr), ntohs(cl->address.sin_port));
-    }
 
-    /* Ending the event */
-    if (event_del(cl->ev) == -1)
-      syserr("Deleting the event.");
-    event_free(cl->ev);
-    if(close(sock) == -1)
-      syserr("Closing sock.");
-    cl->ev = NULL;
+/* End of control connection or error on it */
+void client_event(struct bufferevent *bev, short events, void *arg) {
+  struct connection_description *cl;
+
+  cl = (struct connection_description *) arg;
 
+  if (events & BEV_EVENT_ERROR) {
+    fprintf(stderr,
+      "Error (%s) on connection from %s:%d. Closing connection.\n",
+      evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()),
+      inet_ntoa(cl->address.sin_addr), ntohs(cl->address.sin_port));
+    close_client(cl);
     return;
   }
 
-  /* Sending response */
-  buf[bytes_read] = 0;
-  write(sock, "OK\n", 3);
+  if (events & BEV_EVENT_EOF) {
+    fprintf(stderr, "Connection from %s:%d closed.\n",
+      inet_ntoa(cl->address.sin_addr), ntohs(cl->address.sin_port));
 
-  /* REGEX */
-  regcomp(&reg_set, "^setconfig", 0);
-  regcomp(&reg_get, "^getconfig", 0);
-  regcomp(&reg_count, "^counters", 0);
-  regcomp(&reg_shut, "^shutdown!", 0);
- 
-  /* Counting number of commands like "setconfig 1234//1,2t\n getconfig\n" */ 
-  command_count = count_occurrences(buf, '\n'); /* +1 ? */
-  
-  commands = split(buf, "\n", command_count);
-  fprintf(stderr, "Received instruction - %s\n", buf);
-  fprintf(stderr, "Number of commands: %d\n", command_count);
-
-  /* Processing each line of commands separately */
-  for (i = 0; i < command_count; ++i) {
-    command = commands[i];
-    fprintf(stderr, "Command = %s\n", command);
- 
-    /* Choosing option */
-    if (!regexec(&reg_set, command, 0, NULL, 0)) {
-      set_config(sock, command);
-    } else if (!regexec(&reg_get, command, 0, NULL, 0)) {
-      get_config(sock);
-    } else if (!regexec(&reg_shut, command, 0, NULL, 0)) {
-      event_del(listener_socket_event);
-      event_free(listener_socket_event);
-
-      for (i = 0; i < MAX_SOCKETS; ++i)
-        delete_event(i);
-    } else if (!regexec(&reg_count, command, 0, NULL, 0)) {
-      counters(sock);
-    }
-    else {
-      write(sock, "ERR: Unknown command\n", 21);
+    /* Commands sent before closing still run once a commit is done */
+    if (cl->committing != NULL) {
+      bufferevent_disable(bev, EV_READ);
+      cl->closing = 1;
+    } else {
+      finish_client(cl);
     }
   }
-  printf("Position END");
-
-  free_array(commands, command_count);
-
-  regfree(&reg_set);
-  regfree(&reg_get);
-  regfree(&reg_shut);
-  regfree(&reg_count);
 }
 
 
@@ -115,7 +194,7 @@ void listener_manage(evutil_socket_t sock, short ev, void *arg) {
   evutil_socket_t connection_socket;
   struct event_base *base;
   struct connection_description *cl;
-  struct event *an_event;
+  struct bufferevent *bev;
 
   /* Accepting control user */
   base = (struct event_base *) arg;
@@ -123,8 +202,10 @@ void listener_manage(evutil_socket_t sock, short ev, void *arg) {
   addr_size = sizeof(struct sockaddr_in);
   connection_socket = accept(sock, (struct sockaddr *) &sin, &addr_size);
   
-  if (connection_socket == -1)
-    syserr("Accepting control connection.");
+  if (connection_socket == -1) {
+    fprintf(stderr, "Accepting control connection (%s).\n", strerror(errno));
+    return;
+  }
 
   cl = get_client_slot();
   if (!cl) {
@@ -135,19 +216,99 @@ void listener_manage(evutil_socket_t sock, short ev, void *arg) {
     return;
   }
 
-  memcpy(&(cl->address), &sin, sizeof(struct sockaddr_in));
-  cl->sock = connection_socket;
+  if (evutil_make_socket_nonblocking(connection_socket))
+    syserr("Making control connection nonblocking.");
 
-  an_event = event_new(base, connection_socket, EV_READ|EV_PERSIST, 
-    client_manage, (void *) cl);
-  if (!an_event)
-    syserr("Creating event for control user");
-  cl->ev = an_event;
-  if (event_add(an_event, NULL) == -1)
-    syserr("Adding event to a base.");
+  memcpy(&(cl->address), &sin, sizeof(struct sockaddr_in));
+  cl->tx = NULL;
+  cl->committing = NULL;
+  cl->closing = 0;
+  cl->held = 0;
+  cl->watcher = NULL;
+
+  bev = bufferevent_socket_new(base, connection_socket, BEV_OPT_CLOSE_ON_FREE);
+  if (!bev)
+    syserr("Creating bufferevent for control user");
+  cl->bev = bev;
+  bufferevent_setcb(bev, client_manage, NULL, client_event, (void *) cl);
+  if (bufferevent_enable(bev, EV_READ|EV_WRITE) == -1)
+    syserr("Enabling control connection.");
 
   /* Welcome message */
-  write(connection_socket, "SLICZ\n", 6);
+  evbuffer_add(bufferevent_get_output(bev), "SLICZ\n", 6);
+}
+
+
+/* Closes all ports and ends forwarding, on forwarding thread */
+static void stop_forwarding(void* arg) {
+  int i;
+
+  clean_metrics();
+  clean_stats();
+  for (i = 0; i < MAX_SOCKETS; ++i)
+    delete_event(i);
+  stop_data_plane();
+}
+
+
+/* Stops accepting connections and forwarding, the control thread ends
+ * when control connections are closed */
+static void stop_switch() {
+  if (listener_socket_event != NULL) {
+    evutil_closesocket(event_get_fd(listener_socket_event));
+    event_free(listener_socket_event);
+    listener_socket_event = NULL;
+  }
+  clean_resolver();             /* name server sockets */
+  stop_snapshots();
+  stop_upgrades();
+  stop_local_clients();
+  data_plane_call(stop_forwarding, NULL);
+}
+
+
+void shutdown_switch(struct connection_description* cl, struct evbuffer* out,
+  const char* command) {
+  save_snapshot();
+  stop_switch();
+}
+
+
+/* Switch was handed over to a new process. Replies are still sent to
+ * control connections, then they are closed */
+void leave_switch() {
+  int i;
+
+  for (i = 0; i < MAX_CONTROL_CONNECTIONS; i += 1) {
+    if (clients[i].bev == NULL)
+      continue;
+    clients[i].held = 0;
+    if (clients[i].committing != NULL)
+      close_client(&clients[i]);
+    else
+      finish_client(&clients[i]);
+  }
+  stop_switch();
+}
+
+
+/* Control connections stop or go on reading commands */
+void hold_clients(int hold) {
+  struct connection_description* cl;
+  int i;
+
+  for (i = 0; i < MAX_CONTROL_CONNECTIONS; i += 1) {
+    cl = &clients[i];
+    if (cl->bev == NULL)
+      continue;
+    if (hold && (bufferevent_get_enabled(cl->bev) & EV_READ)) {
+      bufferevent_disable(cl->bev, EV_READ);
+      cl->held = 1;
+    } else if (!hold && cl->held) {
+      bufferevent_enable(cl->bev, EV_READ);
+      cl->held = 0;
+    }
+  }
 }
 
 
@@ -170,115 +331,344 @@ void handle_sigint(int signal) {
 }
 
 
-/* Setting configuration by control TCP connection */
-void set_config(evutil_socket_t sock, const char * buf) {
-  char** tmp;
-  int removal;
-  int port_number;
-  port_t* port;
-  int new_sock;
- 
-  /* Splitting message into parts - switch_port/client_ip:client_port/VLANs */ 
-  tmp = split(buf + 10, "/", 3);
-  removal = 0;
-  if (!strcmp(tmp[2], ""))
-    removal = 1;            /* Wrong instruction */
-
-  /* Parsing port */
-  port_number = atoi(tmp[0]);
-  port = get_port(port_number);
-
-  if (port == NULL) { 
-    /* No such port in swich - creating one */
-    port = parse_port(buf + 10);
-     
-    /* Creating new socket */
-    new_sock = init_socket(port->number);
-    ports[new_sock] = port->number;
-    
-    /* Starting event for a new socket management */
-    start_event(new_sock, base, udp_manage);  
-  } else if (!removal) { 
-    /* There is a port but new VLAN list is provided */
-    del_port(port_number);
-    delete_event(get_index(port_number));
-    
-    port = parse_port(buf + 10);
-    new_sock = init_socket(port_number);
-    start_event(new_sock, base, udp_manage);
-  } else {
-    del_port(atoi(tmp[0]));
-    delete_event(get_index(atoi(tmp[0])));
+/* Applies transaction and replies, tx is freed */
+static void commit_reply(struct evbuffer* out, struct transaction* tx) {
+  const char* error;
+
+  if (commit_transaction(tx, &error) == -1)
+    evbuffer_add_printf(out, "ERR: %s\n", error);
+  else
+    evbuffer_add(out, "END\n", 4);
+  free_transaction(tx);
+}
+
+
+/* Client names of a commit are resolved, commands after it can run */
+static void config_resolved(struct transaction* tx, void* arg) {
+  struct connection_description* cl;
+
+  cl = (struct connection_description*) arg;
+  cl->committing = NULL;
+  commit_reply(bufferevent_get_output(cl->bev), tx);
+
+  run_commands(cl, 1);
+  if (cl->committing == NULL && cl->closing)
+    finish_client(cl);
+}
+
+
+/* Commits transaction once its client names are resolved, the event loop
+ * keeps forwarding meanwhile */
+static void apply_config(struct connection_description* cl,
+  struct evbuffer* out, struct transaction* tx) {
+  if (tx->pending == 0) {
+    commit_reply(out, tx);
+    return;
+  }
+  cl->committing = tx;
+  when_resolved(tx, config_resolved, cl);
+}
+
+
+/* Setting configuration by control TCP connection. Inside a transaction
+ * the port is only validated and staged */
+void set_config(struct connection_description* cl, struct evbuffer* out,
+  const char* command) {
+  struct transaction* tx;
+  const char* error;
+  const char* raw = command + 9;
+
+  while (*raw == ' ')
+    raw += 1;
+
+  if (cl->tx != NULL) {
+    if (stage_port(cl->tx, raw, &error) == -1)
+      evbuffer_add_printf(out, "ERR: %s\n", error);
+    else
+      evbuffer_add(out, "END\n", 4);
+    return;
   }
 
-  write(sock, "END\n", 4);
-  free_array(tmp, 3);
+  tx = new_transaction();
+  if (stage_port(tx, raw, &error) == -1) {
+    evbuffer_add_printf(out, "ERR: %s\n", error);
+    free_transaction(tx);
+    return;
+  }
+  apply_config(cl, out, tx);
 }
 
-void get_config(evutil_socket_t sock) {
-  char buffer[BUF_SIZE+1];
-  char *buf = buffer;
 
-  port_t *port;
-  port = get_head();
+/* Starts a transaction, following setconfig commands are applied together
+ * by commit */
+void begin_config(struct connection_description* cl, struct evbuffer* out,
+  const char* command) {
+  if (cl->tx != NULL) {
+    evbuffer_add(out, "ERR: Transaction already started\n", 33);
+    return;
+  }
+  cl->tx = new_transaction();
+  evbuffer_add(out, "END\n", 4);
+}
 
-  while (port != NULL) {
-    memset(buffer, 0, sizeof(buffer));
-    print_config(port, &buf);
-    write(sock, buf, strlen(buf));
-    write(sock, "\n", 1);
-    port = port->next;
+
+/* Applies staged ports, nothing is applied if any of them was wrong */
+void commit_config(struct connection_description* cl, struct evbuffer* out,
+  const char* command) {
+  struct transaction* tx = cl->tx;
+
+  if (tx == NULL) {
+    evbuffer_add(out, "ERR: No transaction\n", 20);
+    return;
   }
-  write(sock, "END\n", 4);
+  cl->tx = NULL;
+  apply_config(cl, out, tx);
+}
+
+
+void abort_config(struct connection_description* cl, struct evbuffer* out,
+  const char* command) {
+  if (cl->tx == NULL) {
+    evbuffer_add(out, "ERR: No transaction\n", 20);
+    return;
+  }
+  free_transaction(cl->tx);
+  cl->tx = NULL;
+  evbuffer_add(out, "END\n", 4);
+}
+
+
+/* "loadconfig <file>" - applies a configuration file of the switch host as
+ * one transaction, or stages it if a transaction is open */
+void load_config(struct connection_description* cl, struct evbuffer* out,
+  const char* command) {
+  struct transaction* tx;
+  const char* error;
+  const char* path = command + 10;
+
+  while (*path == ' ')
+    path += 1;
+  if (*path == '\0') {
+    evbuffer_add(out, "ERR: Missing file name\n", 23);
+    return;
+  }
+
+  if (cl->tx != NULL) {
+    if (stage_file(cl->tx, path, &error) == -1)
+      evbuffer_add_printf(out, "ERR: %s\n", error);
+    else
+      evbuffer_add(out, "END\n", 4);
+    return;
+  }
+
+  tx = new_transaction();
+  if (stage_file(tx, path, &error) == -1) {
+    evbuffer_add_printf(out, "ERR: %s\n", error);
+    free_transaction(tx);
+    return;
+  }
+  apply_config(cl, out, tx);
+}
+
+/* Arguments of "getconfig" and "macs" */
+struct query {
+  int from;                  /* port numbers */
+  int to;
+  int vlan;                  /* -1 for all */
+  int limit;
+  unsigned long long cursor; /* 0 at start */
+};
+
+
+/* Reads optional "port=<n>[-<m>] vlan=<v> limit=<n> cursor=<c>" arguments
+ * after the command name. Returns 0, or -1 and sets error */
+static int read_query(const char* args, struct query* query, int max_limit,
+  const char** error) {
+  char *copy, *token, *save, *end;
+  unsigned long long value;
+
+  query->from = 0;
+  query->to = MAX_PORT_NUMBER;
+  query->vlan = -1;
+  query->limit = max_limit;
+  query->cursor = 0;
+
+  copy = strdup(args);
+  if (copy == NULL)
+    syserr("Reading query.");
+  *error = NULL;
+
+  for (token = strtok_r(copy, " ", &save); token != NULL && *error == NULL;
+       token = strtok_r(NULL, " ", &save)) {
+    if (!strncmp(token, "port=", 5)) {
+      query->from = strtol(token + 5, &end, 10);
+      query->to = query->from;
+      if (*end == '-')
+        query->to = strtol(end + 1, &end, 10);
+      if (end == token + 5 || *end != '\0' || query->from < 0 ||
+          query->to > MAX_PORT_NUMBER || query->from > query->to)
+        *error = "Wrong port range";
+    } else if (!strncmp(token, "vlan=", 5)) {
+      query->vlan = strtol(token + 5, &end, 10);
+      if (end == token + 5 || *end != '\0' || query->vlan < 0 ||
+          query->vlan >= MAX_VLANS)
+        *error = "Wrong VLAN";
+    } else if (!strncmp(token, "limit=", 6)) {
+      query->limit = strtol(token + 6, &end, 10);
+      if (end == token + 6 || *end != '\0' || query->limit <= 0)
+        *error = "Wrong limit";
+      else if (query->limit > max_limit)
+        query->limit = max_limit;
+    } else if (!strncmp(token, "cursor=", 7)) {
+      value = strtoull(token + 7, &end, 10);
+      if (end == token + 7 || *end != '\0')
+        *error = "Wrong cursor";
+      query->cursor = value;
+    } else {
+      *error = "Unknown argument";
+    }
+  }
+
+  free(copy);
+  return (*error == NULL) ? 0 : -1;
+}
+
+
+/* "getconfig [port=<n>[-<m>]] [vlan=<v>] [limit=<n>] [cursor=<c>]" -
+ * configuration of ports in ascending order. If limit ports were sent and
+ * there are more, "CURSOR <c>" before END continues with cursor=<c> */
+void get_config(struct connection_description* cl, struct evbuffer* out,
+  const char* command) {
+  char *buf;
+  size_t size;
+  FILE *stream;
+  port_t **found;
+  struct query query;
+  const char* error;
+  int count, i;
+
+  if (read_query(command + 9, &query, MAX_SOCKETS, &error) == -1) {
+    evbuffer_add_printf(out, "ERR: %s\n", error);
+    return;
+  }
+  if (query.cursor > MAX_PORT_NUMBER) {
+    evbuffer_add(out, "END\n", 4);
+    return;
+  }
+  if (query.cursor >= query.from)
+    query.from = query.cursor + 1;
+
+  /* One more port tells if there are more */
+  found = malloc((query.limit + 1) * sizeof(port_t*));
+  if (found == NULL)
+    syserr("Printing configuration.");
+  count = find_ports(query.vlan, query.from, query.to, found,
+    query.limit + 1);
+
+  /* Configuration of many VLANs can be long, printing to growing memory */
+  stream = open_memstream(&buf, &size);
+  if (stream == NULL)
+    syserr("Printing configuration.");
+
+  for (i = 0; i < count && i < query.limit; i += 1) {
+    print_config(found[i], stream);
+    fputc('\n', stream);
+  }
+  if (count > query.limit)
+    fprintf(stream, "CURSOR %d\n", found[query.limit - 1]->number);
+  fputs("END\n", stream);
+  fclose(stream);
+
+  evbuffer_add(out, buf, size);
+  free(buf);
+  free(found);
+}
+
+
+/* "macs [vlan=<v>] [port=<n>] [limit=<n>] [cursor=<c>]" - learned MACs in
+ * the order of their last change, up to MAX_QUERY_MACS at once. If there
+ * are more, "CURSOR <c>" before END continues with cursor=<c> */
+void macs(struct connection_description* cl, struct evbuffer* out,
+  const char* command) {
+  struct mac_query query;
+  struct query args;
+  const char* error;
+  const uint8_t* octet;
+  int i;
+
+  if (read_query(command + 4, &args, MAX_QUERY_MACS, &error) == -1) {
+    evbuffer_add_printf(out, "ERR: %s\n", error);
+    return;
+  }
+  if (args.from != args.to && (args.from != 0 || args.to != MAX_PORT_NUMBER)) {
+    evbuffer_add(out, "ERR: Only one port can be given\n", 32);
+    return;
+  }
+
+  query.vlan = args.vlan;
+  query.port = (args.from == args.to) ? args.from : -1;
+  query.cursor = args.cursor;
+  query.limit = args.limit;
+  query.result = malloc(args.limit * sizeof(mac_t));
+  if (query.result == NULL)
+    syserr("Printing MAC table.");
+
+  /* Only the entries are copied while forwarding waits */
+  data_plane_call(query_macs, &query);
+
+  for (i = 0; i < query.count; i += 1) {
+    octet = query.result[i].mac.ether_addr_octet;
+    evbuffer_add_printf(out,
+      "%02x:%02x:%02x:%02x:%02x:%02x vlan %d port %d %s\n", octet[0],
+      octet[1], octet[2], octet[3], octet[4], octet[5], query.result[i].vlan,
+      query.result[i].port, query.result[i].is_tagged ? "tagged" : "untagged");
+  }
+  if (query.cursor != 0)
+    evbuffer_add_printf(out, "CURSOR %llu\n", query.cursor);
+  evbuffer_add(out, "END\n", 4);
+  free(query.result);
 }
 
 void start_event(int index, struct event_base* base, void (*func) 
     (evutil_socket_t sock, short ev, void* arg)) {
+  /* New port starts with empty latency histograms */
+  latency_reset(&lat_unicast[index]);
+  latency_reset(&lat_flood[index]);
+
   events[index] = 
     event_new(base, sockets[index], EV_READ|EV_PERSIST, func, 
-    (void *) &index);
+    (void *) (intptr_t) index);
 
   if (!events[index])
     syserr("Creating event for a listener socket.");
   if (event_add(events[index], NULL) == -1)
     syserr("Adding UDP socket");
+  start_egress(index, base);
 }
 
 void delete_event(int index) {
   if (events[index] == NULL)
     return;
+  flows_config_changed();
 
   if (event_del(events[index]) == -1)
     syserr("Can't delete the event");
 
   event_free(events[index]);
-  
-  if(close(sockets[index]) == -1) 
-    syserr("Error closing socket.");              
-  sockets[index] = -1;                                                          
-  ports[index] = -1;                                                            
-  events[index] = NULL;   
+  stop_egress(index);
+  release_socket(index);
+  events[index] = NULL;
 }
 
+/* Socket index of a port, -1 if there is no such port */
 int get_index(int port) {
-  int i;
+  port_t* node = get_port(port);
 
-  i = 0;
-  
-  while (i < MAX_SOCKETS && ports[i] != port) {
-    i++;
-  }
-
-  if (i >= MAX_SOCKETS) {
-    i = -1;
-  }
-
-  return i;
+  return (node != NULL) ? node->index : -1;
 }
 
-void counters(evutil_socket_t sock) {
-  char buffer[BUF_SIZE+1];
-  char *buf = buffer;
+void counters(struct connection_description* cl, struct evbuffer* out,
+  const char* command) {
   int index;
   port_t *port;
 
@@ -286,201 +676,139 @@ void counters(evutil_socket_t sock) {
 
   while (port != NULL) {
     index = get_index(port -> number);
-    memset(buffer, 0, sizeof(buffer));
-    sprintf(buf, "%d: recvd:%d sent:%d errs:%d", port->number, udp_recv[index],
-      udp_sent[index], udp_errs[index]);
-    buf[strlen(buf)] = '\n';
-    write(sock, buf, strlen(buf));
+    evbuffer_add_printf(out, "%d: recvd:%d sent:%d errs:%d drops:%llu\n",
+      port->number, udp_recv[index], udp_sent[index], udp_errs[index],
+      tx_drops[index]);
     port = port->next;
   }
-  write(sock, "END\n", 4);
+  evbuffer_add(out, "END\n", 4);
 }
 
 
-/* Atomic increase of an integer field */
-static void atomic_inc(int* field) {
-  __sync_val_compare_and_swap(field, *field, *field + 1);
+/* Prints latency histogram summary of one port and egress type */
+static void print_latency(struct evbuffer* out, int port, const char* type,
+  const latency_t* hist) {
+  evbuffer_add_printf(out,
+    "%d %s: frames:%llu p50:%llu p99:%llu p99.9:%llu max:%llu\n",
+    port, type, hist->total, latency_percentile(hist, 0.5),
+    latency_percentile(hist, 0.99), latency_percentile(hist, 0.999),
+    hist->max);
 }
 
 
-/* Forwards a frame (buffer) to sender_addr */
-static void forward_frame(struct sockaddr_in sender_addr,
-  port_t *forward_port, int addrlen, int r, char *buffer) {
-  int fwd_port = forward_port->number;
-  sender_addr.sin_addr.s_addr = forward_port->sender_addr;
-  sender_addr.sin_port = htons(forward_port->sender_port);
-  if (sendto(sockets[get_index(fwd_port)], buffer, r, 0,
-     (struct sockaddr *) &sender_addr, addrlen) == -1)
-    syserr("UDP send");
+/* Clears latency histograms of all ports, on forwarding thread */
+static void reset_latency(void* arg) {
+  int index;
 
-  /* increasing counters */
-  atomic_inc(udp_sent + get_index(fwd_port));
+  for (index = 0; index < MAX_SOCKETS; index += 1) {
+    latency_reset(&lat_unicast[index]);
+    latency_reset(&lat_flood[index]);
+  }
 }
 
 
-/* Event handler on UDP packet receiving */
-void udp_manage(evutil_socket_t sock, short ev, void *arg) {
-  int r, index, fwd_port, vlan_number;
-  uint16_t *tpid, *pcp_dei, *ether_type;
-  char buffer[BUF_SIZE+1];
-  char dst_buffer[BUF_SIZE+1];
-  socklen_t addrlen;
-  struct sockaddr_in sender_addr;
-  struct ether_addr *src_addr, *dst_addr;
-  port_t *base_port, *forward_port;
-  
-  index = (int) arg;
-  addrlen = sizeof(sender_addr);
-
-  /* Pick maintained port from port map */
-  base_port = get_port(ports[index]);
-
-  /* Receive UDP data */
-  r = recvfrom(sock, buffer, BUF_SIZE, 0,
-           (struct sockaddr *)&sender_addr, &addrlen);
-
-  /* If port is inactive, activate it with sender data */
-  if (base_port->status == INACTIVE){
-    printf("Activating %lu %d\n", (unsigned long)sender_addr.sin_addr.s_addr, 
-           ntohs(sender_addr.sin_port));
-    activate_port(base_port, sender_addr.sin_addr.s_addr, 
-                  ntohs(sender_addr.sin_port));
-  }
-    
-  /* Ignore datagram if it's not authorized */
-  if (sender_addr.sin_addr.s_addr != base_port->sender_addr
-      || sender_addr.sin_port != htons(base_port->sender_port)) { 
-    fprintf(stderr, "ignoring unauthorized datagram\n");
+/* Forwarding latency (ns, kernel receive to sendto completion) per port,
+ * "latency reset" clears the histograms */
+void latency(struct connection_description* cl, struct evbuffer* out,
+  const char* command) {
+  int index;
+  port_t *port;
+
+  if (!strncmp(command, "latency reset", 13)) {
+    data_plane_call(reset_latency, NULL);
+    evbuffer_add(out, "END\n", 4);
     return;
-  } else {
-    /* Increasing counters */
-    atomic_inc(udp_recv + index);
   }
-  
-  /* error handling */
-  if(r <= 0) {
-    if(r < 0) {
-      fprintf(stderr, "Error in read\n");
-      /* Increasing counters */
-      atomic_inc(udp_errs + index);
-    } else {
-      fprintf(stderr, "Connection closed\n");
+
+  port = get_head();
+  while (port != NULL) {
+    index = get_index(port->number);
+    if (index != -1) {
+      print_latency(out, port->number, "unicast", &lat_unicast[index]);
+      print_latency(out, port->number, "flood", &lat_flood[index]);
     }
-    delete_event(index);
-    return;
+    port = port->next;
   }
-  
-  /* unpack ethernet frame from UDP */
-  dst_addr = ((struct ether_addr *) buffer) + 0;
-  src_addr = ((struct ether_addr *) buffer) + 1;
-  tpid = (uint16_t *) (buffer + 2 * sizeof(struct ether_addr));
-  pcp_dei = (uint16_t *) (buffer + 2 * sizeof(struct ether_addr) + 
-                          sizeof(uint16_t));
-  ether_type = (uint16_t *) (buffer + 2 * sizeof(struct ether_addr) + 
-                             2 * sizeof(uint16_t));
-  ether_type = ether_type;
-
-  /* If frame is tagged, retrieve src_addr and vlan + add it to mac_map */
-  if (ntohs(*tpid) == 0x8100){
-    /* Zeroing PCP/DEI field */
-    /* Adding pair <mac, tagged_vlan> */
-    vlan_number = ntohs(*pcp_dei);
-    vlan_number &= 4095; /* zeroing pcp-dei */
-    *pcp_dei = htons(vlan_number);
-    /* If such a vlan number is supported via UDP port, add it to mac map */
-    if (valid_vlan(base_port, vlan_number))
-      add_mac(*src_addr, vlan_number, ports[index], 1);
-    else {
-      atomic_inc(udp_errs + index);
-      fprintf(stderr, "Ignoring unauthorized vlan number\n");
-      return;
-    }
-  } else {
-    /* Frame is not tagged with 802.1Q, obtaining vlan number from tpid field */
-    vlan_number = base_port->untagged_vlan;
-    /* If no untagged lan is supported, return */
-    if (vlan_number == -1){
-      atomic_inc(udp_errs + index);
-      fprintf(stderr, "Untagged frame received for tagged-only port\n");
+  evbuffer_add(out, "END\n", 4);
+}
+
+
+/* New priority of a port */
+struct port_priority {
+  port_t* port;
+  int pcp;
+};
+
+
+/* Changes priority of a port, on forwarding thread */
+static void set_priority(void* arg) {
+  struct port_priority* change = (struct port_priority*) arg;
+
+  change->port->default_pcp = change->pcp;
+  flows_config_changed();
+}
+
+
+/* 802.1p priority of untagged frames received on a port, "priority <port>
+ * <pcp>" sets it */
+void priority(struct connection_description* cl, struct evbuffer* out,
+  const char* command) {
+  struct port_priority change;
+  int port_number, pcp;
+  port_t *port;
+
+  if (sscanf(command, "priority %d %d", &port_number, &pcp) == 2) {
+    port = get_port(port_number);
+    if (port == NULL || pcp < 0 || pcp > 7) {
+      evbuffer_add(out, "ERR: Wrong port or priority\n", 28);
       return;
     }
-    /* Adding pair <mac, untagged_vlan> */
-    add_mac(*src_addr, vlan_number, ports[index], 0);
+    change.port = port;
+    change.pcp = pcp;
+    data_plane_call(set_priority, &change);
+    watch_config(port_number);
+    evbuffer_add(out, "END\n", 4);
+    return;
   }
 
-  /* sending UDP further */
-  if (ntohs(*tpid) == 0x8100) {
-    fwd_port = get_port_from_mac(*dst_addr, vlan_number);
-  } else {
-    fwd_port = get_untagged_port_from_mac(*dst_addr);
-  }
-  
-  /* Receiver found, forward udp frame */
-  addrlen = sizeof(sender_addr);
-  if (fwd_port != -1){
-    forward_port = get_port(fwd_port);
-    /* if tagged->untagged, untag forwarded frame */
-    if (ntohs(*tpid) == 0x8100 && forward_port->untagged_vlan == vlan_number) {
-      fprintf(stderr, "Frame shall be untagged.\n");
-      untag_frame(buffer, dst_buffer);
-      memcpy(buffer, dst_buffer, sizeof(buffer));
-    /* if untagged->tagged, tag forwarded frame */
-    } else if (ntohs(*tpid) != 0x8100 && 
-               forward_port->untagged_vlan != vlan_number) {
-      tag_frame(buffer, dst_buffer, vlan_number);
-      memcpy(buffer, dst_buffer, sizeof(buffer));
-    }
-    
-    forward_frame(sender_addr, forward_port, addrlen, r, buffer);
-  } else {
-    /* Broadcast frame to everyone in a VLAN */
-    reset_vlan_iterator();
-    /* fwd_port is a port with specified vlan */
-    while ( (fwd_port = vlan_next_port(vlan_number)) != -1) {
-      forward_port = get_port(fwd_port);
-
-      /* if tagged->untagged, untag forwarded frame */
-      if (ntohs(*tpid) == 0x8100 && 
-          forward_port->untagged_vlan == vlan_number) {
-        fprintf(stderr, "Frame shall be untagged.\n");
-        untag_frame(buffer, dst_buffer);
-        memcpy(buffer, dst_buffer, sizeof(buffer));
-      /* if untagged->tagged, tag forwarded frame */
-      } else if (ntohs(*tpid) != 0x8100 && 
-                 forward_port->untagged_vlan != vlan_number) {
-        tag_frame(buffer, dst_buffer, vlan_number);
-        memcpy(buffer, dst_buffer, sizeof(buffer));
-      }
-      
-      /* Avoiding loopback */
-      if ((forward_port->sender_addr != sender_addr.sin_addr.s_addr)
-          || (htons(forward_port->sender_port) != sender_addr.sin_port))
-        forward_frame(sender_addr, forward_port, addrlen, r, buffer);
-    }
+  for (port = get_head(); port != NULL; port = port->next) {
+    evbuffer_add_printf(out, "%d: pcp:%d\n", port->number, port->default_pcp);
   }
+  evbuffer_add(out, "END\n", 4);
 }
 
 
-void tag_frame(char* buffer, char* dst_buffer, int vlan){
-  uint16_t *tpid, *pcp_dei;
+/* "watch [interval=<ms>]" - streams MAC table and port changes as EVENT
+ * lines, and counter changes every interval ms */
+void watch(struct connection_description* cl, struct evbuffer* out,
+  const char* command) {
+  int interval = 0;
+  const char* arg;
 
-  /* dst_buffer's tpid and pcp_dei */
-  tpid = (uint16_t *) (dst_buffer + 2 * sizeof(struct ether_addr));
-  pcp_dei = (uint16_t *) (dst_buffer + 2 * sizeof(struct ether_addr) + 
-                          sizeof(uint16_t));
+  if (cl->watcher != NULL) {
+    evbuffer_add(out, "ERR: Already watching\n", 22);
+    return;
+  }
+  arg = strstr(command, "interval=");
+  if (arg != NULL && (sscanf(arg, "interval=%d", &interval) != 1 ||
+      interval < WATCH_POLL_MSEC)) {
+    evbuffer_add_printf(out, "ERR: Interval must be at least %d ms\n",
+      WATCH_POLL_MSEC);
+    return;
+  }
 
-  /* copy MAC addresses to dst_buffer*/
-  memcpy(dst_buffer, buffer, 12);
-  /* set vlan tag */
-  *tpid = htons(0x8100);
-  *pcp_dei = htons(vlan);
-  /* copy the rest */
-  memcpy(dst_buffer + 16, buffer + 12, 1508);
+  cl->watcher = watch_start(cl->bev, interval);
+  evbuffer_add(out, "END\n", 4);
 }
 
 
-void untag_frame(char* buffer, char* dst_buffer){
-  memcpy(dst_buffer, buffer, 12);
-  memcpy(dst_buffer + 12, buffer + 16, 1502);
+void unwatch(struct connection_description* cl, struct evbuffer* out,
+  const char* command) {
+  if (cl->watcher == NULL) {
+    evbuffer_add(out, "ERR: Not watching\n", 18);
+    return;
+  }
+  watch_stop(cl->watcher);
+  cl->watcher = NULL;
+  evbuffer_add(out, "END\n", 4);
 }
-
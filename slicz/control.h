@@ -8,14 +8,17 @@
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
 #include <event2/event.h>
 #include <event2/util.h>
 #include <netinet/in.h>
-#include <regex.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/types.h>    /* ether_addr */
 #include <sys/socket.h>
@@ -23,43 +26,76 @@
 #include "help_functions.h"
 #include "ports.h"
 #include "macs.h"
+#include "latency.h"
+#include "metrics.h"
+#include "flows.h"
+#include "forward.h"
+#include "config.h"
+#include "planes.h"
+#include "watch.h"
+#include "snapshot.h"
+#include "upgrade.h"
+#include "stats.h"
 #include "err.h"
 
 
 /* Definitions */
 #define MAX_CONTROL_CONNECTIONS 10
-#define BUF_SIZE 1518
+#define MAX_COMMAND_LEN (1 << 20)   /* longest accepted command line */
+#define MAX_QUERY_MACS 4096         /* MACs copied from forwarding at once */
 
 /* Structures */
 struct connection_description {
   struct sockaddr_in address;     /* client address */
-  evutil_socket_t sock;           /* switch port */
-  struct event *ev;               /* assigned event */
+  struct bufferevent *bev;        /* buffered connection */
+  struct transaction *tx;         /* open transaction, NULL if none */
+  struct transaction *committing; /* commit waiting for client names */
+  int closing;                    /* client closed during the commit */
+  struct watcher *watcher;        /* events subscription, NULL if none */
+  int held;                       /* not read during a handoff */
 };
 
-struct connection_description clients[MAX_CONTROL_CONNECTIONS];
-
-/* Global data tables */
-struct event* events[MAX_SOCKETS];
-int udp_sent[MAX_SOCKETS];
-int udp_recv[MAX_SOCKETS];
-int udp_errs[MAX_SOCKETS];
+extern struct connection_description clients[MAX_CONTROL_CONNECTIONS];
+extern struct event_base* control_base;  /* control thread, forwarding uses base */
 
 /* Functions */
 void init_clients();
 struct connection_description *get_client_slot();
-void client_manage(evutil_socket_t sock, short ev, void *arg);
+void client_manage(struct bufferevent *bev, void *arg);
+void client_event(struct bufferevent *bev, short events, void *arg);
 void listener_manage(evutil_socket_t sock, short ev, void *arg);
 void handle_sigint(int signal);
-void set_config(evutil_socket_t sock, const char* buf);
-void get_config(evutil_socket_t sock);
-void counters(evutil_socket_t sock);
+void set_config(struct connection_description* cl, struct evbuffer* out,
+  const char* command);
+void get_config(struct connection_description* cl, struct evbuffer* out,
+  const char* command);
+void load_config(struct connection_description* cl, struct evbuffer* out,
+  const char* command);
+void begin_config(struct connection_description* cl, struct evbuffer* out,
+  const char* command);
+void commit_config(struct connection_description* cl, struct evbuffer* out,
+  const char* command);
+void abort_config(struct connection_description* cl, struct evbuffer* out,
+  const char* command);
+void shutdown_switch(struct connection_description* cl, struct evbuffer* out,
+  const char* command);
+void leave_switch();
+void hold_clients(int hold);
+void counters(struct connection_description* cl, struct evbuffer* out,
+  const char* command);
+void macs(struct connection_description* cl, struct evbuffer* out,
+  const char* command);
+void latency(struct connection_description* cl, struct evbuffer* out,
+  const char* command);
+void priority(struct connection_description* cl, struct evbuffer* out,
+  const char* command);
+void watch(struct connection_description* cl, struct evbuffer* out,
+  const char* command);
+void unwatch(struct connection_description* cl, struct evbuffer* out,
+  const char* command);
 void start_event(int index, struct event_base* base, void (*func)
   (evutil_socket_t sock, short ev, void* arg));
 void delete_event(int index);
 int get_index(int port);
-void udp_manage(evutil_socket_t sock, short ev, void *arg);
-void tag_frame(char* buffer, char* dst_buffer, int vlan);
-void untag_frame(char* buffer, char* dst_buffer);
 
 #endif
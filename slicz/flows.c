@@ -0,0 +1,90 @@
+/*
+ * Author: Konrad Słoniewski
+ * Date:   18 August 2013
+ */
+
+#include <arpa/inet.h>
+
+#include "flows.h"
+
+/* Attributes */
+
+static struct flow_entry cache[FLOW_CACHE_SIZE];
+static unsigned long config_generation = 1;  /* 0 marks empty entries */
+
+
+/* Functions */
+
+/* Fills key from frame header received on a given port */
+void make_flow_key(struct flow_key* key, int ingress, const char* frame) {
+  uint16_t tpid, tci;
+
+  memset(key, 0, sizeof(*key));
+  key->ingress = ingress;
+  memcpy(&key->dst, frame, ETHER_ADDR_LEN);
+  memcpy(&key->src, frame + ETHER_ADDR_LEN, ETHER_ADDR_LEN);
+
+  memcpy(&tpid, frame + 2 * ETHER_ADDR_LEN, sizeof(tpid));
+  memcpy(&tci, frame + 2 * ETHER_ADDR_LEN + sizeof(tpid), sizeof(tci));
+  key->tag = (ntohs(tpid) == 0x8100) ? (ntohs(tci) & 4095) : -1;
+}
+
+
+/* Cache slot of a flow */
+unsigned int flow_hash(const struct flow_key* key) {
+  uint64_t dst = 0, src = 0, h;
+
+  memcpy(&dst, &key->dst, ETHER_ADDR_LEN);
+  memcpy(&src, &key->src, ETHER_ADDR_LEN);
+  h = dst * 0x9e3779b97f4a7c15ULL;
+  h ^= (src + ((uint64_t) key->ingress << 48) + (uint32_t) key->tag) *
+    0xc2b2ae3d27d4eb4fULL;
+  h ^= h >> 29;
+
+  return (unsigned int) h & (FLOW_CACHE_SIZE - 1);
+}
+
+
+/* Starts loading cache slot, so that lookup of a batch does not wait for
+ * memory frame by frame */
+void flow_prefetch(unsigned int hash) {
+  __builtin_prefetch(&cache[hash]);
+}
+
+
+/* Returns cached action of a flow, NULL if it has to be computed. Only
+ * changes of its source or destination MAC, or of its VLAN for a flooded
+ * flow, make it stale, so learning a MAC keeps other flows */
+struct flow_action* flow_lookup(const struct flow_key* key, unsigned int hash) {
+  struct flow_entry* entry = &cache[hash];
+
+  if (entry->config_gen != config_generation ||
+      memcmp(&entry->key, key, sizeof(*key)) ||
+      entry->src_gen != mac_generation(key->src) ||
+      entry->dst_gen != mac_generation(key->dst) ||
+      (entry->action.flood &&
+       entry->vlan_gen != vlan_generation(entry->action.vlan)))
+    return NULL;
+
+  return &entry->action;
+}
+
+
+/* Stores action computed for the current configuration and MAC table */
+void flow_insert(const struct flow_key* key, unsigned int hash,
+  const struct flow_action* action) {
+  struct flow_entry* entry = &cache[hash];
+
+  entry->key = *key;
+  entry->config_gen = config_generation;
+  entry->src_gen = mac_generation(key->src);
+  entry->dst_gen = mac_generation(key->dst);
+  entry->vlan_gen = vlan_generation(action->vlan);
+  entry->action = *action;
+}
+
+
+/* Invalidates all cached flows after a port or VLAN change */
+void flows_config_changed() {
+  config_generation += 1;
+}
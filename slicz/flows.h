@@ -0,0 +1,69 @@
+/*
+ * Author: Konrad Słoniewski
+ * Date:   18 August 2013
+ */
+
+#ifndef _FLOWS_H
+#define _FLOWS_H
+
+#include <net/ethernet.h>    /* struct ether_addr */
+#include <netinet/in.h>      /* struct sockaddr_in */
+#include <stdint.h>
+#include <string.h>
+
+#include "macs.h"
+
+/* Definitions */
+#define FLOW_CACHE_SIZE 4096   /* entries, power of two */
+#define FLOW_MAX_EGRESS 16     /* longest cached egress list */
+#define REWRITE_NONE 0         /* forward frame as received */
+#define REWRITE_TAG 1          /* add 802.1Q tag */
+#define REWRITE_UNTAG 2        /* remove 802.1Q tag */
+
+/* Structs */
+
+/* What identifies a flow: ingress port, addresses and 802.1Q tag. Source
+ * is part of the key, so a hit also means the source is already learned */
+struct flow_key {
+  int ingress;                 /* socket index of ingress port */
+  int tag;                     /* VLAN of the tag, -1 if untagged */
+  struct ether_addr dst;
+  struct ether_addr src;
+};
+
+/* One egress port of a flow */
+struct flow_egress {
+  int index;                   /* socket index of egress port */
+  int rewrite;                 /* REWRITE_* */
+  struct sockaddr_in addr;     /* client of egress port */
+};
+
+/* Precomputed forwarding decision */
+struct flow_action {
+  int vlan;                    /* VLAN the frame belongs to */
+  int pcp;                     /* priority given to untagged frames */
+  int flood;                   /* destination unknown, sent to whole VLAN */
+  struct sockaddr_in client;   /* authorized client of ingress port */
+  int egress_count;
+  struct flow_egress egress[FLOW_MAX_EGRESS];
+};
+
+struct flow_entry {
+  struct flow_key key;
+  unsigned long config_gen;    /* configuration the action was built for */
+  unsigned long src_gen;       /* MAC table entries of the source, */
+  unsigned long dst_gen;       /* of the destination */
+  unsigned long vlan_gen;      /* and of the VLAN, if flooded */
+  struct flow_action action;
+};
+
+/* Functions */
+void make_flow_key(struct flow_key* key, int ingress, const char* frame);
+unsigned int flow_hash(const struct flow_key* key);
+void flow_prefetch(unsigned int hash);
+struct flow_action* flow_lookup(const struct flow_key* key, unsigned int hash);
+void flow_insert(const struct flow_key* key, unsigned int hash,
+  const struct flow_action* action);
+void flows_config_changed();
+
+#endif
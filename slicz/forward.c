@@ -0,0 +1,867 @@
+/*
+ * Author: Konrad Słoniewski
+ * Date:   18 August 2013
+ */
+
+#define _GNU_SOURCE           /* recvmmsg, sendmmsg */
+
+#include <sys/socket.h>
+
+#include "forward.h"
+#include "control.h"          /* get_index() */
+
+/* Forwarding works on vectors of frames received from one port in a single
+ * wakeup, in stages: receive, parse (keys and hashes, prefetching flow
+ * cache lines), lookup, classify/learn for cache misses, rewrite and
+ * enqueue, transmit (sendmmsg per egress port), latency accounting.
+ *
+ * Frames live in pooled buffers (framebuf.c). Every egress queue holds a
+ * reference, so flooding a frame shares one buffer; rewriting is done in
+ * place when no egress needs the original, otherwise on one copy.
+ *
+ * Ports of local transports (shm) receive and send frames through their
+ * transport instead of recvmmsg and sendmmsg, with the same batches.
+ *
+ * Sockets are never written blocking. Frames that do not fit into socket
+ * buffer stay in bounded per-port queues drained on EV_WRITE, one for each
+ * 802.1p traffic class: classes 5-7 are served with strict priority and
+ * classes 0-4 share the rest by weighted round robin. */
+
+/* Structs */
+
+/* Frames received in one batch, with everything stages compute for them */
+struct frame_vector {
+  int count;
+  struct frame_buf* frames[FRAME_BATCH];       /* kept between batches */
+  struct iovec iovs[FRAME_BATCH];
+  struct mmsghdr msgs[FRAME_BATCH];
+  struct sockaddr_in addrs[FRAME_BATCH];
+  char controls[FRAME_BATCH][CMSG_SPACE(sizeof(struct timespec))];
+  int valid[FRAME_BATCH];                      /* long enough to parse */
+  struct flow_key keys[FRAME_BATCH];
+  unsigned int hashes[FRAME_BATCH];
+  struct flow_action* actions[FRAME_BATCH];    /* NULL - cache miss */
+  int flood[FRAME_BATCH];                      /* -1 - frame dropped */
+  int egress_counts[FRAME_BATCH];
+};
+
+/* Frames of one traffic class waiting for an egress port, ring of
+ * queue_limit slots */
+struct class_queue {
+  int head;                                    /* oldest frame */
+  int count;
+  struct frame_buf** frames;
+};
+
+/* Frames waiting for transmission through one egress port, one queue per
+ * traffic class. What cannot be sent at once waits here until the socket
+ * becomes writable */
+struct egress_queue {
+  int count;                                   /* frames in all classes */
+  int blocked;                                 /* waiting for EV_WRITE */
+  int active;                                  /* on tx_active list */
+  struct event* ev;                            /* EV_WRITE drain event */
+  int wrr_class;                               /* class served by WRR */
+  int wrr_credit;                              /* frames it may still send */
+  struct sockaddr_in addr;                     /* client of the port */
+  struct class_queue classes[PRIORITY_CLASSES];
+};
+
+/* Attributes */
+
+latency_t lat_unicast[MAX_SOCKETS];
+latency_t lat_flood[MAX_SOCKETS];
+
+static struct frame_vector vector;
+static struct egress_queue* queues[MAX_SOCKETS];  /* NULL - no port */
+static int queue_limit = EGRESS_QUEUE_DEFAULT;
+static int drop_policy = DROP_TAIL;
+static int tx_active[MAX_SOCKETS];    /* egress ports with new frames */
+/* Traffic class of each PCP, as recommended by 802.1Q for eight queues -
+ * background (PCP 1) is below best effort (PCP 0) */
+static const int pcp_classes[8] = { 1, 0, 2, 3, 4, 5, 6, 7 };
+/* Frames sent in one WRR round by classes below strict priority ones */
+static const int wrr_weights[WRR_CLASSES] = { 1, 2, 3, 4, 5 };
+static int tx_active_count = 0;
+static int queued_frames = 0;         /* in all egress queues */
+
+
+/* Functions */
+
+/* Receive time of a datagram from SO_TIMESTAMPNS, current time if the
+ * kernel did not provide it */
+static void receive_time(struct msghdr* msg, struct timespec* time) {
+  struct cmsghdr* cmsg;
+
+  for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg))
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+      memcpy(time, CMSG_DATA(cmsg), sizeof(*time));
+      return;
+    }
+
+  clock_gettime(CLOCK_REALTIME, time);
+}
+
+
+/* Frames of a port of a local transport. They come from the pseudo
+ * client of the port, its own number */
+static int receive_local(int index, struct frame_vector* vec, int slots) {
+  int i, r;
+
+  if (slots == 0)
+    return 0;
+  r = transports[index]->receive(index, vec->frames, slots);
+  if (r < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      fprintf(stderr, "Error in read (%s)\n", strerror(errno));
+      atomic_inc(udp_errs + index);
+    }
+    return 0;
+  }
+
+  for (i = 0; i < r; i += 1) {
+    vec->frames[i]->ingress = index;
+    clock_gettime(CLOCK_REALTIME, &vec->frames[i]->received);
+    memset(&vec->addrs[i], 0, sizeof(vec->addrs[i]));
+    vec->addrs[i].sin_family = AF_INET;
+    vec->addrs[i].sin_addr.s_addr = INADDR_ANY;
+    vec->addrs[i].sin_port = htons(ports[index]);
+  }
+  vec->count = r;
+
+  return r;
+}
+
+
+/* Stage: receive up to FRAME_BATCH datagrams with their timestamps into
+ * pool buffers. Buffers not filled stay in the vector for the next batch */
+static int receive_frames(evutil_socket_t sock, int index,
+  struct frame_vector* vec) {
+  static char discard[FRAME_SIZE];
+  struct frame_buf* frame;
+  int i, r, slots;
+
+  for (slots = 0; slots < FRAME_BATCH; slots += 1) {
+    if (vec->frames[slots] == NULL)
+      vec->frames[slots] = frame_alloc();
+    frame = vec->frames[slots];
+    if (frame == NULL)
+      break;
+
+    vec->iovs[slots].iov_base = frame->data;
+    vec->iovs[slots].iov_len = FRAME_SIZE;
+    memset(&vec->msgs[slots].msg_hdr, 0, sizeof(struct msghdr));
+    vec->msgs[slots].msg_hdr.msg_name = &vec->addrs[slots];
+    vec->msgs[slots].msg_hdr.msg_namelen = sizeof(vec->addrs[slots]);
+    vec->msgs[slots].msg_hdr.msg_iov = &vec->iovs[slots];
+    vec->msgs[slots].msg_hdr.msg_iovlen = 1;
+    vec->msgs[slots].msg_hdr.msg_control = vec->controls[slots];
+    vec->msgs[slots].msg_hdr.msg_controllen = sizeof(vec->controls[slots]);
+  }
+
+  /* Local transports keep frames until the pool has room again */
+  if (transports[index] != NULL)
+    return receive_local(index, vec, slots);
+
+  /* Pool exhausted by queued frames, datagram has to be dropped */
+  if (slots == 0) {
+    if (recv(sock, discard, sizeof(discard), MSG_DONTWAIT) >= 0)
+      atomic_inc(udp_errs + index);
+    return 0;
+  }
+
+  r = recvmmsg(sock, vec->msgs, slots, MSG_DONTWAIT, NULL);
+  if (r < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      fprintf(stderr, "Error in read (%s)\n", strerror(errno));
+      atomic_inc(udp_errs + index);
+    }
+    return 0;
+  }
+
+  for (i = 0; i < r; i += 1) {
+    frame = vec->frames[i];
+    frame->len = vec->msgs[i].msg_len;
+    frame->ingress = index;
+    receive_time(&vec->msgs[i].msg_hdr, &frame->received);
+  }
+  vec->count = r;
+
+  return r;
+}
+
+
+/* Frame has whole Ethernet header, with the tag if it is tagged */
+static int frame_parsable(const struct frame_buf* frame) {
+  uint16_t tpid;
+
+  if (frame->len < ETHER_HDR_LEN)
+    return 0;
+  memcpy(&tpid, frame->data + 2 * ETHER_ADDR_LEN, sizeof(tpid));
+
+  return ntohs(tpid) != 0x8100 || frame->len >= ETHER_HDR_LEN + 4;
+}
+
+
+/* Stage: flow keys and hashes of the whole vector, then prefetch of all
+ * cache lines, so lookups find them in cache */
+static void parse_frames(struct frame_vector* vec, int index) {
+  int i;
+
+  for (i = 0; i < vec->count; i += 1) {
+    vec->valid[i] = frame_parsable(vec->frames[i]);
+    if (!vec->valid[i])
+      continue;
+    make_flow_key(&vec->keys[i], index, vec->frames[i]->data);
+    vec->hashes[i] = flow_hash(&vec->keys[i]);
+  }
+
+  for (i = 0; i < vec->count; i += 1)
+    if (vec->valid[i])
+      flow_prefetch(vec->hashes[i]);
+}
+
+
+/* Cached action of frame i, only if it came from the authorized client */
+static struct flow_action* lookup_frame(struct frame_vector* vec, int i) {
+  struct flow_action* action;
+
+  if (!vec->valid[i])
+    return NULL;
+
+  action = flow_lookup(&vec->keys[i], vec->hashes[i]);
+  if (action == NULL ||
+      vec->addrs[i].sin_addr.s_addr != action->client.sin_addr.s_addr ||
+      vec->addrs[i].sin_port != action->client.sin_port)
+    return NULL;
+
+  return action;
+}
+
+
+/* Stage: flow cache lookup of the whole vector */
+static void lookup_frames(struct frame_vector* vec) {
+  int i;
+
+  for (i = 0; i < vec->count; i += 1)
+    vec->actions[i] = lookup_frame(vec, i);
+}
+
+
+/* Removes oldest frame of a class queue, counting it if it was sent */
+static void pop_frame(int index, int c, int sent) {
+  struct egress_queue* queue = queues[index];
+  struct class_queue* cq = &queue->classes[c];
+  struct frame_buf* frame = cq->frames[cq->head];
+
+  if (sent) {
+    atomic_inc(udp_sent + index);
+    udp_sent_bytes[index] += frame->len;
+  }
+  frame_put(frame);
+  cq->head = (cq->head + 1) % queue_limit;
+  cq->count -= 1;
+  queue->count -= 1;
+  queued_frames -= 1;
+}
+
+
+/* Queues frame for transmission through an egress port in the queue of
+ * its traffic class, the queue keeps a reference. Full class queue drops
+ * the new frame or its oldest one. So does a blocked port once blocked
+ * ports hold EGRESS_BLOCKED_MAX frames, so that they cannot take the
+ * whole pool and starve receiving */
+static void enqueue_frame(const struct flow_egress* egress,
+  struct frame_buf* frame) {
+  struct egress_queue* queue = queues[egress->index];
+  int c = pcp_classes[frame->priority];
+  struct class_queue* cq = &queue->classes[c];
+  int tail;
+
+  if (cq->count >= queue_limit ||
+      (queue->blocked && queued_frames >= EGRESS_BLOCKED_MAX)) {
+    tx_drops[egress->index] += 1;
+    if (drop_policy == DROP_TAIL || cq->count == 0)
+      return;
+    pop_frame(egress->index, c, 0);
+  }
+
+  /* Blocked queue is drained by its EV_WRITE event. A queue emptied by
+   * drop-head may get frames again in the same batch, but is listed once */
+  if (!queue->active && !queue->blocked) {
+    queue->active = 1;
+    tx_active[tx_active_count++] = egress->index;
+  }
+
+  tail = (cq->head + cq->count) % queue_limit;
+  frame_get(frame);
+  cq->frames[tail] = frame;
+  queue->addr = egress->addr;
+  cq->count += 1;
+  queue->count += 1;
+  queued_frames += 1;
+}
+
+
+/* Adds 802.1Q tag in the headroom, moving only MAC addresses */
+static void tag_in_place(struct frame_buf* frame, int vlan) {
+  uint16_t tpid, pcp_dei;
+  char* data;
+
+  data = frame_push(frame, 4);
+  memmove(data, data + 4, 2 * ETHER_ADDR_LEN);
+  tpid = htons(0x8100);
+  pcp_dei = htons((frame->priority << 13) | vlan);
+  memcpy(data + 12, &tpid, sizeof(tpid));
+  memcpy(data + 14, &pcp_dei, sizeof(pcp_dei));
+}
+
+
+/* Removes 802.1Q tag, moving only MAC addresses */
+static void untag_in_place(struct frame_buf* frame) {
+  memmove(frame->data + 4, frame->data, 2 * ETHER_ADDR_LEN);
+  frame_pull(frame, 4);
+}
+
+
+/* Rewritten version of frame - the frame itself if the original is not
+ * needed any more, otherwise a new buffer (NULL if pool is exhausted or
+ * the frame is too short to be rewritten) */
+static struct frame_buf* rewrite_copy(struct frame_buf* frame, int rewrite,
+  int vlan, int keep_original) {
+  struct frame_buf* copy;
+
+  /* parse_frames() keeps short frames out, this guards the rewrite itself */
+  if (frame->len < ETHER_HDR_LEN + (rewrite == REWRITE_UNTAG ? 4 : 0))
+    return NULL;
+
+  if (!keep_original) {
+    if (rewrite == REWRITE_TAG)
+      tag_in_place(frame, vlan);
+    else
+      untag_in_place(frame);
+    return frame;
+  }
+
+  copy = frame_alloc();
+  if (copy == NULL)
+    return NULL;
+  copy->ingress = frame->ingress;
+  copy->received = frame->received;
+  copy->priority = frame->priority;
+  if (rewrite == REWRITE_TAG)
+    copy->len = tag_frame(frame->data, frame->len, copy->data, vlan,
+      frame->priority);
+  else
+    copy->len = untag_frame(frame->data, frame->len, copy->data);
+
+  return copy;
+}
+
+
+/* Stage: rewrite frame i according to action and queue it. The frame is
+ * tagged or untagged, so at most one rewritten version is needed */
+static void rewrite_frame(struct frame_vector* vec, int i,
+  const struct flow_action* action, const struct flow_egress* egress) {
+  struct frame_buf* frame = vec->frames[i];
+  struct frame_buf* rewritten = NULL;
+  int e, keep_original = 0;
+  uint16_t tci;
+
+  vec->flood[i] = action->flood;
+  vec->egress_counts[i] = action->egress_count;
+  vlan_frames[action->vlan] += 1;
+  vlan_bytes[action->vlan] += frame->len;
+
+  /* Priority from the tag, untagged frames get the one of ingress port */
+  if (vec->keys[i].tag != -1) {
+    memcpy(&tci, frame->data + 2 * ETHER_ADDR_LEN + 2, sizeof(tci));
+    frame->priority = ntohs(tci) >> 13;
+  } else {
+    frame->priority = action->pcp;
+  }
+
+  for (e = 0; e < action->egress_count; e += 1)
+    if (egress[e].rewrite == REWRITE_NONE)
+      keep_original = 1;
+
+  for (e = 0; e < action->egress_count; e += 1) {
+    if (egress[e].rewrite == REWRITE_NONE) {
+      enqueue_frame(&egress[e], frame);
+      continue;
+    }
+    if (rewritten == NULL) {
+      rewritten = rewrite_copy(frame, egress[e].rewrite, action->vlan,
+        keep_original);
+      if (rewritten == NULL) {
+        atomic_inc(udp_errs + frame->ingress);
+        return;
+      }
+    }
+    enqueue_frame(&egress[e], rewritten);
+  }
+
+  if (rewritten != NULL && rewritten != frame)
+    frame_put(rewritten);
+}
+
+
+/* Adds port to egress list unless it is already there. Frame leaves tagged
+ * if it belongs to a VLAN other than untagged VLAN of the egress port */
+static int add_egress(struct flow_egress* egress, int count, int fwd_port,
+  int vlan_number, int tagged) {
+  port_t *forward_port;
+  int fwd_index, i;
+
+  forward_port = get_port(fwd_port);
+  fwd_index = get_index(fwd_port);
+  if (forward_port == NULL || fwd_index == -1)
+    return count;
+
+  for (i = 0; i < count; i += 1)
+    if (egress[i].index == fwd_index)
+      return count;
+
+  egress[count].index = fwd_index;
+  memset(&egress[count].addr, 0, sizeof(egress[count].addr));
+  egress[count].addr.sin_family = AF_INET;
+  egress[count].addr.sin_addr.s_addr = forward_port->sender_addr;
+  egress[count].addr.sin_port = htons(forward_port->sender_port);
+
+  if (tagged && forward_port->untagged_vlan == vlan_number)
+    egress[count].rewrite = REWRITE_UNTAG;
+  else if (!tagged && forward_port->untagged_vlan != vlan_number)
+    egress[count].rewrite = REWRITE_TAG;
+  else
+    egress[count].rewrite = REWRITE_NONE;
+
+  return count + 1;
+}
+
+
+/* Stages for a cache miss: authorization, VLAN classification, learning
+ * and MAC lookup. Returns 0 if the frame is dropped, otherwise fills the
+ * action and its egress list */
+static int classify_frame(struct frame_vector* vec, int i, int index,
+  port_t* base_port, struct flow_action* action, struct flow_egress* egress) {
+  int fwd_port, vlan_number, tagged;
+  uint16_t tpid, pcp_dei;
+  struct ether_addr src_addr, dst_addr;
+  struct sockaddr_in* sender_addr = &vec->addrs[i];
+  struct frame_buf* frame = vec->frames[i];
+  port_t *forward_port;
+
+  /* If port is inactive, activate it with sender data */
+  if (base_port->status == INACTIVE){
+    printf("Activating %lu %d\n", (unsigned long)sender_addr->sin_addr.s_addr,
+           ntohs(sender_addr->sin_port));
+    activate_port(base_port, sender_addr->sin_addr.s_addr,
+                  ntohs(sender_addr->sin_port));
+    flows_config_changed();
+    watch_port_activated(base_port->number);
+  }
+
+  /* Ignore datagram if it's not authorized */
+  if (sender_addr->sin_addr.s_addr != base_port->sender_addr
+      || sender_addr->sin_port != htons(base_port->sender_port)) {
+    fprintf(stderr, "ignoring unauthorized datagram\n");
+    return 0;
+  }
+
+  /* Increasing counters */
+  atomic_inc(udp_recv + index);
+  udp_recv_bytes[index] += frame->len;
+
+  if (!vec->valid[i]) {
+    atomic_inc(udp_errs + index);
+    fprintf(stderr, "Ignoring truncated frame\n");
+    return 0;
+  }
+
+  /* unpack ethernet frame from UDP */
+  memcpy(&dst_addr, frame->data, ETHER_ADDR_LEN);
+  memcpy(&src_addr, frame->data + ETHER_ADDR_LEN, ETHER_ADDR_LEN);
+  memcpy(&tpid, frame->data + 2 * ETHER_ADDR_LEN, sizeof(tpid));
+  memcpy(&pcp_dei, frame->data + 2 * ETHER_ADDR_LEN + sizeof(tpid),
+    sizeof(pcp_dei));
+  tagged = (ntohs(tpid) == 0x8100);
+
+  /* If frame is tagged, retrieve src_addr and vlan + add it to mac_map */
+  if (tagged) {
+    vlan_number = ntohs(pcp_dei) & 4095;
+    /* If such a vlan number is supported via UDP port, add it to mac map */
+    if (valid_vlan(base_port, vlan_number)) {
+      add_mac(src_addr, vlan_number, ports[index], 1);
+    } else {
+      atomic_inc(udp_errs + index);
+      vlan_drops[vlan_number] += 1;
+      fprintf(stderr, "Ignoring unauthorized vlan number\n");
+      return 0;
+    }
+  } else {
+    /* Frame is not tagged with 802.1Q, VLAN is the untagged one of port */
+    vlan_number = base_port->untagged_vlan;
+    /* If no untagged lan is supported, return */
+    if (vlan_number == -1){
+      atomic_inc(udp_errs + index);
+      fprintf(stderr, "Untagged frame received for tagged-only port\n");
+      return 0;
+    }
+    /* Adding pair <mac, untagged_vlan> */
+    add_mac(src_addr, vlan_number, ports[index], 0);
+  }
+
+  /* Building forwarding decision */
+  if (tagged) {
+    fwd_port = get_port_from_mac(dst_addr, vlan_number);
+  } else {
+    fwd_port = get_untagged_port_from_mac(dst_addr);
+  }
+
+  memset(action, 0, sizeof(*action));
+  action->vlan = vlan_number;
+  action->pcp = base_port->default_pcp;
+  action->client = *sender_addr;
+  if (fwd_port != -1) {
+    /* Receiver found, forward udp frame */
+    action->egress_count = add_egress(egress, 0, fwd_port, vlan_number,
+      tagged);
+  } else {
+    /* Broadcast frame to everyone in a VLAN but the ingress port. Other
+     * ports may share its client address: interfaces of one slijent send
+     * from one UDP port */
+    action->flood = 1;
+    reset_vlan_iterator();
+    while ((fwd_port = vlan_next_port(vlan_number)) != -1) {
+      forward_port = get_port(fwd_port);
+      if (forward_port != NULL && fwd_port != ports[index])
+        action->egress_count = add_egress(egress, action->egress_count,
+          fwd_port, vlan_number, tagged);
+    }
+  }
+
+  return 1;
+}
+
+
+/* Stage: per-frame forwarding decisions in arrival order. Misses go
+ * through classification and learning; once one did, the table may have
+ * changed, so later hits are looked up again */
+static void process_frames(struct frame_vector* vec, int index) {
+  struct flow_action action;
+  struct flow_egress egress[MAX_SOCKETS];
+  port_t* base_port = NULL;
+  int i, revalidate = 0;
+
+  for (i = 0; i < vec->count; i += 1) {
+    vec->flood[i] = -1;
+    if (revalidate && vec->actions[i] != NULL)
+      vec->actions[i] = lookup_frame(vec, i);
+
+    if (vec->actions[i] != NULL) {
+      /* Hit: source learned, VLAN allowed */
+      atomic_inc(udp_recv + index);
+      udp_recv_bytes[index] += vec->frames[i]->len;
+      rewrite_frame(vec, i, vec->actions[i], vec->actions[i]->egress);
+      continue;
+    }
+
+    /* Miss */
+    if (base_port == NULL)
+      base_port = get_port(ports[index]);
+    if (base_port == NULL ||
+        !classify_frame(vec, i, index, base_port, &action, egress))
+      continue;
+    revalidate = 1;
+
+    rewrite_frame(vec, i, &action, egress);
+
+    /* Remembering decision for next frames of the flow */
+    if (action.egress_count <= FLOW_MAX_EGRESS) {
+      memcpy(action.egress, egress,
+        action.egress_count * sizeof(struct flow_egress));
+      flow_insert(&vec->keys[i], vec->hashes[i], &action);
+    }
+  }
+}
+
+
+/* Class of the next frame to send: the highest classes are served with
+ * strict priority, the rest by weighted round robin. taken[c] frames of
+ * class c are already picked for the batch being built */
+static int next_class(struct egress_queue* queue, const int* taken) {
+  int c, tries;
+
+  for (c = PRIORITY_CLASSES - 1; c >= WRR_CLASSES; c -= 1)
+    if (queue->classes[c].count > taken[c])
+      return c;
+
+  for (tries = 0; tries <= WRR_CLASSES; tries += 1) {
+    c = queue->wrr_class;
+    if (queue->wrr_credit > 0 && queue->classes[c].count > taken[c]) {
+      queue->wrr_credit -= 1;
+      return c;
+    }
+    queue->wrr_class = (c == 0) ? WRR_CLASSES - 1 : c - 1;
+    queue->wrr_credit = wrr_weights[queue->wrr_class];
+  }
+
+  return -1;
+}
+
+
+/* Removes n frames in scheduling order. Replays decisions made while the
+ * batch was built, starting from the saved WRR state */
+static void pop_scheduled(int index, int n, int sent, int wrr_class,
+  int wrr_credit) {
+  struct egress_queue* queue = queues[index];
+  int none[PRIORITY_CLASSES] = { 0 };
+
+  queue->wrr_class = wrr_class;
+  queue->wrr_credit = wrr_credit;
+  while (n > 0) {
+    pop_frame(index, next_class(queue, none), sent);
+    n -= 1;
+  }
+}
+
+
+/* Sends queued frames of a port in batches until the queues are empty or
+ * socket buffer is full. In the latter case waits for EV_WRITE, or for
+ * egress event of the transport */
+static void drain_queue(int index) {
+  struct egress_queue* queue = queues[index];
+  struct class_queue* cq;
+  struct mmsghdr msgs[FRAME_BATCH];
+  struct iovec iovs[FRAME_BATCH];
+  struct frame_buf* batch[FRAME_BATCH];
+  int taken[PRIORITY_CLASSES];
+  int c, n, r, slot, wrr_class, wrr_credit;
+
+  while (queue->count > 0) {
+    wrr_class = queue->wrr_class;
+    wrr_credit = queue->wrr_credit;
+    memset(taken, 0, sizeof(taken));
+
+    for (n = 0; n < FRAME_BATCH; n += 1) {
+      c = next_class(queue, taken);
+      if (c == -1)
+        break;
+      cq = &queue->classes[c];
+      slot = (cq->head + taken[c]) % queue_limit;
+      taken[c] += 1;
+
+      batch[n] = cq->frames[slot];
+      iovs[n].iov_base = cq->frames[slot]->data;
+      iovs[n].iov_len = cq->frames[slot]->len;
+      memset(&msgs[n].msg_hdr, 0, sizeof(struct msghdr));
+      msgs[n].msg_hdr.msg_name = &queue->addr;
+      msgs[n].msg_hdr.msg_namelen = sizeof(queue->addr);
+      msgs[n].msg_hdr.msg_iov = &iovs[n];
+      msgs[n].msg_hdr.msg_iovlen = 1;
+    }
+
+    if (transports[index] != NULL)
+      r = transports[index]->send(index, batch, n);
+    else
+      r = sendmmsg(sockets[index], msgs, n, MSG_DONTWAIT);
+    if (r == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+        queue->wrr_class = wrr_class;
+        queue->wrr_credit = wrr_credit;
+        if (!queue->blocked && event_add(queue->ev, NULL) == -1)
+          syserr("Adding egress event");
+        queue->blocked = 1;
+        return;
+      }
+      /* Frame refused, dropping it */
+      fprintf(stderr, "Error in send (%s)\n", strerror(errno));
+      atomic_inc(udp_errs + index);
+      pop_scheduled(index, 1, 0, wrr_class, wrr_credit);
+      continue;
+    }
+    pop_scheduled(index, r, 1, wrr_class, wrr_credit);
+  }
+
+  if (queue->blocked) {
+    if (event_del(queue->ev) == -1)
+      syserr("Deleting egress event");
+    queue->blocked = 0;
+  }
+}
+
+
+/* Event handler on egress socket becoming writable */
+static void egress_manage(evutil_socket_t sock, short ev, void *arg) {
+  drain_queue((int) (intptr_t) arg);
+}
+
+
+/* Stage: send frames queued on ports that are not blocked */
+static void transmit_frames() {
+  int i;
+
+  for (i = 0; i < tx_active_count; i += 1) {
+    queues[tx_active[i]]->active = 0;
+    drain_queue(tx_active[i]);
+  }
+  tx_active_count = 0;
+}
+
+
+/* Stage: latency of every forwarded frame, measured after transmission.
+ * Vector's references to received frames are dropped here */
+static void release_frames(struct frame_vector* vec, int index) {
+  struct timespec now;
+  int i;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  for (i = 0; i < vec->count; i += 1) {
+    if (vec->flood[i] == 1)
+      udp_flood[index] += 1;
+    if (vec->flood[i] != -1 && vec->egress_counts[i] > 0)
+      latency_record(vec->flood[i] ? &lat_flood[index] : &lat_unicast[index],
+        timespec_diff(&vec->frames[i]->received, &now));
+    frame_put(vec->frames[i]);
+    vec->frames[i] = NULL;
+  }
+  vec->count = 0;
+}
+
+
+/* Event handler on UDP packet receiving */
+void udp_manage(evutil_socket_t sock, short ev, void *arg) {
+  int index = (int) (intptr_t) arg;
+  struct frame_vector* vec = &vector;
+
+  if (receive_frames(sock, index, vec) == 0)
+    return;
+
+  parse_frames(vec, index);
+  lookup_frames(vec);
+  process_frames(vec, index);
+  transmit_frames();
+  release_frames(vec, index);
+}
+
+
+/* Egress queue length of one class and policy for a full queue, DROP_TAIL
+ * or DROP_HEAD. Length applies to ports created later */
+void set_egress_queue(int len, int policy) {
+  if (len < 1 || len > EGRESS_QUEUE_MAX)
+    fatal("Egress queue length must be between 1 and %d.", EGRESS_QUEUE_MAX);
+  queue_limit = len;
+  drop_policy = policy;
+}
+
+
+/* Creates egress queues and their drain event for a new port */
+void start_egress(int index, struct event_base* base) {
+  struct egress_queue* queue;
+  struct frame_buf** slots;
+  int c;
+
+  queue = calloc(1, sizeof(*queue));
+  slots = calloc(PRIORITY_CLASSES * queue_limit, sizeof(*slots));
+  if (queue == NULL || slots == NULL)
+    syserr("Allocating egress queue.");
+  for (c = 0; c < PRIORITY_CLASSES; c += 1)
+    queue->classes[c].frames = slots + c * queue_limit;
+  queues[index] = queue;
+
+  queue->wrr_class = WRR_CLASSES - 1;
+  queue->wrr_credit = wrr_weights[WRR_CLASSES - 1];
+  queue->ev = event_new(base, egress_fds[index],
+    egress_events[index] | EV_PERSIST,
+    egress_manage, (void *) (intptr_t) index);
+  if (!queue->ev)
+    syserr("Creating egress event.");
+}
+
+
+/* Drops frames still queued on a removed port */
+void stop_egress(int index) {
+  struct egress_queue* queue = queues[index];
+  int i, c;
+
+  if (queue == NULL)
+    return;
+  if (queue->ev != NULL)
+    event_free(queue->ev);
+  for (c = 0; c < PRIORITY_CLASSES; c += 1)
+    while (queue->classes[c].count > 0)
+      pop_frame(index, c, 0);
+  free(queue->classes[0].frames);
+  free(queue);
+  queues[index] = NULL;
+
+  /* Port may still be on the list of the current batch */
+  for (i = 0; i < tx_active_count; i += 1)
+    if (tx_active[i] == index)
+      tx_active[i] = tx_active[--tx_active_count];
+}
+
+
+/* egress_fds[index] of a port is being replaced (hold 1) or has been
+ * (hold 0). A blocked queue stops waiting meanwhile and then tries again
+ * on the new one */
+void hold_egress(int index, int hold) {
+  struct egress_queue* queue = queues[index];
+
+  if (queue == NULL || !queue->blocked)
+    return;
+  if (hold) {
+    if (event_del(queue->ev) == -1)
+      syserr("Deleting egress event");
+    return;
+  }
+  if (event_add(queue->ev, NULL) == -1)
+    syserr("Adding egress event");
+  event_active(queue->ev, egress_events[index], 0);
+}
+
+
+/* Frames waiting in egress queues of all ports */
+int egress_queued() {
+  int index, count = 0;
+
+  for (index = 0; index < MAX_SOCKETS; index += 1)
+    if (queues[index] != NULL)
+      count += queues[index]->count;
+  return count;
+}
+
+
+/* Copies frame adding 802.1Q tag with given priority, returns new length,
+ * or -1 if the frame has no whole Ethernet header */
+int tag_frame(const char* buffer, int len, char* dst_buffer, int vlan,
+  int pcp){
+  uint16_t tpid, pcp_dei;
+
+  if (len < ETHER_HDR_LEN)
+    return -1;
+
+  /* copy MAC addresses to dst_buffer*/
+  memcpy(dst_buffer, buffer, 12);
+  /* set vlan tag */
+  tpid = htons(0x8100);
+  pcp_dei = htons((pcp << 13) | vlan);
+  memcpy(dst_buffer + 12, &tpid, sizeof(tpid));
+  memcpy(dst_buffer + 14, &pcp_dei, sizeof(pcp_dei));
+  /* copy the rest */
+  memcpy(dst_buffer + 16, buffer + 12, len - 12);
+
+  return len + 4;
+}
+
+
+/* Copies frame removing 802.1Q tag, returns new length, or -1 if the
+ * frame has no whole tagged header */
+int untag_frame(const char* buffer, int len, char* dst_buffer){
+  if (len < ETHER_HDR_LEN + 4)
+    return -1;
+  memcpy(dst_buffer, buffer, 12);
+  memcpy(dst_buffer + 12, buffer + 16, len - 16);
+
+  return len - 4;
+}
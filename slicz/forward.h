@@ -0,0 +1,52 @@
+/*
+ * Author: Konrad Słoniewski
+ * Date:   18 August 2013
+ */
+
+#ifndef _FORWARD_H
+#define _FORWARD_H
+
+#include <arpa/inet.h>
+#include <event2/event.h>
+#include <event2/util.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "ports.h"
+#include "macs.h"
+#include "flows.h"
+#include "latency.h"
+#include "framebuf.h"
+#include "err.h"
+
+/* Definitions */
+#define FRAME_SIZE 1518         /* biggest forwarded frame */
+#define FRAME_BATCH 32          /* frames processed together */
+#define EGRESS_QUEUE_MAX 512    /* longest queue of a class, frames */
+#define EGRESS_QUEUE_DEFAULT 256
+#define DROP_TAIL 0             /* full queue drops new frames */
+#define DROP_HEAD 1             /* full queue drops oldest frames */
+#define PRIORITY_CLASSES 8      /* 802.1p traffic classes */
+#define WRR_CLASSES 5           /* classes below strict priority ones */
+/* Frames blocked ports may hold together, the rest of the pool is left
+ * for receiving and for ports that can send */
+#define EGRESS_BLOCKED_MAX (FRAMEBUF_COUNT * 3 / 4)
+
+/* Global data tables */
+extern latency_t lat_unicast[MAX_SOCKETS];
+extern latency_t lat_flood[MAX_SOCKETS];
+
+/* Functions */
+void udp_manage(evutil_socket_t sock, short ev, void *arg);
+int tag_frame(const char* buffer, int len, char* dst_buffer, int vlan,
+  int pcp);
+int untag_frame(const char* buffer, int len, char* dst_buffer);
+void set_egress_queue(int len, int policy);
+void start_egress(int index, struct event_base* base);
+void stop_egress(int index);
+void hold_egress(int index, int hold);
+int egress_queued();
+
+#endif
@@ -0,0 +1,141 @@
+/*
+ * Author: Konrad Słoniewski
+ * Date:   18 August 2013
+ */
+
+#include "framebuf.h"
+
+/* Attributes */
+
+static struct frame_buf pool[FRAMEBUF_COUNT];
+static struct frame_buf* free_list = NULL;   /* shared by all threads */
+static int free_count = 0;
+static int free_lock = 0;
+
+/* Buffers of one thread, taken and returned without locking */
+static __thread struct frame_buf* cache = NULL;
+static __thread int cache_count = 0;
+
+
+/* Functions */
+
+static void lock_pool() {
+  while (__sync_lock_test_and_set(&free_lock, 1))
+    ;
+}
+
+
+static void unlock_pool() {
+  __sync_lock_release(&free_lock);
+}
+
+
+/* Puts all buffers on the shared free list */
+void init_frame_pool() {
+  int i;
+
+  free_list = NULL;
+  for (i = FRAMEBUF_COUNT - 1; i >= 0; i -= 1) {
+    pool[i].next = free_list;
+    free_list = &pool[i];
+  }
+  free_count = FRAMEBUF_COUNT;
+}
+
+
+/* Moves half of a cache worth of buffers from the shared list */
+static void refill_cache() {
+  struct frame_buf* frame;
+
+  lock_pool();
+  while (free_list != NULL && cache_count < FRAMEBUF_CACHE / 2) {
+    frame = free_list;
+    free_list = frame->next;
+    free_count -= 1;
+    frame->next = cache;
+    cache = frame;
+    cache_count += 1;
+  }
+  unlock_pool();
+}
+
+
+/* Gives half of the cache back to the shared list */
+static void spill_cache() {
+  struct frame_buf* frame;
+
+  lock_pool();
+  while (cache_count > FRAMEBUF_CACHE / 2) {
+    frame = cache;
+    cache = frame->next;
+    cache_count -= 1;
+    frame->next = free_list;
+    free_list = frame;
+    free_count += 1;
+  }
+  unlock_pool();
+}
+
+
+/* Returns empty buffer with one reference, NULL if the pool is exhausted */
+struct frame_buf* frame_alloc() {
+  struct frame_buf* frame;
+
+  if (cache == NULL)
+    refill_cache();
+  if (cache == NULL)
+    return NULL;
+
+  frame = cache;
+  cache = frame->next;
+  cache_count -= 1;
+
+  frame->next = NULL;
+  frame->data = frame->buffer + FRAMEBUF_HEADROOM;
+  frame->len = 0;
+  frame->ingress = -1;
+  frame->priority = 0;
+  frame->refs = 1;
+
+  return frame;
+}
+
+
+void frame_get(struct frame_buf* frame) {
+  __sync_fetch_and_add(&frame->refs, 1);
+}
+
+
+/* Drops a reference, the last one returns buffer to the pool */
+void frame_put(struct frame_buf* frame) {
+  if (__sync_sub_and_fetch(&frame->refs, 1) != 0)
+    return;
+
+  frame->next = cache;
+  cache = frame;
+  cache_count += 1;
+  if (cache_count > FRAMEBUF_CACHE)
+    spill_cache();
+}
+
+
+/* Extends frame at the front by len bytes of headroom */
+char* frame_push(struct frame_buf* frame, int len) {
+  frame->data -= len;
+  frame->len += len;
+  return frame->data;
+}
+
+
+/* Removes len bytes from the front of frame */
+char* frame_pull(struct frame_buf* frame, int len) {
+  frame->data += len;
+  frame->len -= len;
+  return frame->data;
+}
+
+
+/* Buffers on the shared free list, thread caches not included */
+int frame_pool_available() {
+  return free_count;
+}
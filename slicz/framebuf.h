@@ -0,0 +1,44 @@
+/*
+ * Author: Konrad Słoniewski
+ * Date:   18 August 2013
+ */
+
+#ifndef _FRAMEBUF_H
+#define _FRAMEBUF_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+/* Definitions */
+#define FRAMEBUF_HEADROOM 64     /* room for tags pushed in front of frame */
+#define FRAMEBUF_DATA 1536       /* biggest frame with a tag, 64 multiple */
+#define FRAMEBUF_COUNT 8192      /* buffers in the pool */
+#define FRAMEBUF_CACHE 64        /* buffers cached by one thread */
+
+/* Structs */
+
+/* Frame buffer shared by everyone who forwards the frame. Last frame_put()
+ * returns it to the pool */
+struct frame_buf {
+  char* data;                    /* first byte of frame */
+  int len;                       /* frame length */
+  int ingress;                   /* socket index of ingress port */
+  int priority;                  /* 802.1p PCP */
+  struct timespec received;      /* kernel receive time */
+  int refs;
+  struct frame_buf* next;        /* free list */
+  char buffer[FRAMEBUF_HEADROOM + FRAMEBUF_DATA]
+    __attribute__((aligned(64)));
+};
+
+/* Functions */
+void init_frame_pool();
+struct frame_buf* frame_alloc();
+void frame_get(struct frame_buf* frame);
+void frame_put(struct frame_buf* frame);
+char* frame_push(struct frame_buf* frame, int len);
+char* frame_pull(struct frame_buf* frame, int len);
+int frame_pool_available();
+
+#endif
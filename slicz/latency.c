@@ -0,0 +1,82 @@
+/*
+ * Author: Konrad Słoniewski
+ * Date:   18 August 2013
+ */
+
+#include <string.h>
+
+#include "latency.h"
+
+
+/* Bucket of a value: values below 2^LATENCY_SUB_BITS get their own buckets,
+ * bigger ones share a bucket with values of the same highest bits */
+static int bucket_index(unsigned long long value) {
+  int shift = 0;
+
+  if (value >> LATENCY_SUB_BITS)
+    shift = 63 - __builtin_clzll(value) - LATENCY_SUB_BITS;
+
+  return (shift << LATENCY_SUB_BITS) + (int) (value >> shift);
+}
+
+
+/* Highest value falling into a bucket */
+static unsigned long long bucket_value(int index) {
+  int shift = (index >> LATENCY_SUB_BITS) - 1;
+  unsigned long long sub;
+
+  if (shift <= 0)
+    return index;
+
+  sub = (index & ((1 << LATENCY_SUB_BITS) - 1)) + (1 << LATENCY_SUB_BITS);
+  return ((sub + 1) << shift) - 1;
+}
+
+
+void latency_record(latency_t* hist, unsigned long long ns) {
+  hist->counts[bucket_index(ns)] += 1;
+  hist->total += 1;
+  hist->sum += ns;
+  if (ns > hist->max)
+    hist->max = ns;
+}
+
+
+/* Returns value below which p (0..1) of recorded values lie */
+unsigned long long latency_percentile(const latency_t* hist, double p) {
+  unsigned long long target, seen;
+  int i;
+
+  if (hist->total == 0)
+    return 0;
+
+  target = (unsigned long long) (p * hist->total);
+  if (target < p * hist->total || target == 0)
+    target += 1;
+
+  seen = 0;
+  for (i = 0; i < LATENCY_BUCKETS; i += 1) {
+    seen += hist->counts[i];
+    if (seen >= target)
+      return bucket_value(i) < hist->max ? bucket_value(i) : hist->max;
+  }
+
+  return hist->max;
+}
+
+
+void latency_reset(latency_t* hist) {
+  memset(hist, 0, sizeof(*hist));
+}
+
+
+/* Nanoseconds from one moment to another, 0 if clock went backwards */
+unsigned long long timespec_diff(const struct timespec* from,
+  const struct timespec* to) {
+  long long ns;
+
+  ns = (long long) (to->tv_sec - from->tv_sec) * 1000000000LL +
+    (to->tv_nsec - from->tv_nsec);
+
+  return ns > 0 ? ns : 0;
+}
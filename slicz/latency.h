@@ -0,0 +1,33 @@
+/*
+ * Author: Konrad Słoniewski
+ * Date:   18 August 2013
+ */
+
+#ifndef _LATENCY_H
+#define _LATENCY_H
+
+#include <time.h>
+
+/* Definitions */
+#define LATENCY_SUB_BITS 4   /* 16 buckets per power of two, ~6% precision */
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)
+
+/* Log-bucketed (HDR-style) histogram of nanosecond values */
+struct latency_hist {
+  unsigned long long counts[LATENCY_BUCKETS];
+  unsigned long long total;  /* number of recorded values */
+  unsigned long long sum;    /* sum of recorded values */
+  unsigned long long max;    /* exact maximum */
+};
+
+/* Types */
+typedef struct latency_hist latency_t;
+
+/* Functions */
+void latency_record(latency_t* hist, unsigned long long ns);
+unsigned long long latency_percentile(const latency_t* hist, double p);
+void latency_reset(latency_t* hist);
+unsigned long long timespec_diff(const struct timespec* from,
+  const struct timespec* to);
+
+#endif
@@ -0,0 +1,506 @@
+/*
+ * Author: Konrad Słoniewski
+ * Date:   18 August 2013
+ */
+
+/* Load generator and reflector of slijent, running without TAP.
+ *
+ * The generator sends synthetic frames to one switch port at a given
+ * rate, the reflector attached to another port sends every such frame
+ * back to its source. The generator then counts loss and reordering of
+ * replies and their round-trip time, measured with its own clock only. */
+
+#define _GNU_SOURCE        /* sendmmsg, recvmmsg */
+
+#include "loadgen.h"
+
+/* Structures */
+struct load_batch {
+  char bufs[LOAD_BATCH][LOAD_MAX_FRAME + 1];
+  struct iovec iovs[LOAD_BATCH];
+  struct mmsghdr msgs[LOAD_BATCH];
+};
+
+/* Counters, interval ones are zeroed by every report */
+struct load_stats {
+  unsigned long long sent;
+  unsigned long long received;
+  unsigned long long reflected;
+  latency_t rtt;
+};
+
+/* Global variables */
+static struct load_options opts;
+static struct event_base* load_base;
+static int generate_sock = -1;
+static int reflect_sock = -1;
+static struct load_batch tx;                /* generator requests */
+static struct load_batch rx;                /* generator replies */
+static struct load_batch echo;              /* reflector */
+static struct event* send_event;            /* pacing timer or EV_WRITE */
+static struct event* reply_event;
+static struct event* reflect_event;
+static struct event* announce_event;
+static struct event* report_event;
+static struct event* stop_event;            /* start, end and drain */
+static struct event* sigint_event;
+static uint64_t started_ns;                 /* of sending */
+static uint64_t scheduled;                  /* frames due so far */
+static unsigned long long late;             /* skipped by a slow sender */
+static unsigned long long reordered;
+static unsigned long long reflect_errors;
+static uint64_t highest_seq;                /* of received replies */
+static int any_reply;
+static struct load_stats total;
+static struct load_stats interval;
+static const struct ether_addr broadcast_mac = {
+  { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff }
+};
+
+
+/* Functions */
+
+static uint64_t now_ns() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+
+/* Default options: 64-byte untagged unicast frames for 10 seconds */
+void init_load_options(struct load_options* options) {
+  memset(options, 0, sizeof(*options));
+  read_load_mac("02:00:00:00:00:01", &options->src_mac);
+  read_load_mac("02:00:00:00:00:02", &options->dst_mac);
+  options->frame_size = 64;
+  options->rate = 1000;
+  options->duration = 10;
+  options->vlan = -1;
+}
+
+
+void read_load_mac(const char* raw, struct ether_addr* mac) {
+  if (ether_aton_r(raw, mac) == NULL)
+    fatal("Wrong MAC address %s.", raw);
+}
+
+
+static int open_socket() {
+  struct sockaddr_in local_addr;
+  int sock;
+
+  sock = socket(PF_INET, SOCK_DGRAM, 0);
+  if (sock < 0)
+    syserr("socket");
+  if (evutil_make_socket_nonblocking(sock))
+    syserr("Making socket nonblocking.");
+
+  memset(&local_addr, 0, sizeof(local_addr));
+  local_addr.sin_family = AF_INET;
+  local_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  local_addr.sin_port = htons(0);
+  if (bind(sock, (struct sockaddr*) &local_addr, sizeof(local_addr)))
+    syserr("bind");
+
+  return sock;
+}
+
+
+/* Prepares batch descriptors, frames of a sent batch go to addr */
+static void init_batch(struct load_batch* batch, struct sockaddr_in* addr) {
+  int i;
+
+  memset(batch->msgs, 0, sizeof(batch->msgs));
+  for (i = 0; i < LOAD_BATCH; i += 1) {
+    batch->iovs[i].iov_base = batch->bufs[i];
+    batch->iovs[i].iov_len = LOAD_MAX_FRAME + 1;
+    batch->msgs[i].msg_hdr.msg_iov = &batch->iovs[i];
+    batch->msgs[i].msg_hdr.msg_iovlen = 1;
+    batch->msgs[i].msg_hdr.msg_name = addr;
+    batch->msgs[i].msg_hdr.msg_namelen = (addr == NULL) ? 0 : sizeof(*addr);
+  }
+}
+
+
+/* Writes Ethernet header and probe of a given kind, returns frame length */
+static int build_frame(char* frame, const struct ether_addr* dst,
+  const struct ether_addr* src, uint32_t kind) {
+  struct load_probe probe;
+  uint16_t value;
+  int offset;
+
+  memset(frame, 0, opts.frame_size);
+  memcpy(frame, dst, ETHER_ADDR_LEN);
+  memcpy(frame + ETHER_ADDR_LEN, src, ETHER_ADDR_LEN);
+  offset = 2 * ETHER_ADDR_LEN;
+  if (opts.vlan >= 0) {
+    value = htons(ETHERTYPE_VLAN);
+    memcpy(frame + offset, &value, 2);
+    value = htons((opts.pcp << 13) | opts.vlan);
+    memcpy(frame + offset + 2, &value, 2);
+    offset += 4;
+  }
+  value = htons(LOAD_ETHERTYPE);
+  memcpy(frame + offset, &value, 2);
+  offset += 2;
+
+  probe.magic = htonl(LOAD_MAGIC);
+  probe.kind = htonl(kind);
+  probe.seq = 0;
+  probe.sent_ns = 0;
+  memcpy(frame + offset, &probe, sizeof(probe));
+
+  return opts.frame_size;
+}
+
+
+/* Returns probe of a frame, NULL if the frame is not ours */
+static struct load_probe* find_probe(char* frame, int len) {
+  struct load_probe* probe;
+  uint16_t type;
+  int offset;
+
+  offset = 2 * ETHER_ADDR_LEN;
+  if (len < offset + 2)
+    return NULL;
+  memcpy(&type, frame + offset, 2);
+  if (ntohs(type) == ETHERTYPE_VLAN) {
+    offset += 4;
+    if (len < offset + 2)
+      return NULL;
+    memcpy(&type, frame + offset, 2);
+  }
+  offset += 2;
+  if (ntohs(type) != LOAD_ETHERTYPE ||
+      len < offset + (int) sizeof(struct load_probe))
+    return NULL;
+
+  probe = (struct load_probe*) (frame + offset);
+  if (ntohl(probe->magic) != LOAD_MAGIC)
+    return NULL;
+  return probe;
+}
+
+
+/* Sends at most count requests, returns how many were sent */
+static int send_requests(int count) {
+  struct load_probe* probe;
+  uint64_t seq, stamp;
+  int i, r;
+
+  if (count > LOAD_BATCH)
+    count = LOAD_BATCH;
+  stamp = now_ns();
+  for (i = 0; i < count; i += 1) {
+    seq = total.sent + i;
+    probe = find_probe(tx.bufs[i], opts.frame_size);
+    memcpy(tx.bufs[i], (seq % 100 < (unsigned) opts.broadcast) ?
+      &broadcast_mac : &opts.dst_mac, ETHER_ADDR_LEN);
+    probe->seq = htobe64(seq);
+    probe->sent_ns = htobe64(stamp);
+  }
+
+  r = sendmmsg(generate_sock, tx.msgs, count, 0);
+  if (r < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS)
+      perror("sending data");
+    return 0;
+  }
+
+  total.sent += r;
+  interval.sent += r;
+  return r;
+}
+
+
+/* Pacing timer, sends frames due since the start. A sender that cannot
+ * keep up skips frames instead of bursting them later */
+static void send_paced(evutil_socket_t sock, short ev, void* arg) {
+  uint64_t elapsed, due;
+  int r;
+
+  /* Whole seconds apart, elapsed nanoseconds times rate would overflow
+   * after some hours */
+  elapsed = now_ns() - started_ns;
+  due = elapsed / 1000000000ULL * opts.rate +
+    elapsed % 1000000000ULL * opts.rate / 1000000000ULL;
+  if (due - scheduled > LOAD_TICK_BURST) {
+    late += due - scheduled - LOAD_TICK_BURST;
+    scheduled = due - LOAD_TICK_BURST;
+  }
+
+  while (scheduled < due) {
+    r = send_requests(due - scheduled);
+    if (r == 0)
+      break;
+    scheduled += r;
+  }
+}
+
+
+/* Socket is writable, sends the next batch at maximum rate */
+static void send_ready(evutil_socket_t sock, short ev, void* arg) {
+  send_requests(LOAD_BATCH);
+}
+
+
+/* Receives reflected frames of the generator */
+static void read_replies(evutil_socket_t sock, short ev, void* arg) {
+  struct load_probe* probe;
+  uint64_t seq, now;
+  int received, i;
+
+  do {
+    for (i = 0; i < LOAD_BATCH; i += 1)
+      rx.iovs[i].iov_len = LOAD_MAX_FRAME + 1;
+    received = recvmmsg(generate_sock, rx.msgs, LOAD_BATCH, MSG_DONTWAIT,
+      NULL);
+    if (received < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        perror("reading data");
+      return;
+    }
+
+    now = now_ns();
+    for (i = 0; i < received; i += 1) {
+      probe = find_probe(rx.bufs[i], rx.msgs[i].msg_len);
+      if (probe == NULL || ntohl(probe->kind) != LOAD_REPLY)
+        continue;
+
+      seq = be64toh(probe->seq);
+      if (any_reply && seq < highest_seq)
+        reordered += 1;
+      else
+        highest_seq = seq;
+      any_reply = 1;
+
+      total.received += 1;
+      interval.received += 1;
+      latency_record(&total.rtt, now - be64toh(probe->sent_ns));
+      latency_record(&interval.rtt, now - be64toh(probe->sent_ns));
+    }
+  } while (received == LOAD_BATCH);
+}
+
+
+/* Sends requests received by the reflector back to their source */
+static void reflect_frames(evutil_socket_t sock, short ev, void* arg) {
+  struct load_probe* probe;
+  int received, count, sent, r, i;
+
+  do {
+    for (i = 0; i < LOAD_BATCH; i += 1)
+      echo.iovs[i].iov_len = LOAD_MAX_FRAME + 1;
+    received = recvmmsg(reflect_sock, echo.msgs, LOAD_BATCH, MSG_DONTWAIT,
+      NULL);
+    if (received < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        perror("reading data");
+      return;
+    }
+
+    /* Replies are moved to the front of the batch */
+    count = 0;
+    for (i = 0; i < received; i += 1) {
+      probe = find_probe(echo.bufs[i], echo.msgs[i].msg_len);
+      if (probe == NULL || ntohl(probe->kind) != LOAD_REQUEST)
+        continue;
+      probe->kind = htonl(LOAD_REPLY);
+      memcpy(echo.bufs[i], echo.bufs[i] + ETHER_ADDR_LEN, ETHER_ADDR_LEN);
+      memcpy(echo.bufs[i] + ETHER_ADDR_LEN, &opts.dst_mac, ETHER_ADDR_LEN);
+      if (count != i)
+        memcpy(echo.bufs[count], echo.bufs[i], echo.msgs[i].msg_len);
+      echo.iovs[count].iov_len = echo.msgs[i].msg_len;
+      count += 1;
+    }
+
+    sent = 0;
+    while (sent < count) {
+      r = sendmmsg(reflect_sock, echo.msgs + sent, count - sent, 0);
+      if (r < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS)
+          perror("sending data");
+        reflect_errors += count - sent;
+        break;
+      }
+      sent += r;
+    }
+    total.reflected += sent;
+    interval.reflected += sent;
+  } while (received == LOAD_BATCH);
+}
+
+
+/* Broadcast from the reflector MAC, so the switch learns where it is and
+ * keeps the port of the reflector active */
+static void announce(evutil_socket_t sock, short ev, void* arg) {
+  char frame[LOAD_MAX_FRAME];
+  struct sockaddr_in* addr = &opts.reflect_addr;
+  int len;
+
+  len = build_frame(frame, &broadcast_mac, &opts.dst_mac, LOAD_ANNOUNCE);
+  if (sendto(reflect_sock, frame, len, 0, (struct sockaddr*) addr,
+             sizeof(*addr)) < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+    perror("sending data");
+}
+
+
+static void print_rtt(const latency_t* rtt) {
+  fprintf(stderr, "rtt p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f us",
+    latency_percentile(rtt, 0.5) / 1e3, latency_percentile(rtt, 0.9) / 1e3,
+    latency_percentile(rtt, 0.99) / 1e3,
+    latency_percentile(rtt, 0.999) / 1e3, rtt->max / 1e3);
+}
+
+
+/* Prints rates of the last second */
+static void report(evutil_socket_t sock, short ev, void* arg) {
+  if (opts.generate) {
+    fprintf(stderr, "tx %llu f/s %.3f Mb/s  rx %llu f/s  ", interval.sent,
+      interval.sent * opts.frame_size * 8 / 1e6, interval.received);
+    print_rtt(&interval.rtt);
+  }
+  if (opts.reflect)
+    fprintf(stderr, "%sreflected %llu f/s", opts.generate ? "  " : "",
+      interval.reflected);
+  fprintf(stderr, "\n");
+
+  interval.sent = 0;
+  interval.received = 0;
+  interval.reflected = 0;
+  latency_reset(&interval.rtt);
+}
+
+
+/* Prints totals and leaves the event loop */
+static void finish(evutil_socket_t sock, short ev, void* arg) {
+  unsigned long long lost;
+
+  if (opts.generate) {
+    lost = (total.sent > total.received) ? total.sent - total.received : 0;
+    fprintf(stderr, "sent %llu frames (%llu late), received %llu, lost %llu "
+      "(%.3f%%), reordered %llu\n", total.sent, late, total.received, lost,
+      total.sent ? 100.0 * lost / total.sent : 0.0, reordered);
+    print_rtt(&total.rtt);
+    fprintf(stderr, "\n");
+  }
+  if (opts.reflect)
+    fprintf(stderr, "reflected %llu frames, %llu not sent\n",
+      total.reflected, reflect_errors);
+
+  event_base_loopbreak(load_base);
+}
+
+
+/* Stops sending at the end of the test, replies are waited for a while */
+static void stop_sending(evutil_socket_t sock, short ev, void* arg) {
+  struct timeval drain = { 0, LOAD_DRAIN_MSEC * 1000 };
+
+  event_free(send_event);
+  send_event = NULL;
+  event_free(stop_event);
+  stop_event = evtimer_new(load_base, finish, NULL);
+  if (!stop_event || event_add(stop_event, &drain) == -1)
+    syserr("Adding drain timer.");
+}
+
+
+/* Starts sending once the reflector had time to announce itself */
+static void start_sending(evutil_socket_t sock, short ev, void* arg) {
+  struct timeval tick = { 0, LOAD_TICK_USEC };
+  struct timeval duration = { opts.duration, 0 };
+
+  if (opts.rate > 0) {
+    send_event = event_new(load_base, -1, EV_PERSIST, send_paced, NULL);
+    if (!send_event || event_add(send_event, &tick) == -1)
+      syserr("Adding pacing timer.");
+  } else {
+    send_event = event_new(load_base, generate_sock, EV_WRITE|EV_PERSIST,
+      send_ready, NULL);
+    if (!send_event || event_add(send_event, NULL) == -1)
+      syserr("Adding send event.");
+  }
+  started_ns = now_ns();
+
+  event_free(stop_event);
+  stop_event = evtimer_new(load_base, stop_sending, NULL);
+  if (!stop_event || event_add(stop_event, &duration) == -1)
+    syserr("Adding end timer.");
+}
+
+
+static void add_event(struct event** ev, int sock, short what,
+  event_callback_fn handler, const struct timeval* period) {
+  *ev = event_new(load_base, sock, what, handler, NULL);
+  if (!*ev || event_add(*ev, period) == -1)
+    syserr("Adding event.");
+}
+
+
+/* Generates and/or reflects frames until the end of the test or SIGINT */
+void run_load(const struct load_options* options) {
+  struct timeval second = { 1, 0 };
+  struct timeval start = { 0, LOAD_START_MSEC * 1000 };
+  int i;
+
+  opts = *options;
+  if (opts.frame_size < LOAD_MIN_FRAME || opts.frame_size > LOAD_MAX_FRAME)
+    fatal("Frame size must be between %d and %d.", LOAD_MIN_FRAME,
+      LOAD_MAX_FRAME);
+  if (opts.vlan >= 4096 || opts.pcp < 0 || opts.pcp > 7 ||
+      opts.broadcast < 0 || opts.broadcast > 100 || opts.rate < 0 ||
+      opts.duration <= 0)
+    fatal("Wrong load parameters.");
+
+  load_base = event_base_new();
+  if (!load_base)
+    syserr("Error creating base.");
+
+  if (opts.reflect) {
+    reflect_sock = open_socket();
+    init_batch(&echo, &opts.reflect_addr);
+    add_event(&reflect_event, reflect_sock, EV_READ|EV_PERSIST,
+      reflect_frames, NULL);
+    add_event(&announce_event, -1, EV_PERSIST, announce, &second);
+    announce(-1, 0, NULL);
+  }
+
+  if (opts.generate) {
+    generate_sock = open_socket();
+    init_batch(&tx, &opts.generate_addr);
+    init_batch(&rx, NULL);
+    for (i = 0; i < LOAD_BATCH; i += 1)
+      tx.iovs[i].iov_len = build_frame(tx.bufs[i], &opts.dst_mac,
+        &opts.src_mac, LOAD_REQUEST);
+    add_event(&reply_event, generate_sock, EV_READ|EV_PERSIST, read_replies,
+      NULL);
+    add_event(&stop_event, -1, 0, start_sending, &start);
+  }
+
+  add_event(&report_event, -1, EV_PERSIST, report, &second);
+  sigint_event = evsignal_new(load_base, SIGINT, finish, NULL);
+  if (!sigint_event || event_add(sigint_event, NULL) == -1)
+    syserr("Error adding SIGINT event.");
+
+  if (event_base_dispatch(load_base) == -1)
+    syserr("Error running slijent dispatch loop.");
+
+  if (send_event != NULL)
+    event_free(send_event);
+  if (stop_event != NULL)
+    event_free(stop_event);
+  if (reply_event != NULL)
+    event_free(reply_event);
+  if (reflect_event != NULL)
+    event_free(reflect_event);
+  if (announce_event != NULL)
+    event_free(announce_event);
+  event_free(report_event);
+  event_free(sigint_event);
+  event_base_free(load_base);
+  if (generate_sock != -1)
+    close(generate_sock);
+  if (reflect_sock != -1)
+    close(reflect_sock);
+}
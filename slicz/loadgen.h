@@ -0,0 +1,72 @@
+/*
+ * Author: Konrad Słoniewski
+ * Date:   18 August 2013
+ */
+
+#ifndef _LOADGEN_H
+#define _LOADGEN_H
+
+#include <endian.h>
+#include <event2/event.h>
+#include <errno.h>
+#include <net/ethernet.h>
+#include <netinet/ether.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "latency.h"
+#include "err.h"
+
+/* Definitions */
+#define LOAD_BATCH 32              /* frames per sendmmsg/recvmmsg call */
+#define LOAD_MIN_FRAME 60          /* without FCS */
+#define LOAD_MAX_FRAME 1518
+#define LOAD_TICK_USEC 1000        /* pacing period of a given rate */
+#define LOAD_TICK_BURST 1024       /* frames sent late at most per tick */
+#define LOAD_START_MSEC 200        /* reflector announces itself meanwhile */
+#define LOAD_DRAIN_MSEC 500        /* late replies after the last frame */
+#define LOAD_ETHERTYPE 0x88b5      /* local experimental */
+#define LOAD_MAGIC 0x534c4a50      /* "SLJP" */
+#define LOAD_REQUEST 0             /* kinds of probe frames */
+#define LOAD_REPLY 1
+#define LOAD_ANNOUNCE 2
+
+/* Structures */
+
+/* Payload of generated frames, after the Ethernet (and 802.1Q) header.
+ * The reflector only changes kind, so times are of the generator clock */
+struct load_probe {
+  uint32_t magic;
+  uint32_t kind;
+  uint64_t seq;
+  uint64_t sent_ns;                /* CLOCK_MONOTONIC of the generator */
+} __attribute__((packed));
+
+struct load_options {
+  int generate;                    /* frames are sent to generate_addr */
+  struct sockaddr_in generate_addr;
+  int reflect;                     /* frames of reflect_addr come back */
+  struct sockaddr_in reflect_addr;
+  struct ether_addr src_mac;       /* generator */
+  struct ether_addr dst_mac;       /* reflector */
+  int frame_size;                  /* bytes without FCS */
+  long rate;                       /* frames per second, 0 for maximum */
+  int duration;                    /* seconds */
+  int vlan;                        /* 802.1Q tag, -1 for untagged frames */
+  int pcp;
+  int broadcast;                   /* percent of broadcast frames */
+};
+
+/* Functions */
+void init_load_options(struct load_options* options);
+void read_load_mac(const char* raw, struct ether_addr* mac);
+void run_load(const struct load_options* options);
+
+#endif
@@ -4,46 +4,222 @@
  */
 
 #include "macs.h"
+#include "ports.h"        /* MAX_VLANS */
+#include "watch.h"        /* watch_mac() */
 
 /* Attributes */
 
+static mac_t slots[MAC_MAX_CAP];
+static int buckets[MAC_BUCKETS];        /* first slot of a MAC hash, or -1 */
+static int free_slot = -1;              /* free slots linked by hash_next */
+static int initialized = 0;
+static struct mac_links lists_age;      /* prev - last slot, next - first */
+static struct mac_links lists_vlan[MAX_VLANS];
+static struct mac_links lists_port[MAX_PORT_NUMBER + 1];
+static unsigned long long last_seq = 0;
 static int capacity = 0;
-static mac_t *head = NULL;
-static mac_t guard;
-static mac_t* iterator;
+static int iterator = -1;               /* slot of VLAN iteration */
+static int iterator_reset = 1;
+static unsigned long long learned = 0;  /* MACs ever added */
+static unsigned long long evicted = 0;  /* MACs removed from a full table */
+/* Change counters of MACs (by hash, in all VLANs) and of VLANs */
+static unsigned long mac_generations[MAC_GENERATIONS];
+static unsigned long vlan_generations[MAX_VLANS];
 
 
 /* Functions */
 
-void delete_first_mac() {
-  mac_t *trash;
-  if (head != NULL) {
-    trash = head;
-    head = head->next;
-    free(trash);
-    capacity -= 1;
+static void init_table() {
+  int i;
+
+  for (i = 0; i < MAC_BUCKETS; i += 1)
+    buckets[i] = -1;
+  for (i = MAC_MAX_CAP - 1; i >= 0; i -= 1) {
+    slots[i].seq = 0;
+    slots[i].hash_next = free_slot;
+    free_slot = i;
   }
+  lists_age.prev = lists_age.next = -1;
+  for (i = 0; i < MAX_VLANS; i += 1)
+    lists_vlan[i].prev = lists_vlan[i].next = -1;
+  for (i = 0; i <= MAX_PORT_NUMBER; i += 1)
+    lists_port[i].prev = lists_port[i].next = -1;
+  initialized = 1;
+}
+
+
+/* List of an entry, its prev is the last slot and next the first one */
+static struct mac_links* get_list(int list, const mac_t* node) {
+  if (list == MAC_BY_VLAN)
+    return &lists_vlan[node->vlan];
+  if (list == MAC_BY_PORT)
+    return &lists_port[node->port];
+  return &lists_age;
+}
+
+
+static void list_append(int list, int slot) {
+  struct mac_links* ends = get_list(list, &slots[slot]);
+
+  slots[slot].links[list].prev = ends->prev;
+  slots[slot].links[list].next = -1;
+  if (ends->prev != -1)
+    slots[ends->prev].links[list].next = slot;
+  else
+    ends->next = slot;
+  ends->prev = slot;
+}
+
+
+static void list_remove(int list, int slot) {
+  struct mac_links* ends = get_list(list, &slots[slot]);
+  struct mac_links* links = &slots[slot].links[list];
+
+  if (links->prev != -1)
+    slots[links->prev].links[list].next = links->next;
+  else
+    ends->next = links->next;
+  if (links->next != -1)
+    slots[links->next].links[list].prev = links->prev;
+  else
+    ends->prev = links->prev;
+}
+
+
+/* Bucket of a MAC in all VLANs */
+static unsigned mac_hash(struct ether_addr mac) {
+  const uint8_t* octet = mac.ether_addr_octet;
+  unsigned hash;
+
+  hash = (octet[2] << 24 | octet[3] << 16 | octet[4] << 8 | octet[5]) ^
+    (octet[0] << 8 | octet[1]);
+  hash *= 2654435761u;
+  return (hash >> 8) & (MAC_BUCKETS - 1);
+}
+
+
+/* Flows from or to the MAC of an entry and flooded in its VLAN are stale */
+static void entry_changed(int slot) {
+  mac_generations[mac_hash(slots[slot].mac) & (MAC_GENERATIONS - 1)] += 1;
+  vlan_generations[slots[slot].vlan] += 1;
+}
+
+
+/* Entry becomes the newest one of its lists */
+static void link_entry(int slot) {
+  int list;
+
+  slots[slot].seq = ++last_seq;
+  for (list = 0; list < MAC_LISTS; list += 1)
+    list_append(list, slot);
+  entry_changed(slot);
+}
+
+
+static void unlink_entry(int slot) {
+  int list;
+
+  for (list = 0; list < MAC_LISTS; list += 1)
+    list_remove(list, slot);
+  entry_changed(slot);
+}
+
+
+/* Removes the oldest entry */
+void delete_first_mac() {
+  int slot = lists_age.next;
+  int* link;
+
+  if (!initialized || slot == -1)
+    return;
+  unlink_entry(slot);
+  for (link = &buckets[mac_hash(slots[slot].mac)]; *link != slot;
+       link = &slots[*link].hash_next)
+    ;
+  *link = slots[slot].hash_next;
+
+  slots[slot].seq = 0;
+  slots[slot].hash_next = free_slot;
+  free_slot = slot;
+  capacity -= 1;
 }
 
 
 void clean_mac_map() {
-  while(head != NULL) {
+  while (initialized && lists_age.next != -1) {
     delete_first_mac();
   }
 }
 
 
+/* Slot of a MAC in a VLAN, -1 if it is not known */
+static int find_mac(struct ether_addr mac, int vlan) {
+  int slot;
+
+  if (!initialized)
+    return -1;
+  for (slot = buckets[mac_hash(mac)]; slot != -1;
+       slot = slots[slot].hash_next)
+    if (slots[slot].vlan == vlan && compare_macs(slots[slot].mac, mac))
+      return slot;
+  return -1;
+}
+
+
+/* New entry, the table is not full */
+static void insert_mac(struct ether_addr mac, int vlan, int port,
+  int is_tagged) {
+  mac_t* node;
+  int slot;
+  unsigned bucket;
+
+  slot = free_slot;
+  node = &slots[slot];
+  free_slot = node->hash_next;
+  node->mac = mac;
+  node->vlan = vlan;
+  node->is_tagged = is_tagged;
+  node->port = port;
+  bucket = mac_hash(mac);
+  node->hash_next = buckets[bucket];
+  buckets[bucket] = slot;
+  link_entry(slot);
+  capacity += 1;
+}
+
+
+/* Learns a MAC, a known one seen on another port has moved there. Returns
+ * 1 if the table changed, -1 if the MAC is known at the port */
 int add_mac(struct ether_addr mac, int vlan, int port, int is_tagged) {
   mac_t* node;
+  int slot, old_port;
+
+  if (!initialized)
+    init_table();
 
   /* Check if already exists */
-  if (get_port_from_mac(mac, vlan) != INACTIVE_PORT) {
+  slot = find_mac(mac, vlan);
+  if (slot != -1 && slots[slot].port == port) {
     return -1;
   }
+  if (slot != -1) {
+    node = &slots[slot];
+    old_port = node->port;
+    unlink_entry(slot);
+    node->port = port;
+    node->is_tagged = is_tagged;
+    link_entry(slot);
+    watch_mac(WATCH_MAC_MOVED, mac, vlan, port, old_port);
+    return 1;
+  }
 
   /* Checking max value */
   if (capacity >= MAC_MAX_CAP) {
+    node = &slots[lists_age.next];
+    watch_mac(WATCH_MAC_EVICTED, node->mac, node->vlan, node->port,
+      INACTIVE_PORT);
     delete_first_mac();
+    evicted += 1;
   }
 
   fprintf(stderr, "Added: %x-%x-%x-%x-%x-%x vlan %d a port %d\n",
@@ -51,79 +227,180 @@ int add_mac(struct ether_addr mac, int vlan, int port, int is_tagged) {
           mac.ether_addr_octet[0], mac.ether_addr_octet[1],
           mac.ether_addr_octet[0], mac.ether_addr_octet[1], vlan, port);
 
-  node = malloc(sizeof(mac_t));
-  node->mac = mac;
-  node->vlan = vlan;
-  node->is_tagged = is_tagged;
-  node->port = port;
-  node->next = head;
-  head = node;
-  capacity += 1;
+  insert_mac(mac, vlan, port, is_tagged);
+  learned += 1;
+  watch_mac(WATCH_MAC_LEARNED, mac, vlan, port, INACTIVE_PORT);
   return 1;
 }
 
 
-int get_port_from_mac(struct ether_addr mac, int vlan) {
-  mac_t* node;
-  int port;
+/* Entry of a saved table, learned without logging and events. Returns -1
+ * if the table is full */
+int load_mac(struct ether_addr mac, int vlan, int port, int is_tagged) {
+  int slot;
 
-  node = head;
-  port = INACTIVE_PORT;
-  while (node != NULL && port == INACTIVE_PORT) {
-    if (node->vlan == vlan && compare_macs(node->mac, mac)) {
-      port = node->port;
-    }
-    node = node->next;
+  if (!initialized)
+    init_table();
+
+  slot = find_mac(mac, vlan);
+  if (slot != -1) {
+    unlink_entry(slot);
+    slots[slot].port = port;
+    slots[slot].is_tagged = is_tagged;
+    link_entry(slot);
+    return 0;
   }
+  if (capacity >= MAC_MAX_CAP)
+    return -1;
+  insert_mac(mac, vlan, port, is_tagged);
+  return 0;
+}
+
 
-  return port;
+int get_port_from_mac(struct ether_addr mac, int vlan) {
+  int slot = find_mac(mac, vlan);
+
+  return (slot != -1) ? slots[slot].port : INACTIVE_PORT;
 }
 
 
+/* Compares addresses as one 4 and one 2 byte word instead of bytewise */
 int compare_macs(struct ether_addr mac1, struct ether_addr mac2) {
-  int i, cmp;
-  i = 0;
-  cmp = 1;
-  for (i = 0; i < 6; i += 1) {
-    if (mac1.ether_addr_octet[i] != mac2.ether_addr_octet[i]) {
-      cmp = 0;
-    }
-  }
-  return cmp; 
+  uint32_t high1, high2;
+  uint16_t low1, low2;
+
+  memcpy(&high1, mac1.ether_addr_octet, sizeof(high1));
+  memcpy(&high2, mac2.ether_addr_octet, sizeof(high2));
+  memcpy(&low1, mac1.ether_addr_octet + 4, sizeof(low1));
+  memcpy(&low2, mac2.ether_addr_octet + 4, sizeof(low2));
+
+  return ((high1 ^ high2) | (low1 ^ low2)) == 0;
 }
 
 
 int get_untagged_port_from_mac(struct ether_addr mac) {
-  mac_t* node;
-  int port;
-  node = head;
-  port = INACTIVE_PORT;
-  while (node != NULL && port == INACTIVE_PORT) {
-    if (!(node->is_tagged) && compare_macs(node->mac, mac)) {
-      port = node->port;
-    }
-    node = node->next;
-  }
+  int slot;
 
-  return port;
+  if (!initialized)
+    return INACTIVE_PORT;
+  for (slot = buckets[mac_hash(mac)]; slot != -1;
+       slot = slots[slot].hash_next)
+    if (!slots[slot].is_tagged && compare_macs(slots[slot].mac, mac))
+      return slots[slot].port;
+  return INACTIVE_PORT;
 }
 
 
 void reset_vlan_iterator(){
-  guard.vlan = -1;
-  guard.next = head;
-  iterator = &guard;
+  iterator_reset = 1;
 }
 
 
+/* Ports of MACs learned in a VLAN, -1 after the last one */
 int vlan_next_port(int vlan){
-  if (iterator != NULL)
-    iterator = iterator->next;
+  if (!initialized || vlan < 0 || vlan >= MAX_VLANS)
+    return -1;
+  if (iterator_reset)
+    iterator = lists_vlan[vlan].next;
+  else if (iterator != -1)
+    iterator = slots[iterator].links[MAC_BY_VLAN].next;
+  iterator_reset = 0;
 
-  while (iterator != NULL && iterator->vlan != vlan)
-    iterator = iterator->next;
-  if (iterator == NULL)
+  if (iterator == -1)
     return -1;
   else
-    return iterator->port;
+    return slots[iterator].port;
+}
+
+
+int mac_table_size() {
+  return capacity;
+}
+
+
+unsigned long long mac_table_learned() {
+  return learned;
+}
+
+
+unsigned long long mac_table_evicted() {
+  return evicted;
+}
+
+
+/* Changes of entries of a MAC, in any VLAN. Flows cached with an older
+ * value of their source or destination are computed again */
+unsigned long mac_generation(struct ether_addr mac) {
+  return mac_generations[mac_hash(mac) & (MAC_GENERATIONS - 1)];
+}
+
+
+/* Changes of entries of a VLAN, which may change where floods go */
+unsigned long vlan_generation(int vlan) {
+  return vlan_generations[vlan];
+}
+
+
+/* Next entry of a dump after slot, -1 if there is none */
+static int next_match(const struct mac_query* query, int list, int slot) {
+  for (slot = slots[slot].links[list].next; slot != -1;
+       slot = slots[slot].links[list].next)
+    if (query->vlan == -1 || slots[slot].vlan == query->vlan)
+      return slot;
+  return -1;
+}
+
+
+/* Dumps entries of a VLAN and/or port in the order of their last change,
+ * at most limit of them. The cursor is set to continue after them, or to
+ * 0 after the last one. An entry that does not change is dumped once,
+ * changed ones move to the end */
+void query_macs(void* arg) {
+  struct mac_query* query = (struct mac_query*) arg;
+  struct mac_links* ends;
+  unsigned long long seq;
+  int list, slot;
+
+  query->count = 0;
+  if (!initialized || query->vlan >= MAX_VLANS ||
+      query->port > MAX_PORT_NUMBER) {
+    query->cursor = 0;
+    return;
+  }
+
+  /* Shortest list that holds all entries of the dump */
+  if (query->port != -1) {
+    list = MAC_BY_PORT;
+    ends = &lists_port[query->port];
+  } else if (query->vlan != -1) {
+    list = MAC_BY_VLAN;
+    ends = &lists_vlan[query->vlan];
+  } else {
+    list = MAC_BY_AGE;
+    ends = &lists_age;
+  }
+
+  slot = ends->next;
+  if (query->cursor != 0) {
+    seq = query->cursor / MAC_MAX_CAP;
+    slot = query->cursor % MAC_MAX_CAP;
+    if (slots[slot].seq == seq) {
+      slot = slots[slot].links[list].next;
+    } else {
+      /* The last dumped entry changed, the list is searched */
+      for (slot = ends->next; slot != -1 && slots[slot].seq <= seq;
+           slot = slots[slot].links[list].next)
+        ;
+    }
+  }
+  if (slot != -1 && query->vlan != -1 && slots[slot].vlan != query->vlan)
+    slot = next_match(query, list, slot);
+
+  while (slot != -1 && query->count < query->limit) {
+    query->result[query->count++] = slots[slot];
+    query->cursor = slots[slot].seq * MAC_MAX_CAP + slot;
+    slot = next_match(query, list, slot);
+  }
+  if (slot == -1)
+    query->cursor = 0;
 }
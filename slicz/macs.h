@@ -18,15 +18,32 @@
 
 /* Definitions */
 #define INACTIVE_PORT -1
-#define MAC_MAX_CAP 4096
+#define MAC_MAX_CAP 65536          /* power of two */
+#define MAC_BUCKETS (2 * MAC_MAX_CAP)
+#define MAC_BY_AGE 0               /* lists of the table */
+#define MAC_BY_VLAN 1
+#define MAC_BY_PORT 2
+#define MAC_LISTS 3
+#define MAC_GENERATIONS 4096       /* change counters of MACs, power of two */
 
 /* Structs */
+
+/* Neighbours of an entry on one list, slots or -1 */
+struct mac_links {
+  int prev;
+  int next;
+};
+
+/* Entry of the table. Every list is ordered by seq, changed entries move
+ * to the end */
 struct mac_node {
   struct ether_addr mac;
   int vlan;
   int port;
   int is_tagged;
-  struct mac_node *next;
+  unsigned long long seq;    /* order of changes, 0 if slot is free */
+  int hash_next;             /* next slot in bucket or free slot */
+  struct mac_links links[MAC_LISTS];
 };
 
 /* used for tests */
@@ -41,14 +58,31 @@ struct simple_frame {
 /* Types */
 typedef struct mac_node mac_t;
 
+/* Part of the table to dump, on forwarding thread */
+struct mac_query {
+  int vlan;                  /* -1 for all */
+  int port;                  /* -1 for all */
+  unsigned long long cursor; /* where previous part ended, 0 at start */
+  int limit;                 /* size of result */
+  mac_t* result;
+  int count;                 /* entries put to result */
+};
+
 /* Functions */
 void delete_first_mac();
 void clean_mac_map();
 int add_mac(struct ether_addr mac, int vlan, int port, int is_tagged);
+int load_mac(struct ether_addr mac, int vlan, int port, int is_tagged);
 int get_port_from_mac(struct ether_addr mac, int vlan);
 int compare_macs(struct ether_addr mac1, struct ether_addr mac2);
 int get_untagged_port_from_mac(struct ether_addr mac);
 void reset_vlan_iterator();
 int vlan_next_port(int vlan);
+int mac_table_size();
+unsigned long long mac_table_learned();
+unsigned long long mac_table_evicted();
+unsigned long mac_generation(struct ether_addr mac);
+unsigned long vlan_generation(int vlan);
+void query_macs(void* arg);
 
 #endif
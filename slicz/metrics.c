@@ -0,0 +1,218 @@
+/*
+ * Author: Konrad Słoniewski
+ * Date:   18 August 2013
+ */
+
+#include "metrics.h"
+#include "control.h"          /* get_index() */
+
+/* Attributes */
+
+static struct evhttp* http;
+static struct evhttp_bound_socket* http_socket;
+static struct event* loop_probe;
+static struct timespec probe_expected;   /* when the probe should fire */
+static latency_t loop_lag;                /* event loop lag, ns */
+static latency_t command_latency;         /* control command latency, ns */
+
+
+/* Functions */
+
+/* Timer handler, measures how late the event loop serves it */
+static void probe_loop(evutil_socket_t sock, short ev, void* arg) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  latency_record(&loop_lag, timespec_diff(&probe_expected, &now));
+
+  probe_expected = now;
+  probe_expected.tv_nsec += LOOP_PROBE_MSEC * 1000000L;
+  if (probe_expected.tv_nsec >= 1000000000L) {
+    probe_expected.tv_sec += 1;
+    probe_expected.tv_nsec -= 1000000000L;
+  }
+}
+
+
+/* Records time of one control command */
+void metrics_command_done(const struct timespec* started) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  latency_record(&command_latency, timespec_diff(started, &now));
+}
+
+
+/* Prints histogram as a Prometheus summary in seconds */
+static void print_summary(struct evbuffer* out, const char* name,
+  const char* help, const latency_t* hist) {
+  static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+  int i;
+
+  evbuffer_add_printf(out, "# HELP %s %s\n# TYPE %s summary\n", name, help,
+    name);
+  for (i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i += 1)
+    evbuffer_add_printf(out, "%s{quantile=\"%g\"} %.9f\n", name, quantiles[i],
+      latency_percentile(hist, quantiles[i]) / 1e9);
+  evbuffer_add_printf(out, "%s_sum %.9f\n%s_count %llu\n", name,
+    hist->sum / 1e9, name, hist->total);
+}
+
+
+static void print_header(struct evbuffer* out, const char* name,
+  const char* type, const char* help) {
+  evbuffer_add_printf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name,
+    type);
+}
+
+
+/* Per-port counter, one sample per configured port */
+static void print_port_counter(struct evbuffer* out, const char* name,
+  const char* help, int* ints, unsigned long long* longs) {
+  port_t* port;
+  int index;
+
+  print_header(out, name, "counter", help);
+  for (port = get_head(); port != NULL; port = port->next) {
+    index = get_index(port->number);
+    if (index == -1)
+      continue;
+    evbuffer_add_printf(out, "%s{port=\"%d\"} %llu\n", name, port->number,
+      ints != NULL ? (unsigned long long) ints[index] : longs[index]);
+  }
+}
+
+
+/* Per-VLAN counter, only VLANs that have seen traffic */
+static void print_vlan_counter(struct evbuffer* out, const char* name,
+  const char* help, unsigned long long* values) {
+  int vlan;
+
+  print_header(out, name, "counter", help);
+  for (vlan = 0; vlan < MAX_VLANS; vlan += 1)
+    if (values[vlan] != 0)
+      evbuffer_add_printf(out, "%s{vlan=\"%d\"} %llu\n", name, vlan,
+        values[vlan]);
+}
+
+
+/* GET /metrics - Prometheus text exposition format */
+static void serve_metrics(struct evhttp_request* req, void* arg) {
+  struct evbuffer* out;
+
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+    evhttp_send_error(req, HTTP_BADMETHOD, NULL);
+    return;
+  }
+
+  out = evbuffer_new();
+  if (!out) {
+    evhttp_send_error(req, HTTP_INTERNAL, NULL);
+    return;
+  }
+
+  print_port_counter(out, "slicz_port_received_frames_total",
+    "Frames received on a port.", udp_recv, NULL);
+  print_port_counter(out, "slicz_port_received_bytes_total",
+    "Bytes received on a port.", NULL, udp_recv_bytes);
+  print_port_counter(out, "slicz_port_sent_frames_total",
+    "Frames sent through a port.", udp_sent, NULL);
+  print_port_counter(out, "slicz_port_sent_bytes_total",
+    "Bytes sent through a port.", NULL, udp_sent_bytes);
+  print_port_counter(out, "slicz_port_dropped_frames_total",
+    "Frames dropped on a port.", udp_errs, NULL);
+  print_port_counter(out, "slicz_port_egress_dropped_frames_total",
+    "Frames dropped by a full egress queue of a port.", NULL, tx_drops);
+  print_port_counter(out, "slicz_port_flooded_frames_total",
+    "Frames received on a port and flooded to the VLAN.", NULL, udp_flood);
+
+  print_vlan_counter(out, "slicz_vlan_frames_total",
+    "Frames forwarded in a VLAN.", vlan_frames);
+  print_vlan_counter(out, "slicz_vlan_bytes_total",
+    "Bytes forwarded in a VLAN.", vlan_bytes);
+  print_vlan_counter(out, "slicz_vlan_dropped_frames_total",
+    "Frames dropped as not allowed in a VLAN.", vlan_drops);
+
+  print_header(out, "slicz_mac_table_entries", "gauge",
+    "Learned MAC addresses.");
+  evbuffer_add_printf(out, "slicz_mac_table_entries %d\n", mac_table_size());
+  print_header(out, "slicz_mac_table_capacity", "gauge",
+    "Maximum number of learned MAC addresses.");
+  evbuffer_add_printf(out, "slicz_mac_table_capacity %d\n", MAC_MAX_CAP);
+  print_header(out, "slicz_mac_learned_total", "counter",
+    "MAC addresses added to the table.");
+  evbuffer_add_printf(out, "slicz_mac_learned_total %llu\n",
+    mac_table_learned());
+  print_header(out, "slicz_mac_evicted_total", "counter",
+    "MAC addresses removed from a full table.");
+  evbuffer_add_printf(out, "slicz_mac_evicted_total %llu\n",
+    mac_table_evicted());
+
+  print_header(out, "slicz_frame_pool_free", "gauge",
+    "Frame buffers on the shared free list.");
+  evbuffer_add_printf(out, "slicz_frame_pool_free %d\n",
+    frame_pool_available());
+  print_header(out, "slicz_frame_pool_size", "gauge",
+    "Frame buffers in the pool.");
+  evbuffer_add_printf(out, "slicz_frame_pool_size %d\n", FRAMEBUF_COUNT);
+
+  print_summary(out, "slicz_event_loop_lag_seconds",
+    "Delay of a periodic timer in the forwarding event loop.", &loop_lag);
+  print_summary(out, "slicz_control_command_duration_seconds",
+    "Time spent executing one control command.", &command_latency);
+
+  evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type",
+    "text/plain; version=0.0.4");
+  evhttp_send_reply(req, HTTP_OK, "OK", out);
+  evbuffer_free(out);
+}
+
+
+/* Starts metrics listener on localhost:http_port, or on a listening
+ * socket handed over if it is not -1, in http_base and lag probe of the
+ * forwarding loop in base */
+void init_metrics(struct event_base* base, struct event_base* http_base,
+  int http_port, evutil_socket_t listener) {
+  struct timeval period = { 0, LOOP_PROBE_MSEC * 1000 };
+
+  http = evhttp_new(http_base);
+  if (!http)
+    syserr("Creating metrics HTTP server.");
+  if (listener != -1)
+    http_socket = evhttp_accept_socket_with_handle(http, listener);
+  else
+    http_socket = evhttp_bind_socket_with_handle(http, "127.0.0.1",
+      http_port);
+  if (http_socket == NULL)
+    syserr("Binding metrics port %d.", http_port);
+  if (evhttp_set_cb(http, "/metrics", serve_metrics, NULL) == -1)
+    fatal("Registering /metrics.");
+
+  loop_probe = event_new(base, -1, EV_PERSIST, probe_loop, NULL);
+  if (!loop_probe)
+    syserr("Creating event loop probe.");
+  clock_gettime(CLOCK_MONOTONIC, &probe_expected);
+  probe_loop(-1, 0, NULL);
+  latency_reset(&loop_lag);
+  if (event_add(loop_probe, &period) == -1)
+    syserr("Adding event loop probe.");
+}
+
+
+/* Listening socket of the metrics server, -1 if there is none */
+evutil_socket_t metrics_socket() {
+  if (http_socket == NULL)
+    return -1;
+  return evhttp_bound_socket_get_fd(http_socket);
+}
+
+
+void clean_metrics() {
+  if (loop_probe != NULL)
+    event_free(loop_probe);
+  if (http != NULL)
+    evhttp_free(http);
+  loop_probe = NULL;
+  http = NULL;
+  http_socket = NULL;
+}
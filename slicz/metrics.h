@@ -0,0 +1,31 @@
+/*
+ * Author: Konrad Słoniewski
+ * Date:   18 August 2013
+ */
+
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/http.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "ports.h"
+#include "macs.h"
+#include "latency.h"
+#include "framebuf.h"
+#include "err.h"
+
+/* Definitions */
+#define LOOP_PROBE_MSEC 100     /* event loop lag sampling period */
+
+/* Functions */
+void init_metrics(struct event_base* base, struct event_base* http_base,
+  int http_port, evutil_socket_t listener);
+evutil_socket_t metrics_socket();
+void clean_metrics();
+void metrics_command_done(const struct timespec* started);
+
+#endif
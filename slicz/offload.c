@@ -0,0 +1,214 @@
+/*
+ * Author: Konrad Słoniewski
+ * Date:   18 August 2013
+ */
+
+#include <arpa/inet.h>
+#include <string.h>
+
+#include "offload.h"
+
+/* Frame layout */
+#define ETHER_HDR_LEN 14
+#define VLAN_HDR_LEN 4
+#define IPV6_HDR_LEN 40
+#define TCP_FLAG_FIN 0x01
+#define TCP_FLAG_PSH 0x08
+#define TCP_FLAG_CWR 0x80
+
+
+/* Adds data to one's complement sum, data is taken as big-endian words */
+static uint32_t csum_add(uint32_t sum, const void* data, int len) {
+  const uint8_t* p = data;
+
+  while (len > 1) {
+    sum += (p[0] << 8) | p[1];
+    p += 2;
+    len -= 2;
+  }
+  if (len > 0)
+    sum += p[0] << 8;
+
+  return sum;
+}
+
+
+static uint16_t csum_fold(uint32_t sum) {
+  while (sum >> 16)
+    sum = (sum & 0xffff) + (sum >> 16);
+  return ~sum;
+}
+
+
+static void store16(char* field, uint16_t value) {
+  field[0] = value >> 8;
+  field[1] = value & 0xff;
+}
+
+
+static uint16_t load16(const char* field) {
+  return ((uint8_t) field[0] << 8) | (uint8_t) field[1];
+}
+
+
+/* Fills in checksum the guest stack left to the "hardware" (NEEDS_CSUM):
+ * its field already holds the pseudo-header sum */
+void complete_checksum(const struct virtio_net_hdr* hdr, char* frame,
+  int len) {
+  int start = hdr->csum_start;
+  int offset = hdr->csum_offset;
+  uint16_t csum;
+
+  if (!(hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) ||
+      start + offset + 2 > len)
+    return;
+
+  csum = csum_fold(csum_add(0, frame + start, len - start));
+  if (csum == 0 && offset == 6)  /* UDP sends zero as 0xffff */
+    csum = 0xffff;
+  store16(frame + start + offset, csum);
+}
+
+
+/* Fills in TCP or UDP checksum of a frame whose checksum start was not
+ * told (TPACKET rings): it is found from the Ethernet, VLAN and IP
+ * headers. Other frames and IP fragments are left as they are */
+void complete_partial_checksum(char* frame, int len) {
+  struct virtio_net_hdr hdr;
+  int l3 = ETHER_HDR_LEN, proto, end;
+  uint16_t type;
+
+  if (len < ETHER_HDR_LEN)
+    return;
+  type = load16(frame + 12);
+  while ((type == 0x8100 || type == 0x88a8) &&
+         l3 + VLAN_HDR_LEN <= len) {
+    type = load16(frame + l3 + 2);
+    l3 += VLAN_HDR_LEN;
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  if (type == 0x0800 && l3 + 20 <= len) {
+    if (load16(frame + l3 + 6) & 0x3fff)     /* MF flag or offset */
+      return;
+    proto = (uint8_t) frame[l3 + 9];
+    hdr.csum_start = l3 + ((uint8_t) frame[l3] & 0x0f) * 4;
+    end = l3 + load16(frame + l3 + 2);
+  } else if (type == 0x86dd && l3 + IPV6_HDR_LEN <= len) {
+    proto = (uint8_t) frame[l3 + 6];
+    hdr.csum_start = l3 + IPV6_HDR_LEN;
+    end = hdr.csum_start + load16(frame + l3 + 4);
+  } else {
+    return;
+  }
+
+  if (proto == 6)
+    hdr.csum_offset = 16;
+  else if (proto == 17)
+    hdr.csum_offset = 6;
+  else
+    return;
+  hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+  complete_checksum(&hdr, frame, end < len ? end : len);   /* no padding */
+}
+
+
+/* Cuts a TCP superframe into gso_size segments, each with fixed IP length,
+ * sequence number, flags and freshly computed checksums */
+static int segment_tcp(const struct virtio_net_hdr* hdr, char* frame,
+  int len, int max_len, int ipv6, struct segment_sink* sink) {
+  int l3, l4, hlen, payload, mss, offset, seg, count, ihl;
+  uint32_t seq, sum;
+  uint16_t ip_id;
+  char* out;
+
+  l3 = ETHER_HDR_LEN;
+  if (load16(frame + 12) == 0x8100)
+    l3 += VLAN_HDR_LEN;
+
+  if (hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)
+    l4 = hdr->csum_start;
+  else if (ipv6)
+    l4 = l3 + IPV6_HDR_LEN;
+  else
+    l4 = l3 + (frame[l3] & 0x0f) * 4;
+
+  if (l4 <= l3 || l4 + 20 > len)
+    return -1;
+
+  hlen = l4 + ((uint8_t) frame[l4 + 12] >> 4) * 4;
+  mss = hdr->gso_size;
+  if (mss == 0 || hlen > len || hlen + mss > max_len)
+    return -1;
+
+  payload = len - hlen;
+  seq = ntohl(*(uint32_t*) (frame + l4 + 4));
+  ip_id = load16(frame + l3 + 4);
+  ihl = (frame[l3] & 0x0f) * 4;
+
+  count = 0;
+  for (offset = 0; offset < payload; offset += mss) {
+    seg = (payload - offset < mss) ? payload - offset : mss;
+    out = sink->slot(sink->arg);
+    memcpy(out, frame, hlen);
+    memcpy(out + hlen, frame + hlen + offset, seg);
+
+    /* IP header */
+    if (ipv6) {
+      store16(out + l3 + 4, hlen - l3 - IPV6_HDR_LEN + seg);
+    } else {
+      store16(out + l3 + 2, hlen - l3 + seg);
+      store16(out + l3 + 4, ip_id + count);
+      store16(out + l3 + 10, 0);
+      store16(out + l3 + 10, csum_fold(csum_add(0, out + l3, ihl)));
+    }
+
+    /* TCP header - FIN and PSH stay on the last segment, CWR on the first */
+    *(uint32_t*) (out + l4 + 4) = htonl(seq + offset);
+    if (offset + seg < payload)
+      out[l4 + 13] &= ~(TCP_FLAG_FIN | TCP_FLAG_PSH);
+    if (offset > 0)
+      out[l4 + 13] &= ~TCP_FLAG_CWR;
+
+    /* TCP checksum over pseudo-header and segment */
+    store16(out + l4 + 16, 0);
+    if (ipv6)
+      sum = csum_add(0, out + l3 + 8, 32);
+    else
+      sum = csum_add(0, out + l3 + 12, 8);
+    sum += IPPROTO_TCP + (hlen - l4 + seg);
+    sum = csum_add(sum, out + l4, hlen - l4 + seg);
+    store16(out + l4 + 16, csum_fold(sum));
+
+    sink->commit(sink->arg, hlen + seg);
+    count += 1;
+  }
+
+  return count;
+}
+
+
+/* Turns a frame read from a TAP with virtio-net header into frames of at
+ * most max_len bytes. Returns number of produced frames or -1 if the frame
+ * cannot be handled and was dropped */
+int offload_frame(const struct virtio_net_hdr* hdr, char* frame, int len,
+  int max_len, struct segment_sink* sink) {
+  char* out;
+
+  switch (hdr->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) {
+    case VIRTIO_NET_HDR_GSO_NONE:
+      if (len > max_len)
+        return -1;
+      complete_checksum(hdr, frame, len);
+      out = sink->slot(sink->arg);
+      memcpy(out, frame, len);
+      sink->commit(sink->arg, len);
+      return 1;
+    case VIRTIO_NET_HDR_GSO_TCPV4:
+      return segment_tcp(hdr, frame, len, max_len, 0, sink);
+    case VIRTIO_NET_HDR_GSO_TCPV6:
+      return segment_tcp(hdr, frame, len, max_len, 1, sink);
+    default:
+      return -1;
+  }
+}
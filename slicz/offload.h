@@ -0,0 +1,30 @@
+/*
+ * Author: Konrad Słoniewski
+ * Date:   18 August 2013
+ */
+
+#ifndef _OFFLOAD_H
+#define _OFFLOAD_H
+
+#include <linux/virtio_net.h>  /* struct virtio_net_hdr */
+#include <stdint.h>
+
+/* Definitions */
+#define GSO_MAX_FRAME 65550    /* biggest superframe read from the TAP */
+
+/* Destination of produced frames - slot() returns a buffer for the next
+ * frame, commit() tells that len bytes of it are ready */
+struct segment_sink {
+  char* (*slot)(void* arg);
+  void (*commit)(void* arg, int len);
+  void* arg;
+};
+
+/* Functions */
+int offload_frame(const struct virtio_net_hdr* hdr, char* frame, int len,
+  int max_len, struct segment_sink* sink);
+void complete_checksum(const struct virtio_net_hdr* hdr, char* frame,
+  int len);
+void complete_partial_checksum(char* frame, int len);
+
+#endif
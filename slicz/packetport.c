@@ -0,0 +1,371 @@
+/*
+ * Author: Konrad Słoniewski
+ * Date:   18 August 2013
+ */
+
+/* Ports that are existing interfaces of the switch host (veth, bridge
+ * member, NIC), configured as "number/packet:<netdev>/VLANs". An AF_PACKET
+ * socket with TPACKET_V3 rings mapped into slicz moves frames without a
+ * system call per frame: the kernel fills rx blocks of many frames and
+ * hands over whole blocks, egress frames are put into tx slots and sent by
+ * one send() per batch. The interface is put into promiscuous mode, so it
+ * takes frames for every MAC; frames sent through it, by slicz or the
+ * host, are not taken. Tags the kernel took out of received frames are put
+ * back, so VLANs work as for UDP ports, and so are checksums the host
+ * left to the hardware. While the interface is down,
+ * frames to it are dropped. */
+
+#include "packetport.h"
+#include "offload.h"
+
+/* Structs */
+
+/* Mapped rings of a port, rx blocks followed by tx slots */
+struct packet_port {
+  char* map;
+  size_t map_size;
+  int rx_block;                  /* next block to read */
+  int rx_done;                   /* frames of it already read */
+  struct tpacket3_hdr* rx_next;  /* next frame of it */
+  int tx_slot;                   /* next slot to fill */
+  int link_error;                /* errno while interface is down, or 0 */
+};
+
+
+/* Attributes */
+
+static struct packet_port* packet_ports[MAX_SOCKETS];
+
+
+/* Functions */
+
+static struct tpacket_block_desc* rx_block(struct packet_port* port,
+  int block) {
+  return (struct tpacket_block_desc*) (port->map + block * PACKET_BLOCK_SIZE);
+}
+
+
+static struct tpacket3_hdr* tx_slot(struct packet_port* port, int slot) {
+  return (struct tpacket3_hdr*) (port->map +
+    PACKET_BLOCKS * PACKET_BLOCK_SIZE + slot * PACKET_FRAME_SIZE);
+}
+
+
+/* 1 if the frame was sent through the interface, not received by it.
+ * Such frames are not forwarded, PACKET_IGNORE_OUTGOING is not supported
+ * by older kernels */
+static int outgoing(struct tpacket3_hdr* hdr) {
+  struct sockaddr_ll* addr = (struct sockaddr_ll*) ((char*) hdr +
+    TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+
+  return addr->sll_pkttype == PACKET_OUTGOING;
+}
+
+
+/* Copies a received frame, with its VLAN tag if the kernel took it out
+ * and with its checksum if the sending stack of the host left it to the
+ * hardware. Returns 0, or -1 if the frame is too long */
+static int copy_frame(struct tpacket3_hdr* hdr, struct frame_buf* frame) {
+  char* data = (char*) hdr + hdr->tp_mac;
+  uint16_t tag[2];
+  int len = hdr->tp_snaplen;
+
+  if (!(hdr->tp_status & TP_STATUS_VLAN_VALID)) {
+    if (len > FRAME_SIZE)
+      return -1;
+    memcpy(frame->data, data, len);
+    frame->len = len;
+    if (hdr->tp_status & TP_STATUS_CSUMNOTREADY)
+      complete_partial_checksum(frame->data, frame->len);
+    return 0;
+  }
+
+  if (len + 4 > FRAME_SIZE || len < 2 * ETH_ALEN)
+    return -1;
+  tag[0] = htons((hdr->tp_status & TP_STATUS_VLAN_TPID_VALID) ?
+    hdr->hv1.tp_vlan_tpid : ETH_P_8021Q);
+  tag[1] = htons(hdr->hv1.tp_vlan_tci);
+  memcpy(frame->data, data, 2 * ETH_ALEN);
+  memcpy(frame->data + 2 * ETH_ALEN, tag, sizeof(tag));
+  memcpy(frame->data + 2 * ETH_ALEN + 4, data + 2 * ETH_ALEN,
+    len - 2 * ETH_ALEN);
+  frame->len = len + 4;
+  if (hdr->tp_status & TP_STATUS_CSUMNOTREADY)
+    complete_partial_checksum(frame->data, frame->len);
+  return 0;
+}
+
+
+/* Logs changes of the interface state once */
+static void link_state(int index, int error) {
+  struct packet_port* port = packet_ports[index];
+
+  if (error == port->link_error)
+    return;
+  if (error != 0)
+    fprintf(stderr, "Interface of port %d is down (%s).\n", ports[index],
+      strerror(error));
+  else
+    fprintf(stderr, "Interface of port %d is up again.\n", ports[index]);
+  port->link_error = error;
+}
+
+
+/* Error the socket reports, cleared by reading it. A socket with an error
+ * stays readable, so it is read when a wakeup brings no frames */
+static int socket_error(int index) {
+  socklen_t size = sizeof(int);
+  int error = 0;
+
+  if (getsockopt(sockets[index], SOL_SOCKET, SO_ERROR, &error, &size) == -1)
+    return errno;
+  return error;
+}
+
+
+/* Requested tx slots the kernel has refused to send, the interface is
+ * down. They are freed from the newest; the kernel goes on from the
+ * oldest, which becomes the next slot to fill. Returns their count */
+static int drop_requests(struct packet_port* port) {
+  struct tpacket3_hdr* hdr;
+  int slot, dropped = 0;
+
+  while (dropped < PACKET_TX_SLOTS) {
+    slot = (port->tx_slot + PACKET_TX_SLOTS - 1) % PACKET_TX_SLOTS;
+    hdr = tx_slot(port, slot);
+    if (__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) !=
+        TP_STATUS_SEND_REQUEST)
+      break;
+    __atomic_store_n(&hdr->tp_status, TP_STATUS_AVAILABLE, __ATOMIC_RELEASE);
+    port->tx_slot = slot;
+    dropped += 1;
+  }
+  return dropped;
+}
+
+
+/* Sends requested tx slots. Returns 0, or -1 if the interface is down and
+ * they were dropped */
+static int kick(int index) {
+  int error;
+
+  if (send(sockets[index], NULL, 0, MSG_DONTWAIT) == 0 ||
+      errno == EAGAIN || errno == ENOBUFS) {
+    link_state(index, 0);
+    return 0;
+  }
+  error = errno;
+  tx_drops[index] += drop_requests(packet_ports[index]);
+  link_state(index, error);
+  return -1;
+}
+
+
+/* Frames of retired rx blocks. A block goes back to the kernel once all
+ * its frames are read; if count ends the batch first, the rest is read
+ * on the next loop iteration */
+static int packet_receive(int index, struct frame_buf** frames, int count) {
+  struct packet_port* port = packet_ports[index];
+  struct tpacket_block_desc* block;
+  struct tpacket3_hdr* hdr;
+  int n = 0, error;
+
+  while (n < count) {
+    block = rx_block(port, port->rx_block);
+    if (!(__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) &
+          TP_STATUS_USER))
+      break;
+    if (port->rx_done == 0)
+      port->rx_next = (struct tpacket3_hdr*) ((char*) block +
+        block->hdr.bh1.offset_to_first_pkt);
+
+    while (port->rx_done < block->hdr.bh1.num_pkts && n < count) {
+      hdr = port->rx_next;
+      if (!outgoing(hdr)) {
+        if (copy_frame(hdr, frames[n]) == 0)
+          n += 1;
+        else
+          atomic_inc(udp_errs + index);
+      }
+      port->rx_next = (struct tpacket3_hdr*) ((char*) hdr +
+        hdr->tp_next_offset);
+      port->rx_done += 1;
+    }
+
+    if (port->rx_done == block->hdr.bh1.num_pkts) {
+      __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL,
+        __ATOMIC_RELEASE);
+      port->rx_block = (port->rx_block + 1) % PACKET_BLOCKS;
+      port->rx_done = 0;
+    }
+  }
+
+  if (n == count)
+    event_active(events[index], EV_READ, 0);
+  if (n == 0) {
+    error = socket_error(index);
+    if (error != 0)
+      link_state(index, error);
+    errno = EAGAIN;
+    return -1;
+  }
+  return n;
+}
+
+
+/* Frames to free tx slots, sent by one send(). Frames the kernel does
+ * not send because the interface is down are dropped */
+static int packet_send(int index, struct frame_buf** frames, int count) {
+  struct packet_port* port = packet_ports[index];
+  struct tpacket3_hdr* hdr;
+  int n, kicked = 0;
+
+  for (n = 0; n < count; n += 1) {
+    hdr = tx_slot(port, port->tx_slot);
+    if (__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) !=
+        TP_STATUS_AVAILABLE) {
+      /* Slots requested earlier may wait for a send() */
+      if (kicked)
+        break;
+      kicked = 1;
+      kick(index);
+      hdr = tx_slot(port, port->tx_slot);
+      if (__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) !=
+          TP_STATUS_AVAILABLE)
+        break;
+    }
+    memcpy((char*) hdr + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)),
+      frames[n]->data, frames[n]->len);
+    hdr->tp_len = frames[n]->len;
+    hdr->tp_snaplen = frames[n]->len;
+    hdr->tp_next_offset = 0;
+    __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST,
+      __ATOMIC_RELEASE);
+    port->tx_slot = (port->tx_slot + 1) % PACKET_TX_SLOTS;
+  }
+
+  if (n == 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+  kick(index);
+  return n;
+}
+
+
+/* Unmaps the rings, sockets[index] is closed by release_socket() */
+static void packet_release(int index) {
+  struct packet_port* port = packet_ports[index];
+
+  munmap(port->map, port->map_size);
+  free(port);
+  packet_ports[index] = NULL;
+}
+
+
+static const struct transport packet_transport = {
+  packet_receive, packet_send, packet_release
+};
+
+
+/* Socket with mapped rings bound to interface ifindex, NULL on errors */
+static struct packet_port* open_rings(int sock, int ifindex) {
+  struct packet_port* port;
+  struct tpacket_req3 rx, tx;
+  struct packet_mreq promisc;
+  struct sockaddr_ll addr;
+  int version = TPACKET_V3, one = 1;
+
+  memset(&rx, 0, sizeof(rx));
+  rx.tp_block_size = PACKET_BLOCK_SIZE;
+  rx.tp_block_nr = PACKET_BLOCKS;
+  rx.tp_frame_size = PACKET_FRAME_SIZE;
+  rx.tp_frame_nr = PACKET_BLOCK_SIZE / PACKET_FRAME_SIZE * PACKET_BLOCKS;
+  rx.tp_retire_blk_tov = PACKET_BLOCK_TIMEOUT;
+  memset(&tx, 0, sizeof(tx));
+  tx.tp_block_size = PACKET_TX_BLOCK_SIZE;
+  tx.tp_block_nr = PACKET_TX_BLOCKS;
+  tx.tp_frame_size = PACKET_FRAME_SIZE;
+  tx.tp_frame_nr = PACKET_TX_BLOCK_SIZE / PACKET_FRAME_SIZE *
+    PACKET_TX_BLOCKS;
+
+  if (setsockopt(sock, SOL_PACKET, PACKET_VERSION, &version,
+        sizeof(version)) == -1 ||
+      setsockopt(sock, SOL_PACKET, PACKET_LOSS, &one, sizeof(one)) == -1 ||
+      setsockopt(sock, SOL_PACKET, PACKET_RX_RING, &rx, sizeof(rx)) == -1 ||
+      setsockopt(sock, SOL_PACKET, PACKET_TX_RING, &tx, sizeof(tx)) == -1)
+    return NULL;
+#ifdef PACKET_IGNORE_OUTGOING
+  setsockopt(sock, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one));
+#endif
+
+  port = calloc(1, sizeof(*port));
+  if (port == NULL)
+    syserr("Allocating packet port.");
+  port->map_size = (size_t) PACKET_BLOCKS * PACKET_BLOCK_SIZE +
+    (size_t) PACKET_TX_BLOCKS * PACKET_TX_BLOCK_SIZE;
+  port->map = mmap(NULL, port->map_size, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_LOCKED, sock, 0);
+  if (port->map == MAP_FAILED)
+    port->map = mmap(NULL, port->map_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED, sock, 0);
+  if (port->map == MAP_FAILED) {
+    free(port);
+    return NULL;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sll_family = AF_PACKET;
+  addr.sll_protocol = htons(ETH_P_ALL);
+  addr.sll_ifindex = ifindex;
+  memset(&promisc, 0, sizeof(promisc));
+  promisc.mr_ifindex = ifindex;
+  promisc.mr_type = PACKET_MR_PROMISC;
+  if (bind(sock, (struct sockaddr*) &addr, sizeof(addr)) == -1 ||
+      setsockopt(sock, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &promisc,
+        sizeof(promisc)) == -1) {
+    munmap(port->map, port->map_size);
+    free(port);
+    return NULL;
+  }
+  return port;
+}
+
+
+/* Attaches a new port to an existing interface. Returns socket index, or
+ * -1 */
+int init_packet_port(int port_num, const char* device) {
+  struct packet_port* port;
+  unsigned int ifindex;
+  int sock, index;
+
+  ifindex = if_nametoindex(device);
+  if (ifindex == 0) {
+    fprintf(stderr, "No interface %s for port %d.\n", device, port_num);
+    return -1;
+  }
+
+  /* Frames are taken once the rings are bound, protocol 0 until then */
+  sock = socket(AF_PACKET, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (sock == -1) {
+    fprintf(stderr, "Creating packet socket (%s).\n", strerror(errno));
+    return -1;
+  }
+  port = open_rings(sock, ifindex);
+  if (port == NULL) {
+    fprintf(stderr, "Attaching interface %s to port %d (%s).\n", device,
+      port_num, strerror(errno));
+    close(sock);
+    return -1;
+  }
+
+  index = claim_socket(port_num, sock, &packet_transport);
+  if (index == -1) {
+    munmap(port->map, port->map_size);
+    free(port);
+    close(sock);
+    return -1;
+  }
+  packet_ports[index] = port;
+  return index;
+}
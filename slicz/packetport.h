@@ -0,0 +1,41 @@
+/*
+ * Author: Konrad Słoniewski
+ * Date:   18 August 2013
+ */
+
+#ifndef _PACKETPORT_H
+#define _PACKETPORT_H
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <event2/event.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "ports.h"
+#include "framebuf.h"
+#include "forward.h"
+#include "err.h"
+
+/* Definitions */
+#define PACKET_BLOCK_SIZE (1 << 18)  /* rx block, frames retired together */
+#define PACKET_BLOCKS 16
+#define PACKET_BLOCK_TIMEOUT 1       /* ms until a partial block is retired */
+#define PACKET_FRAME_SIZE 2048       /* rx frame hint and tx slot */
+#define PACKET_TX_BLOCK_SIZE (1 << 16)
+#define PACKET_TX_BLOCKS 32          /* 1024 tx slots */
+#define PACKET_TX_SLOTS (PACKET_TX_BLOCKS * \
+  (PACKET_TX_BLOCK_SIZE / PACKET_FRAME_SIZE))
+
+/* Functions */
+int init_packet_port(int port_num, const char* device);
+
+#endif
@@ -0,0 +1,82 @@
+/*
+ * Author: Konrad Słoniewski
+ * Date:   18 August 2013
+ */
+
+#include "planes.h"
+
+/* Attributes */
+
+static struct event_base* data_plane;
+static struct event* call_event;          /* runs call on forwarding thread */
+static pthread_mutex_t call_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t call_done = PTHREAD_COND_INITIALIZER;
+static void (*call_func)(void* arg);
+static void* call_arg;
+static int called;                        /* call_func has returned */
+static int running = 0;                   /* forwarding loop serves calls */
+
+
+/* Functions */
+
+/* Call of the control thread, on forwarding thread */
+static void run_call(evutil_socket_t sock, short ev, void* arg) {
+  call_func(call_arg);
+
+  pthread_mutex_lock(&call_lock);
+  called = 1;
+  pthread_cond_signal(&call_done);
+  pthread_mutex_unlock(&call_lock);
+}
+
+
+/* Forwarding event base, libevent threads have to be enabled before it is
+ * created */
+void init_planes(struct event_base* data_base) {
+  data_plane = data_base;
+  call_event = event_new(data_plane, -1, 0, run_call, NULL);
+  if (call_event == NULL)
+    syserr("Creating forwarding call event.");
+}
+
+
+/* From now on calls wait for the forwarding loop */
+void start_data_plane() {
+  running = 1;
+}
+
+
+/* Ends forwarding loop, called on forwarding thread. Later calls are run
+ * at once, the forwarding thread does nothing but waiting for the control
+ * thread then */
+void stop_data_plane() {
+  running = 0;
+  if (event_base_loopexit(data_plane, NULL) == -1)
+    syserr("Stopping forwarding.");
+}
+
+
+/* Runs func on forwarding thread between two events and waits for it. It
+ * runs at once before forwarding starts and after it stops */
+void data_plane_call(void (*func)(void* arg), void* arg) {
+  if (!running) {
+    func(arg);
+    return;
+  }
+
+  pthread_mutex_lock(&call_lock);
+  call_func = func;
+  call_arg = arg;
+  called = 0;
+  event_active(call_event, EV_TIMEOUT, 0);
+  while (!called)
+    pthread_cond_wait(&call_done, &call_lock);
+  pthread_mutex_unlock(&call_lock);
+}
+
+
+void clean_planes() {
+  if (call_event != NULL)
+    event_free(call_event);
+  call_event = NULL;
+}
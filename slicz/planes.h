@@ -0,0 +1,30 @@
+/*
+ * Author: Konrad Słoniewski
+ * Date:   18 August 2013
+ */
+
+#ifndef _PLANES_H
+#define _PLANES_H
+
+#include <event2/event.h>
+#include <event2/thread.h>
+#include <pthread.h>
+
+#include "err.h"
+
+/* Forwarding runs on the main thread with its event base, control service
+ * on its own thread. Ports, their events and everything else forwarding
+ * reads without locks is changed only on the forwarding thread. Control
+ * changes them by data_plane_call() and waits meanwhile. Forwarding itself
+ * changes a port when the first frame of its client comes; status and
+ * client of a port are read on the control thread by port_client(), other
+ * fields of ports at any time. Counters are read while they are updated */
+
+/* Functions */
+void init_planes(struct event_base* data_base);
+void start_data_plane();
+void stop_data_plane();
+void data_plane_call(void (*func)(void* arg), void* arg);
+void clean_planes();
+
+#endif
@@ -5,109 +5,321 @@
 
 #include "ports.h"
 
+/* Global data tables of ports.h */
+struct event_base* base;
+struct event* listener_socket_event;
+evutil_socket_t sockets[MAX_SOCKETS];
+int ports[MAX_SOCKETS];
+struct event* events[MAX_SOCKETS];
+const struct transport* transports[MAX_SOCKETS];
+evutil_socket_t egress_fds[MAX_SOCKETS];
+short egress_events[MAX_SOCKETS];
+int udp_sent[MAX_SOCKETS];
+int udp_recv[MAX_SOCKETS];
+int udp_errs[MAX_SOCKETS];
+unsigned long long udp_recv_bytes[MAX_SOCKETS];
+unsigned long long udp_sent_bytes[MAX_SOCKETS];
+unsigned long long udp_flood[MAX_SOCKETS];
+unsigned long long tx_drops[MAX_SOCKETS];
+unsigned long long vlan_frames[MAX_VLANS];
+unsigned long long vlan_bytes[MAX_VLANS];
+unsigned long long vlan_drops[MAX_VLANS];
+
+
+/* Sorted numbers of ports */
+struct port_set {
+  uint16_t* numbers;
+  int count;
+  int capacity;
+};
 
 static port_t *head;
+static port_t *by_number[MAX_PORT_NUMBER + 1];  /* ports by UDP port number */
+static struct port_set all_ports;
+static struct port_set vlan_ports[MAX_VLANS];   /* ports attached to VLANs */
+static evutil_socket_t inherited[MAX_PORT_NUMBER + 1]; /* socket + 1, or 0 */
+/* Names of transports in configurations, by type */
+static const char* transport_names[] = { "udp", "shm", "tap", "packet" };
+#define TRANSPORTS ((int) (sizeof(transport_names) / sizeof(char*)))
+
+
+/* Atomic increase of an integer field, counters of the tables are
+ * increased by forwarding and by transports */
+void atomic_inc(int* field) {
+  __sync_fetch_and_add(field, 1);
+}
+
+
+/* Position of the first number not lower than a given one */
+static int lower_bound(const struct port_set* set, int number) {
+  int low = 0, high = set->count, middle;
+
+  while (low < high) {
+    middle = (low + high) / 2;
+    if (set->numbers[middle] < number)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return low;
+}
+
+
+static void set_add(struct port_set* set, int number) {
+  uint16_t* numbers;
+  int capacity, position;
+
+  position = lower_bound(set, number);
+  if (position < set->count && set->numbers[position] == number)
+    return;
+
+  if (set->count == set->capacity) {
+    capacity = (set->capacity == 0) ? 16 : set->capacity * 2;
+    numbers = realloc(set->numbers, capacity * sizeof(uint16_t));
+    if (numbers == NULL)
+      syserr("Allocating port index.");
+    set->numbers = numbers;
+    set->capacity = capacity;
+  }
+
+  memmove(set->numbers + position + 1, set->numbers + position,
+    (set->count - position) * sizeof(uint16_t));
+  set->numbers[position] = number;
+  set->count += 1;
+}
+
+
+static void set_remove(struct port_set* set, int number) {
+  int position;
+
+  position = lower_bound(set, number);
+  if (position == set->count || set->numbers[position] != number)
+    return;
+  memmove(set->numbers + position, set->numbers + position + 1,
+    (set->count - position - 1) * sizeof(uint16_t));
+  set->count -= 1;
+  if (set->count == 0) {
+    free(set->numbers);
+    memset(set, 0, sizeof(*set));
+  }
+}
+
+/* Port of the list right before a given number, NULL if it would be the
+ * first one. Found in the sorted index, not by walking the list */
+static port_t* previous_port(int number) {
+  int position = lower_bound(&all_ports, number);
+
+  return (position > 0) ? by_number[all_ports.numbers[position - 1]] : NULL;
+}
+
 
 /* Returns a port with a given number */
 port_t* get_port(int number) {
-  port_t* node = head;
-  while (node != NULL && node->number != number)
-    node = node->next;
-  
-  return node;
+  if (number < 0 || number > MAX_PORT_NUMBER)
+    return NULL;
+  return by_number[number];
 }
 
 
-port_t* parse_port(const char* raw) {
-  char** data;
-  int number;
-  port_t* port;
-  int vlan_count;
-  char **vlan_list;
-  int i;
+/* Reads VLAN list like "5,10-200t,300t" into port. Only one VLAN can be
+ * untagged, so other untagged VLANs and untagged ranges but their first
+ * VLAN are tagged */
+static int read_vlans(port_t* port, const char* list, const char** error) {
+  const char* p = list;
+  char* end;
+  long from, to, number;
   int tagged;
-  char** sender_data;
 
-  data = split(raw, "/", 3);
-  number = atoi(data[0]); 
-  
-  /* Checking if VLAN list is empty */
-  if (!strcmp(data[2], "")) {
-    fprintf(stderr, "No VLANs provided, deleting port %d\n", number);
-    del_port(number);
-    free_array(data, 3);
-    return NULL;
+  while (*p != '\0') {
+    from = strtol(p, &end, 10);
+    if (end == p) {
+      *error = "Wrong VLAN list";
+      return -1;
+    }
+    to = from;
+    p = end;
+    if (*p == '-') {
+      to = strtol(p + 1, &end, 10);
+      if (end == p + 1) {
+        *error = "Wrong VLAN range";
+        return -1;
+      }
+      p = end;
+    }
+    tagged = (*p == 't');
+    if (tagged)
+      p += 1;
+    if (*p != ',' && *p != '\0') {
+      *error = "Wrong VLAN list";
+      return -1;
+    }
+    if (from < 0 || to >= MAX_VLANS || from > to) {
+      *error = "VLAN out of range";
+      return -1;
+    }
+
+    if (!tagged)
+      add_untagged_vlan(port, from);
+    for (number = from; number <= to; number += 1)
+      add_vlan(port, number);
+    if (*p == ',')
+      p += 1;
   }
 
-  /* VLAN list is not empty - creating port */
-  port = create_port(number);
+  return 0;
+}
 
-  /* Checking if port already exist */
-  if (port == NULL) {
-    fprintf(stderr, "Port %d already exist.\n", number);
-    free_array(data, 3);
-    return NULL;
+
+/* Reads client "transport:[device]" of a port that is not a UDP socket.
+ * Frames of such a port come from a pseudo client 0.0.0.0:number, so the
+ * port is active from the start. Returns 1, 0 if the client is a UDP one,
+ * or -1 and sets error */
+static int read_transport(port_t* port, const char* client, int len,
+  const char** error) {
+  int type, name_len = 0;
+
+  for (type = PORT_UDP + 1; type < TRANSPORTS; type += 1) {
+    name_len = strlen(transport_names[type]);
+    if (len > name_len && client[name_len] == ':' &&
+        !strncmp(client, transport_names[type], name_len))
+      break;
   }
- 
-  /* Port does not exist - adding VLANs */ 
-  vlan_count = count_occurrences(data[2], ',') + 1;
-  vlan_list = split(data[2], ",", vlan_count);
-
-  for (i = 0; i < vlan_count; i += 1) {
-    char *vlan = strdup(vlan_list[i]);
-    tagged = check_tagging(&vlan);
-    if (!tagged) {
-      add_untagged_vlan(port, atoi(vlan));
-    }
-    add_vlan(port, atoi(vlan));
-    free(vlan);
+  if (type == TRANSPORTS)
+    return 0;
+
+  /* Shared memory ports are found by number, others need a device */
+  len -= name_len + 1;
+  if (len >= PORT_DEVICE_LEN || (type == PORT_SHM && len > 0) ||
+      (type != PORT_SHM && len == 0)) {
+    *error = "Wrong device of port";
+    return -1;
   }
+  port->type = type;
+  memcpy(port->device, client + name_len + 1, len);
+  port->device[len] = '\0';
+  activate_port(port, INADDR_ANY, port->number);
+  return 1;
+}
 
-  free_array(vlan_list, vlan_count);
-  
-  if (strlen(data[1]) == 0) { /* No client on port */
-    port->status = INACTIVE;
-  } else {                    /* Client on port provided */
-    sender_data = split(data[1], ":", 2);
-    activate_port(port, extract_addr(sender_data[0]), atoi(sender_data[1]));
-    free_array(sender_data, 2);
+
+/* Reads "number/[client_addr:client_port]/VLANs" into a port that is not
+ * linked to the port list, client may also be a local transport like
+ * "shm:". Empty VLAN list means removal of the port. Client address is
+ * not resolved: host gets the address (NI_MAXHOST bytes), or "" if the
+ * port has no client. Returns 0, or -1 and sets error */
+int read_port(const char* raw, port_t* port, char* host,
+  const char** error) {
+  const char *client, *vlans, *colon;
+  char* end;
+  long number, sender_port;
+  int local;
+
+  number = strtol(raw, &end, 10);
+  if (end == raw || *end != '/' || number <= 0 || number > MAX_PORT_NUMBER) {
+    *error = "Wrong port number";
+    return -1;
   }
-  
-  free_array(data, 3);
-  
-  return port;
+  init_port(port, number);
+  host[0] = '\0';
+
+  /* Client of the port */
+  client = end + 1;
+  vlans = strchr(client, '/');
+  if (vlans == NULL) {
+    *error = "Missing VLAN list";
+    return -1;
+  }
+  local = read_transport(port, client, vlans - client, error);
+  if (local == -1)
+    return -1;
+  if (vlans > client && !local) {
+    colon = memchr(client, ':', vlans - client);
+    if (colon == NULL || colon == client || colon - client >= NI_MAXHOST) {
+      *error = "Wrong client address";
+      return -1;
+    }
+    sender_port = strtol(colon + 1, &end, 10);
+    if (end != vlans || sender_port <= 0 || sender_port > MAX_PORT_NUMBER) {
+      *error = "Wrong client port";
+      return -1;
+    }
+    memcpy(host, client, colon - client);
+    host[colon - client] = '\0';
+    activate_port(port, INADDR_ANY, sender_port);
+  }
+
+  return read_vlans(port, vlans + 1, error);
 }
 
 
-void del_port(int number) {
-  port_t *node = head;
-  port_t *node_guard = NULL;
- 
-  while (node != NULL && node->number != number) {
-    node_guard = node;
-    node = node->next;
-  }
-  if (node != NULL && node_guard != NULL) { /* Port found - deleting */
-    node_guard->next = node->next;
-    del_vlans(node);
-    free(node);
-  } else if (node != NULL) { /* Port found on head */
-    head = head->next;
-    del_vlans(node);
-    free(node);
-  }  
+/* Port has no VLANs, so configuration removes it */
+int port_removed(const port_t* port) {
+  int i;
+
+  for (i = 0; i < MAX_VLANS / 8; i += 1)
+    if (port->vlans[i] != 0)
+      return 0;
+  return 1;
+}
+
+
+/* Up to limit ports numbered from..to in ascending order, only ports of a
+ * VLAN unless it is -1. Returns number of ports put to result */
+int find_ports(int vlan, int from, int to, port_t** result, int limit) {
+  const struct port_set* set;
+  int position, count = 0;
+
+  if (vlan >= MAX_VLANS)
+    return 0;
+  set = (vlan < 0) ? &all_ports : &vlan_ports[vlan];
+
+  for (position = lower_bound(set, from);
+       position < set->count && set->numbers[position] <= to &&
+       count < limit; position += 1)
+    result[count++] = by_number[set->numbers[position]];
+  return count;
 }
 
 
-void del_vlans(port_t *port) {
-  vlan_t *vlans = port->vlans;
-  vlan_t *tmp;
+/* Changes VLANs of a port of the list, keeping VLAN indexes up to date */
+void set_vlans(port_t* port, const uint8_t* vlans) {
+  int number, attached;
 
-  while (vlans != NULL) {
-    tmp = vlans;
-    vlans = vlans->next;
-    free(tmp);
+  for (number = 0; number < MAX_VLANS; number += 1) {
+    if (number % 8 == 0 && vlans[number / 8] == port->vlans[number / 8]) {
+      number += 7;
+      continue;
+    }
+    attached = (vlans[number / 8] >> (number % 8)) & 1;
+    if (attached == valid_vlan(port, number))
+      continue;
+    if (attached)
+      set_add(&vlan_ports[number], port->number);
+    else
+      set_remove(&vlan_ports[number], port->number);
   }
+  memcpy(port->vlans, vlans, sizeof(port->vlans));
+}
+
+
+void del_port(int number) {
+  port_t *node = get_port(number);
+  port_t *node_guard;
+  uint8_t none[MAX_VLANS / 8];
+
+  if (node == NULL)
+    return;
+  memset(none, 0, sizeof(none));
+  set_vlans(node, none);
+
+  node_guard = previous_port(number);
+  if (node_guard != NULL) /* Port found - deleting */
+    node_guard->next = node->next;
+  else /* Port found on head */
+    head = head->next;
+  set_remove(&all_ports, number);
+  by_number[number] = NULL;
+  free(node);
 }
 
 
@@ -120,50 +332,50 @@ void free_array(char** array, int limit) {
 }
 
 
+/* Initializes port not linked to the port list */
+void init_port(port_t* port, int number) {
+  memset(port, 0, sizeof(*port));
+  port->number = number;
+  port->status = INACTIVE;
+  port->untagged_vlan = -1; /* not tagged */
+  port->default_pcp = 0;
+  port->index = -1;
+  port->next = NULL;
+}
+
+
 port_t* create_port(int number) {
-  port_t *node = head;
+  port_t *node;
   port_t *tmp = NULL;
-  port_t *new_node = malloc(sizeof(port_t));
-
-  /* Creating port */
-  new_node->number = number;
-  new_node->status = INACTIVE;
-  new_node->untagged_vlan = -1; /* not tagged */
-  new_node->vlans = NULL;
+  port_t *new_node;
 
   /* Checking if port already exist */
-  if (get_port(number) != NULL)
+  if (number < 0 || number > MAX_PORT_NUMBER || get_port(number) != NULL)
     return NULL;
-  node = head;
 
-  /* Adding port */
-  while (node != NULL && node->number < number) {
-    tmp = node;
-    node = node->next;
-  }
-  
+  /* Creating port */
+  new_node = malloc(sizeof(port_t));
+  if (new_node == NULL)
+    syserr("Allocating port.");
+  init_port(new_node, number);
+
+  /* Adding port after the closest lower one */
+  tmp = previous_port(number);
+  node = (tmp != NULL) ? tmp->next : head;
+
   if (tmp != NULL)
     tmp->next = new_node;
   else
     head = new_node;
    
   new_node->next = node;
-  fprintf(stderr, "New port: %d\n", new_node->number);
+  by_number[number] = new_node;
+  set_add(&all_ports, number);
  
   return new_node;
 }
 
 
-int check_tagging(char** string) {
-  int len = strlen(*string);
-  if ((*string)[len-1] == 't') {
-    (*string)[len-1] = '\0';
-    return 1;
-  }
-  return 0;
-}
-
-
 void add_untagged_vlan(port_t *port, int number) {
   if (port->untagged_vlan == -1)
     port->untagged_vlan = number;
@@ -175,85 +387,154 @@ void add_untagged_vlan(port_t *port, int number) {
 
 
 void add_vlan(port_t* port, int number) {
-  vlan_t* vlans = port->vlans;
-  vlan_t* node = vlans;
-  vlan_t* tmp = NULL;
-  vlan_t* new_vlan = malloc(sizeof(vlan_t));
-
-  /* Creating new VLAN */
-  new_vlan->number = number;
- 
-  /* Adding VLAN */
-  while (node != NULL && node->number < number) {
-    tmp = node;
-    node = node->next;
+  if (number < 0 || number >= MAX_VLANS) {
+    fprintf(stderr, "Ignoring VLAN %d at port %d.\n", number, port->number);
+    return;
   }
-  
-  if (tmp != NULL)
-    tmp->next = new_vlan;
-  else
-    port->vlans = new_vlan;
-
-  new_vlan->next = node;
+  port->vlans[number / 8] |= 1 << (number % 8);
 }
 
 
+/* Sets client of a port. Forwarding does it when the first frame of a
+ * client comes, while the control thread may be printing the port, so
+ * the fields are written under client_seq */
 void activate_port(port_t* port, unsigned long sender_addr, int sender_port) {
-  port->status = ACTIVE;
-  port->sender_addr = sender_addr;
-  port->sender_port = sender_port;
+  __atomic_store_n(&port->client_seq, port->client_seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&port->status, ACTIVE, __ATOMIC_RELAXED);
+  __atomic_store_n(&port->sender_addr, sender_addr, __ATOMIC_RELAXED);
+  __atomic_store_n(&port->sender_port, sender_port, __ATOMIC_RELAXED);
+  __atomic_store_n(&port->client_seq, port->client_seq + 1, __ATOMIC_RELEASE);
 }
 
 
-unsigned long extract_addr(const char* addr) {
-  struct addrinfo addr_hints;
-  struct addrinfo *addr_result;
-  unsigned long s_addr;
+/* Consistent status and client of a port, for the control thread */
+void port_client(const port_t* port, int* status, unsigned long* sender_addr,
+  int* sender_port) {
+  unsigned seq;
+
+  do {
+    while ((seq = __atomic_load_n(&port->client_seq, __ATOMIC_ACQUIRE)) & 1)
+      ;
+    *status = __atomic_load_n(&port->status, __ATOMIC_RELAXED);
+    *sender_addr = __atomic_load_n(&port->sender_addr, __ATOMIC_RELAXED);
+    *sender_port = __atomic_load_n(&port->sender_port, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while (__atomic_load_n(&port->client_seq, __ATOMIC_RELAXED) != seq);
+}
 
-  memset(&addr_hints, 0, sizeof(struct addrinfo));
-  addr_hints.ai_family = AF_INET;
-  addr_hints.ai_protocol = IPPROTO_TCP;
-  getaddrinfo(addr, "0", &addr_hints, &addr_result);
-  s_addr = ((struct sockaddr_in*) addr_result->ai_addr)->sin_addr.s_addr;
-  freeaddrinfo(addr_result);
 
-  return s_addr;
+/* Port uses the same transport and device as the other one */
+int same_transport(const port_t* port, const port_t* other) {
+  return port->type == other->type && !strcmp(port->device, other->device);
 }
 
 
-/* Socket initialization, returns socket index in socket array */
-int init_socket(int port_num) {
+/* Puts a socket of a port to a free slot, with transport of the port or
+ * NULL for UDP. Returns socket index or -1 if there is no free slot */
+int claim_socket(int port_num, evutil_socket_t sock,
+  const struct transport* transport) {
   int i;
-  struct sockaddr_in sin;
 
   i = 0;
-  while (i < 100 && sockets[i] != -1)
+  while (i < MAX_SOCKETS && sockets[i] != -1)
     i += 1;
 
   /* Checking for a space for a new socket */
-  if (i >= 100)
+  if (i >= MAX_SOCKETS)
     return -1;
 
-  /* There is a free space for a new socket */
-  sockets[i] = socket(PF_INET, SOCK_DGRAM, 0);
+  sockets[i] = sock;
   ports[i] = port_num;
+  transports[i] = transport;
+  egress_fds[i] = sock;
+  egress_events[i] = EV_WRITE;
+  return i;
+}
+
 
-  if (sockets[i] == -1 ||
-      evutil_make_listen_socket_reuseable(sockets[i]) ||
+/* Socket initialization, returns socket index in socket array or -1 if
+ * there is no free slot or the socket cannot be bound */
+int init_socket(int port_num) {
+  int i;
+  int one = 1;
+  evutil_socket_t sock;
+  struct sockaddr_in sin;
+
+  /* Socket bound by the previous process is taken over as it is */
+  if (inherited[port_num] != 0) {
+    i = claim_socket(port_num, inherited[port_num] - 1, NULL);
+    if (i != -1)
+      inherited[port_num] = 0;
+    return i;
+  }
+
+  sock = socket(PF_INET, SOCK_DGRAM, 0);
+  if (sock == -1) {
+    fprintf(stderr, "Creating socket (%s).\n", strerror(errno));
+    return -1;
+  }
+  i = claim_socket(port_num, sock, NULL);
+  if (i == -1) {
+    evutil_closesocket(sock);
+    return -1;
+  }
+
+  if (evutil_make_listen_socket_reuseable(sockets[i]) ||
       evutil_make_socket_nonblocking(sockets[i])) {
     syserr("Creating socket.");
   }
 
+  /* Kernel receive timestamps for forwarding latency */
+  if (setsockopt(sockets[i], SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one)))
+    syserr("Enabling receive timestamps.");
+
   sin.sin_family = AF_INET;
   sin.sin_addr.s_addr = INADDR_ANY;
   sin.sin_port = htons(port_num);
-  if(bind(sockets[i], (struct sockaddr*) &sin, sizeof(sin)) == -1)
-    syserr("Binding socket.");
+  if(bind(sockets[i], (struct sockaddr*) &sin, sizeof(sin)) == -1) {
+    fprintf(stderr, "Binding port %d (%s).\n", port_num, strerror(errno));
+    release_socket(i);
+    return -1;
+  }
   
   return i;
 }
 
 
+/* Bound socket of a port handed over by the previous process, used when
+ * the port is created */
+void inherit_socket(int port_num, evutil_socket_t sock) {
+  if (inherited[port_num] != 0)
+    evutil_closesocket(inherited[port_num] - 1);
+  inherited[port_num] = sock + 1;
+}
+
+
+/* Closes inherited sockets of ports that were not created */
+void close_inherited() {
+  int i;
+
+  for (i = 0; i <= MAX_PORT_NUMBER; i += 1) {
+    if (inherited[i] != 0)
+      evutil_closesocket(inherited[i] - 1);
+    inherited[i] = 0;
+  }
+}
+
+
+/* Closes socket of a given index and frees its slot */
+void release_socket(int index) {
+  if (transports[index] != NULL && transports[index]->release != NULL)
+    transports[index]->release(index);
+  transports[index] = NULL;
+  if (sockets[index] != -1 && close(sockets[index]) == -1)
+    syserr("Error closing socket.");
+  sockets[index] = -1;
+  ports[index] = -1;
+}
+
+
 void init_arrays() {
   int i;
   
@@ -261,9 +542,22 @@ void init_arrays() {
     sockets[i] = -1;
     ports[i] = -1;
     events[i] = NULL;
+    transports[i] = NULL;
+    egress_fds[i] = -1;
+    egress_events[i] = EV_WRITE;
     udp_sent[i] = 0;
     udp_recv[i] = 0;
     udp_errs[i] = 0;
+    udp_recv_bytes[i] = 0;
+    udp_sent_bytes[i] = 0;
+    udp_flood[i] = 0;
+    tx_drops[i] = 0;
+  }
+
+  for (i = 0; i < MAX_VLANS; i += 1) {
+    vlan_frames[i] = 0;
+    vlan_bytes[i] = 0;
+    vlan_drops[i] = 0;
   }
 }
 
@@ -278,49 +572,62 @@ port_t* get_head() {
 /* Prints config of a given port 
  * 
  * @param port - given port
- * @param buffer - buffer to print configuration in
+ * @param out - stream to print configuration to
  */
-void print_config(port_t* port, char** buffer) {
+void print_config(port_t* port, FILE* out) {
   struct in_addr sin_addr;
   char addr[INET_ADDRSTRLEN];
-  char* vlan_buffer = malloc(1024*sizeof(char));
-  /* memset(vlan_buffer, 0, sizeof(vlan_buffer));*/
-  sin_addr.s_addr = port->sender_addr;
+  unsigned long sender_addr;
+  int status, sender_port;
+
+  port_client(port, &status, &sender_addr, &sender_port);
+  sin_addr.s_addr = sender_addr;
   inet_ntop(AF_INET, &sin_addr, addr, INET_ADDRSTRLEN);
-  print_vlans(port, &vlan_buffer);
-  if (port->status == ACTIVE) {
-    sprintf(*buffer, "%d/%s:%d/%s", port->number, addr, port->sender_port,
-      vlan_buffer);
+  if (port->type != PORT_UDP) {
+    fprintf(out, "%d/%s:%s/", port->number, transport_names[port->type],
+      port->device);
+  } else if (status == ACTIVE) {
+    fprintf(out, "%d/%s:%d/", port->number, addr, sender_port);
   } else {
-    sprintf(*buffer, "%d//%s", port->number, vlan_buffer);
+    fprintf(out, "%d//", port->number);
   }
-  free(vlan_buffer);
+  print_vlans(port, out);
 }
 
 
-/* Prints VLANs of a given port 
+/* Prints VLANs of a given port, runs of tagged VLANs as ranges, like
+ * "5,10-200t,300t"
  * 
  * @param port - given port
- * @param buffer - buffer to print configuration in
+ * @param out - stream to print VLANs to
  */
-void print_vlans(port_t* port, char** buffer) {
-  int offset, untagged;
-  vlan_t* vlan = port->vlans;
-  char* string_node = *buffer;
-
-  /* Check if port is untegged */
-  untagged = port->untagged_vlan;
-
-  offset = 0;
-  while (vlan != NULL) {
-    if (vlan->number == untagged) {
-      offset += sprintf(string_node + offset, "%d,", vlan->number);
-    } else {
-      offset += sprintf(string_node + offset, "%dt,", vlan->number);
+void print_vlans(port_t* port, FILE* out) {
+  int number, last, first = 1;
+
+  for (number = 0; number < MAX_VLANS; number += 1) {
+    if (!valid_vlan(port, number))
+      continue;
+    if (!first)
+      fputc(',', out);
+    first = 0;
+
+    if (number == port->untagged_vlan) {
+      fprintf(out, "%d", number);
+      continue;
     }
-    vlan = vlan->next;
+
+    /* Longest run of tagged VLANs */
+    last = number;
+    while (last + 1 < MAX_VLANS && valid_vlan(port, last + 1) &&
+           last + 1 != port->untagged_vlan)
+      last += 1;
+
+    if (last > number)
+      fprintf(out, "%d-%dt", number, last);
+    else
+      fprintf(out, "%dt", number);
+    number = last;
   }
-  (*buffer)[strlen(*buffer) - 1] = '\0';
 }
 
 
@@ -332,10 +639,7 @@ void clean_ports() {
 
 
 int valid_vlan(port_t* port, int number) {
-  vlan_t* vlans = port->vlans;
-  vlan_t* node = vlans;
-  while (node != NULL && node->number != number) {
-    node = node->next;
-  }
-  return (node != NULL) ? 1 : 0;
+  if (number < 0 || number >= MAX_VLANS)
+    return 0;
+  return (port->vlans[number / 8] >> (number % 8)) & 1;
 }
@@ -7,8 +7,10 @@
 #define _PORTS_H
 
 #include <arpa/inet.h>
+#include <errno.h>
 #include <event2/event.h>
 #include <event2/util.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
@@ -23,57 +25,96 @@
 /* Definitions */
 #define ACTIVE 1             /* port is not configured */
 #define INACTIVE 0           /* port is configured */
-#define MAX_SOCKETS 100      /* maximum number of ports */
+#define MAX_SOCKETS 8192     /* maximum number of ports */
+#define MAX_PORT_NUMBER 65535
+#define MAX_VLANS 4096       /* VLAN numbers are 12 bits */
+#define PORT_UDP 0           /* transports of ports */
+#define PORT_SHM 1           /* shared memory rings of a local client */
+#define PORT_TAP 2           /* TAP interface of the switch host */
+#define PORT_PACKET 3        /* existing interface, AF_PACKET rings */
+#define PORT_DEVICE_LEN 64   /* device of a local transport */
 
 /* Events data */
-struct event_base* base;
-struct event* listener_socket_event;
+extern struct event_base* base;
+extern struct event* listener_socket_event;
 
 /* Definitions of structures */
-struct vlan_node {
-  int number;                /* VLAN number */
-  struct vlan_node *next;    /* next VLAN in list */
-};
-
 struct port_node {
   int number;                /* port number */
   int status;                /* ACTIVE or INACTIVE */
   unsigned long sender_addr; /* client address */
   int sender_port;           /* client port */
+  unsigned client_seq;       /* odd while status and client change */
   int untagged_vlan;         /* tagged or untagged */
-  struct vlan_node *vlans;   /* attached VLANs */
+  int default_pcp;           /* 802.1p priority of untagged frames */
+  int index;                 /* socket index, -1 if port has no socket */
+  int type;                  /* PORT_UDP or a local transport */
+  char device[PORT_DEVICE_LEN]; /* device of the transport, "" if none */
+  uint8_t vlans[MAX_VLANS / 8]; /* bitmap of attached VLANs */
   struct port_node *next;    /* next port node */
 };
 
 /* Definitions of types */
 typedef struct port_node port_t;
-typedef struct vlan_node vlan_t;
+
+struct frame_buf;
+
+/* Port that is not a UDP socket. Its frames are received when
+ * sockets[index] becomes readable, and a port that cannot send more waits
+ * for egress_events on egress_fds[index]. Both calls work like recvmmsg
+ * and sendmmsg: they return number of frames, or -1 and set errno */
+struct transport {
+  int (*receive)(int index, struct frame_buf** frames, int count);
+  int (*send)(int index, struct frame_buf** frames, int count);
+  void (*release)(int index);       /* NULL if closing the socket is enough */
+};
 
 /* Global data tables */
-evutil_socket_t sockets[MAX_SOCKETS];
-int ports[MAX_SOCKETS];
-struct event* events[MAX_SOCKETS];
-int udp_sent[MAX_SOCKETS];
-int udp_recv[MAX_SOCKETS];
-int udp_errs[MAX_SOCKETS];
+extern evutil_socket_t sockets[MAX_SOCKETS];
+extern int ports[MAX_SOCKETS];
+extern struct event* events[MAX_SOCKETS];
+extern const struct transport* transports[MAX_SOCKETS];  /* NULL - UDP socket */
+extern evutil_socket_t egress_fds[MAX_SOCKETS];
+extern short egress_events[MAX_SOCKETS];
+extern int udp_sent[MAX_SOCKETS];
+extern int udp_recv[MAX_SOCKETS];
+extern int udp_errs[MAX_SOCKETS];
+extern unsigned long long udp_recv_bytes[MAX_SOCKETS];
+extern unsigned long long udp_sent_bytes[MAX_SOCKETS];
+extern unsigned long long udp_flood[MAX_SOCKETS];    /* frames flooded to VLAN */
+extern unsigned long long tx_drops[MAX_SOCKETS];     /* egress queue overflows */
+extern unsigned long long vlan_frames[MAX_VLANS];
+extern unsigned long long vlan_bytes[MAX_VLANS];
+extern unsigned long long vlan_drops[MAX_VLANS];
 
 /* Functions */
+void atomic_inc(int* field);
 port_t* get_port(int number);
-port_t* parse_port(const char* raw);
+int read_port(const char* raw, port_t* port, char* host,
+  const char** error);
+int port_removed(const port_t* port);
+void init_port(port_t* port, int number);
+int find_ports(int vlan, int from, int to, port_t** result, int limit);
+void set_vlans(port_t* port, const uint8_t* vlans);
 void del_port(int number);
-void del_vlans(port_t* port);
 void free_array(char** array, int limit);
 port_t* create_port(int number);
-int check_tagging(char** string);
 void add_vlan(port_t* port, int number);
 void add_untagged_vlan(port_t* port, int number);
 void activate_port(port_t* port, unsigned long sender_addr, int sender_port);
-unsigned long extract_addr(const char* addr);
+void port_client(const port_t* port, int* status, unsigned long* sender_addr,
+  int* sender_port);
 int init_socket(int port_num);
+int claim_socket(int port_num, evutil_socket_t sock,
+  const struct transport* transport);
+int same_transport(const port_t* port, const port_t* other);
+void release_socket(int index);
+void inherit_socket(int port_num, evutil_socket_t sock);
+void close_inherited();
 void init_arrays();
 port_t* get_head();
-void print_config(port_t* port, char** buffer);
-void print_vlans(port_t* port, char** buffer);
+void print_config(port_t* port, FILE* out);
+void print_vlans(port_t* port, FILE* out);
 void clean_ports();
 int valid_vlan(port_t* port, int number);
 
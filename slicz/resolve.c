@@ -0,0 +1,215 @@
+/*
+ * Author: Konrad Słoniewski
+ * Date:   18 August 2013
+ */
+
+#include "resolve.h"
+
+/* Structs */
+
+/* Who waits for a name being resolved */
+struct name_waiter {
+  resolve_cb cb;
+  void* arg;
+  struct name_waiter* next;
+};
+
+/* Cached address of a name. Hosts file entries never expire, DNS answers
+ * expire after their TTL */
+struct name_entry {
+  char* name;
+  unsigned long s_addr;
+  int resolved;                  /* s_addr is valid */
+  int permanent;                 /* from hosts file */
+  time_t expires;                /* CLOCK_MONOTONIC seconds */
+  int querying;                  /* DNS query in progress */
+  struct name_waiter* waiters;
+  struct name_entry* next;
+};
+
+
+/* Attributes */
+
+static struct evdns_base* dns = NULL;
+static struct name_entry* names[RESOLVE_BUCKETS];
+
+
+/* Functions */
+
+static time_t now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+
+static unsigned name_hash(const char* name) {
+  unsigned hash = 5381;
+
+  while (*name != '\0')
+    hash = hash * 33 + (unsigned char) *name++;
+  return hash & (RESOLVE_BUCKETS - 1);
+}
+
+
+/* Returns cache entry of a name, created if there is none */
+static struct name_entry* get_entry(const char* name) {
+  struct name_entry* entry;
+  unsigned bucket = name_hash(name);
+
+  for (entry = names[bucket]; entry != NULL; entry = entry->next)
+    if (!strcmp(entry->name, name))
+      return entry;
+
+  entry = calloc(1, sizeof(*entry));
+  if (entry == NULL || (entry->name = strdup(name)) == NULL)
+    syserr("Allocating name cache.");
+  entry->next = names[bucket];
+  names[bucket] = entry;
+  return entry;
+}
+
+
+/* Reads IPv4 entries of hosts file, they are looked up before DNS */
+static void load_hosts(const char* path) {
+  FILE* file;
+  char *line = NULL, *token, *save;
+  size_t size = 0;
+  struct in_addr addr;
+  struct name_entry* entry;
+
+  file = fopen(path, "r");
+  if (file == NULL)
+    return;
+
+  while (getline(&line, &size, file) != -1) {
+    line[strcspn(line, "#\n")] = '\0';
+    token = strtok_r(line, " \t", &save);
+    if (token == NULL || inet_pton(AF_INET, token, &addr) != 1)
+      continue;
+    while ((token = strtok_r(NULL, " \t", &save)) != NULL) {
+      entry = get_entry(token);
+      if (entry->permanent)
+        continue;                /* first entry of a name counts */
+      entry->s_addr = addr.s_addr;
+      entry->resolved = 1;
+      entry->permanent = 1;
+    }
+  }
+
+  free(line);
+  fclose(file);
+}
+
+
+/* Name servers of the system and hosts file */
+void init_resolver(struct event_base* base) {
+  int result;
+
+  dns = evdns_base_new(base, 0);
+  if (dns == NULL)
+    syserr("Creating resolver.");
+  result = evdns_base_resolv_conf_parse(dns, DNS_OPTIONS_ALL, RESOLV_CONF);
+  if (result != 0)
+    fprintf(stderr, "Reading %s failed (%d).\n", RESOLV_CONF, result);
+  load_hosts(HOSTS_FILE);
+}
+
+
+/* DNS answer - caching it and waking up everyone who waits for it */
+static void name_resolved(int result, char type, int count, int ttl,
+  void* addresses, void* arg) {
+  struct name_entry* entry = (struct name_entry*) arg;
+  struct name_waiter *waiter, *next;
+
+  entry->querying = 0;
+  entry->resolved = (result == DNS_ERR_NONE && type == DNS_IPv4_A &&
+    count > 0);
+  if (entry->resolved) {
+    entry->s_addr = ((uint32_t*) addresses)[0];
+    entry->expires = now() + ttl;
+  } else {
+    fprintf(stderr, "Resolving %s (%s).\n", entry->name,
+      evdns_err_to_string(result));
+  }
+
+  /* Callbacks may ask for the name again */
+  waiter = entry->waiters;
+  entry->waiters = NULL;
+  while (waiter != NULL) {
+    next = waiter->next;
+    waiter->cb(entry->resolved, entry->s_addr, waiter->arg);
+    free(waiter);
+    waiter = next;
+  }
+}
+
+
+/* Address of a name without blocking. Returns 0 and sets s_addr if the
+ * name is numeric or cached, 1 if cb is called once the name is resolved,
+ * -1 if it cannot be resolved */
+int resolve_name(const char* name, unsigned long* s_addr, resolve_cb cb,
+  void* arg) {
+  struct in_addr numeric;
+  struct name_entry* entry;
+  struct name_waiter* waiter;
+
+  if (inet_pton(AF_INET, name, &numeric) == 1) {
+    *s_addr = numeric.s_addr;
+    return 0;
+  }
+
+  entry = get_entry(name);
+  if (entry->resolved && (entry->permanent || entry->expires > now())) {
+    *s_addr = entry->s_addr;
+    return 0;
+  }
+  if (dns == NULL)
+    return -1;
+
+  /* One query serves everyone who asks meanwhile. It may be answered
+   * before evdns_base_resolve_ipv4() returns */
+  if (!entry->querying) {
+    entry->querying = 1;
+    if (evdns_base_resolve_ipv4(dns, name, 0, name_resolved, entry) == NULL &&
+        entry->querying) {
+      entry->querying = 0;
+      return -1;
+    }
+    if (!entry->querying) {
+      *s_addr = entry->s_addr;
+      return entry->resolved ? 0 : -1;
+    }
+  }
+
+  waiter = malloc(sizeof(*waiter));
+  if (waiter == NULL)
+    syserr("Allocating name request.");
+  waiter->cb = cb;
+  waiter->arg = arg;
+  waiter->next = entry->waiters;
+  entry->waiters = waiter;
+
+  return 1;
+}
+
+
+/* Queries in progress fail, their callbacks are called */
+void clean_resolver() {
+  struct name_entry *entry, *next;
+  int i;
+
+  if (dns != NULL)
+    evdns_base_free(dns, 1);
+  dns = NULL;
+
+  for (i = 0; i < RESOLVE_BUCKETS; i += 1) {
+    for (entry = names[i]; entry != NULL; entry = next) {
+      next = entry->next;
+      free(entry->name);
+      free(entry);
+    }
+    names[i] = NULL;
+  }
+}
@@ -0,0 +1,33 @@
+/*
+ * Author: Konrad Słoniewski
+ * Date:   18 August 2013
+ */
+
+#ifndef _RESOLVE_H
+#define _RESOLVE_H
+
+#include <arpa/inet.h>
+#include <event2/dns.h>
+#include <event2/event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "err.h"
+
+/* Definitions */
+#define RESOLVE_BUCKETS 256          /* power of two */
+#define HOSTS_FILE "/etc/hosts"
+#define RESOLV_CONF "/etc/resolv.conf"
+
+/* Called with ok 0 if the name cannot be resolved */
+typedef void (*resolve_cb)(int ok, unsigned long s_addr, void* arg);
+
+/* Functions */
+void init_resolver(struct event_base* base);
+int resolve_name(const char* name, unsigned long* s_addr, resolve_cb cb,
+  void* arg);
+void clean_resolver();
+
+#endif
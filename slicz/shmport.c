@@ -0,0 +1,428 @@
+/*
+ * Author: Konrad Słoniewski
+ * Date:   18 August 2013
+ */
+
+/* Ports of local clients over shared memory (shmring.h). A port
+ * configured as "number/shm:/VLANs" gets a region and eventfds when it is
+ * created; a client asks for them by port number on the Unix socket of -L.
+ * The forwarding thread polls the ring of a port for a while after it had
+ * frames and sleeps on its eventfd when it stays empty, so clients rarely
+ * have to write eventfds under load. Frames are copied once each way,
+ * between ring slots and pool buffers.
+ *
+ * Only processes of the switch's user or group (or root) may attach, and
+ * one client at a time: its connection stays open while it is attached,
+ * and the port is free for another one when it ends. The port then gets
+ * a new region and eventfds, so the client that left keeps only ones the
+ * switch does not use anymore. */
+
+#define _GNU_SOURCE          /* struct ucred */
+#include "shmport.h"
+
+/* Structs */
+
+/* Region of a port and descriptors a client gets */
+struct shm_port {
+  struct shm_region* region;
+  int fds[SHM_FDS];
+  int idle;                        /* empty polls of to_switch in a row */
+  evutil_socket_t client;          /* connection of the client, or -1 */
+  struct event* client_event;      /* its end, on control thread */
+  int stale;                       /* region of a detached client kept */
+};
+
+/* New region and eventfds of a port, and the old ones after the swap */
+struct shm_renewal {
+  int index;
+  struct shm_region* region;
+  int fds[SHM_FDS];
+};
+
+
+/* Attributes */
+
+static struct shm_port* shm_ports[MAX_SOCKETS];  /* NULL - not a shm port */
+static evutil_socket_t local_listener = -1;
+static struct event* local_event = NULL;
+static const char* local_path = NULL;
+static struct event_base* local_base = NULL;    /* control thread */
+
+
+/* Functions */
+
+/* Frames of the client. Polling goes on while frames come, the port
+ * sleeps on its eventfd after SHM_POLL_IDLE empty polls */
+static int shm_receive(int index, struct frame_buf** frames, int count) {
+  struct shm_port* port = shm_ports[index];
+  struct shm_ring* ring = &port->region->to_switch;
+  char* data;
+  int len, n = 0;
+
+  while (n < count && (data = ring_peek(ring, &len)) != NULL) {
+    if (len <= FRAME_SIZE) {
+      memcpy(frames[n]->data, data, len);
+      frames[n]->len = len;
+      n += 1;
+    } else {
+      atomic_inc(udp_errs + index);
+    }
+    ring_pop(ring);
+  }
+  if (n > 0 && ring_wake_producer(ring))
+    signal_fd(port->fds[SHM_FD_CLIENT_TX]);
+
+  if (ring_keep_polling(ring, &port->idle, n > 0, sockets[index]))
+    event_active(events[index], EV_READ, 0);
+
+  if (n == 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+  return n;
+}
+
+
+/* Frames to the client, as many as fit into its ring. Egress waits for
+ * the room eventfd when none does */
+static int shm_send(int index, struct frame_buf** frames, int count) {
+  struct shm_port* port = shm_ports[index];
+  struct shm_ring* ring = &port->region->to_client;
+  char* slot;
+  int n;
+
+  for (n = 0; n < count; n += 1) {
+    slot = ring_slot(ring);
+    if (slot == NULL) {
+      clear_fd(egress_fds[index]);
+      if (ring_wait_room(ring))
+        break;
+      slot = ring_slot(ring);
+    }
+    memcpy(slot, frames[n]->data, frames[n]->len);
+    ring_push(ring, frames[n]->len);
+  }
+  if (n > 0 && ring_wake_consumer(ring))
+    signal_fd(port->fds[SHM_FD_CLIENT_RX]);
+
+  if (n == 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+  return n;
+}
+
+
+/* New region and eventfds into region and fds. Returns 0, or -1 */
+static int new_region(struct shm_region** region, int* fds) {
+  int i;
+
+  *region = create_region(&fds[SHM_FD_REGION]);
+  if (*region == NULL)
+    return -1;
+  for (i = SHM_FD_REGION + 1; i < SHM_FDS; i += 1) {
+    fds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fds[i] == -1) {
+      while (--i >= 0)
+        close(fds[i]);
+      munmap(*region, sizeof(struct shm_region));
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+/* Port is free for another client */
+static void detach_client(struct shm_port* port) {
+  if (port->client == -1)
+    return;
+  event_free(port->client_event);
+  port->client_event = NULL;
+  close(port->client);
+  port->client = -1;
+}
+
+
+/* Frees the region, sockets[index] is closed by release_socket() */
+static void shm_release(int index) {
+  struct shm_port* port = shm_ports[index];
+  int i;
+
+  detach_client(port);
+  munmap(port->region, sizeof(struct shm_region));
+  for (i = 0; i < SHM_FDS; i += 1)
+    if (i != SHM_FD_SWITCH_RX)
+      close(port->fds[i]);
+  free(port);
+  shm_ports[index] = NULL;
+}
+
+
+static const struct transport shm_transport = {
+  shm_receive, shm_send, shm_release
+};
+
+
+/* Creates region of a new shm port. Returns socket index, or -1 */
+int init_shm_port(int port_num) {
+  struct shm_port* port;
+  int i, index;
+
+  port = calloc(1, sizeof(*port));
+  if (port == NULL)
+    syserr("Allocating shm port.");
+  port->client = -1;
+  if (new_region(&port->region, port->fds) == -1) {
+    fprintf(stderr, "Creating region of port %d (%s).\n", port_num,
+      strerror(errno));
+    free(port);
+    return -1;
+  }
+
+  index = claim_socket(port_num, port->fds[SHM_FD_SWITCH_RX],
+    &shm_transport);
+  if (index == -1) {
+    munmap(port->region, sizeof(struct shm_region));
+    for (i = 0; i < SHM_FDS; i += 1)
+      close(port->fds[i]);
+    free(port);
+    return -1;
+  }
+  egress_fds[index] = port->fds[SHM_FD_SWITCH_TX];
+  egress_events[index] = EV_READ;
+  shm_ports[index] = port;
+  return index;
+}
+
+
+/* Empty rings for a new client, on forwarding thread. Frames of the
+ * previous client are dropped */
+static void reset_port(void* arg) {
+  struct shm_port* port = shm_ports[*(int*) arg];
+  int i;
+
+  ring_reset(&port->region->to_switch);
+  ring_reset(&port->region->to_client);
+  for (i = SHM_FD_REGION + 1; i < SHM_FDS; i += 1)
+    clear_fd(port->fds[i]);
+  port->idle = 0;
+}
+
+
+/* New region and eventfds in place of the old ones, on forwarding thread.
+ * The eventfds the switch waits on keep their numbers, their events are
+ * added again once they refer to the new ones. renewal gets the old
+ * region and the descriptors to close */
+static void swap_region(void* arg) {
+  struct shm_renewal* renewal = (struct shm_renewal*) arg;
+  struct shm_port* port = shm_ports[renewal->index];
+  struct shm_region* region = port->region;
+  int i, fd;
+
+  if (event_del(events[renewal->index]) == -1)
+    syserr("Deleting shm port event.");
+  hold_egress(renewal->index, 1);
+  for (i = 0; i < SHM_FDS; i += 1) {
+    fd = renewal->fds[i];
+    if (i == SHM_FD_SWITCH_RX || i == SHM_FD_SWITCH_TX) {
+      if (dup3(fd, port->fds[i], O_CLOEXEC) == -1)
+        syserr("Renewing eventfd of port %d.", ports[renewal->index]);
+    } else {
+      renewal->fds[i] = port->fds[i];
+      port->fds[i] = fd;
+    }
+  }
+  port->region = renewal->region;
+  renewal->region = region;
+  port->idle = 0;
+  if (event_add(events[renewal->index], NULL) == -1)
+    syserr("Adding shm port event.");
+  hold_egress(renewal->index, 0);
+}
+
+
+/* Gives the port a new region, so a client that has left cannot reach
+ * frames of the next one. Returns 0, or -1 if the old one is kept */
+static int renew_region(int index) {
+  struct shm_renewal renewal;
+  int i;
+
+  renewal.index = index;
+  if (new_region(&renewal.region, renewal.fds) == -1) {
+    fprintf(stderr, "Renewing region of port %d (%s).\n", ports[index],
+      strerror(errno));
+    shm_ports[index]->stale = 1;
+    return -1;
+  }
+  data_plane_call(swap_region, &renewal);
+
+  munmap(renewal.region, sizeof(struct shm_region));
+  for (i = 0; i < SHM_FDS; i += 1)
+    close(renewal.fds[i]);
+  shm_ports[index]->stale = 0;
+  return 0;
+}
+
+
+/* Connection of an attached client has ended, or it sent something */
+static void client_closed(evutil_socket_t sock, short ev, void* arg) {
+  int index = (int) (intptr_t) arg;
+  char buf[64];
+  ssize_t r;
+
+  r = recv(sock, buf, sizeof(buf), MSG_DONTWAIT);
+  if (r > 0 || (r == -1 && (errno == EAGAIN || errno == EINTR)))
+    return;
+  fprintf(stderr, "Local client of port %d detached.\n", ports[index]);
+  detach_client(shm_ports[index]);
+  renew_region(index);
+}
+
+
+/* Processes of the switch's user or group, or root */
+static int allowed(evutil_socket_t sock) {
+  struct ucred cred;
+  socklen_t size = sizeof(cred);
+
+  if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &size) == -1)
+    return 0;
+  return cred.uid == 0 || cred.uid == geteuid() || cred.gid == getegid();
+}
+
+
+/* Answers an attach request, region and eventfds go with SCM_RIGHTS. The
+ * connection of an attached client is kept */
+static void attach_client(evutil_socket_t sock, short ev, void* arg) {
+  char control[CMSG_SPACE(SHM_FDS * sizeof(int))];
+  struct shm_attach request;
+  struct shm_answer answer;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr* cmsg;
+  struct shm_port* shm;
+  port_t* port;
+  int index = -1;
+
+  event_free((struct event*) arg);
+  if (!(ev & EV_READ) ||
+      recv(sock, &request, sizeof(request), MSG_DONTWAIT) != sizeof(request) ||
+      request.magic != SHM_MAGIC) {
+    close(sock);
+    return;
+  }
+
+  memset(&answer, 0, sizeof(answer));
+  answer.magic = SHM_MAGIC;
+  port = get_port(request.port);
+  if (request.version != SHM_VERSION)
+    answer.status = SHM_WRONG_VERSION;
+  else if (!allowed(sock))
+    answer.status = SHM_DENIED;
+  else if (port == NULL || port->type != PORT_SHM || port->index == -1)
+    answer.status = SHM_NO_PORT;
+  else if (shm_ports[port->index]->client != -1)
+    answer.status = SHM_BUSY;
+  else if (shm_ports[port->index]->stale && renew_region(port->index) == -1)
+    answer.status = SHM_FAILED;
+  else
+    index = port->index;
+
+  memset(&msg, 0, sizeof(msg));
+  memset(control, 0, sizeof(control));
+  iov.iov_base = &answer;
+  iov.iov_len = sizeof(answer);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (index != -1) {
+    data_plane_call(reset_port, &index);
+    answer.status = SHM_ATTACHED;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(SHM_FDS * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), shm_ports[index]->fds, SHM_FDS * sizeof(int));
+  }
+
+  if (sendmsg(sock, &msg, MSG_DONTWAIT) != sizeof(answer)) {
+    fprintf(stderr, "Answering local client (%s).\n", strerror(errno));
+    index = -1;
+  } else if (index != -1) {
+    fprintf(stderr, "Local client attached to port %d.\n", request.port);
+  } else if (answer.status == SHM_BUSY || answer.status == SHM_DENIED) {
+    fprintf(stderr, "Local client refused on port %d (%s).\n", request.port,
+      answer.status == SHM_BUSY ? "port has a client" : "user not allowed");
+  }
+  if (index == -1) {
+    close(sock);
+    return;
+  }
+
+  shm = shm_ports[index];
+  shm->client = sock;
+  shm->client_event = event_new(local_base, sock, EV_READ|EV_PERSIST,
+    client_closed, (void*) (intptr_t) index);
+  if (shm->client_event == NULL || event_add(shm->client_event, NULL) == -1)
+    syserr("Adding local client event.");
+}
+
+
+/* New local client, its request is read once it comes */
+static void accept_client(evutil_socket_t sock, short ev, void* arg) {
+  struct event_base* base = (struct event_base*) arg;
+  struct timeval timeout = { SHM_ATTACH_TIMEOUT_SEC, 0 };
+  struct event* request;
+  evutil_socket_t client;
+
+  client = accept(sock, NULL, NULL);
+  if (client == -1)
+    return;
+  request = event_new(base, client, EV_READ, attach_client,
+    event_self_cbarg());
+  if (request == NULL || event_add(request, &timeout) == -1)
+    syserr("Adding local client event.");
+}
+
+
+/* Local clients attach to shm ports through a Unix socket at path, served
+ * by base, the control thread */
+void listen_local_clients(const char* path, struct event_base* base) {
+  struct sockaddr_un addr;
+
+  local_path = path;
+  local_base = base;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path))
+    fatal("Local clients socket path %s is too long.", path);
+  strcpy(addr.sun_path, path);
+
+  /* Other users cannot connect; the mode is set before it listens */
+  unlink(path);
+  local_listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (local_listener == -1 ||
+      bind(local_listener, (struct sockaddr*) &addr, sizeof(addr)) == -1 ||
+      chmod(path, SHM_SOCKET_MODE) == -1 ||
+      listen(local_listener, 16) == -1 ||
+      evutil_make_socket_nonblocking(local_listener) == -1)
+    syserr("Listening for local clients on %s.", path);
+
+  local_event = event_new(base, local_listener, EV_READ|EV_PERSIST,
+    accept_client, base);
+  if (local_event == NULL || event_add(local_event, NULL) == -1)
+    syserr("Adding local clients event.");
+}
+
+
+/* Switch is shut down, clients cannot attach anymore */
+void stop_local_clients() {
+  if (local_event == NULL)
+    return;
+  event_free(local_event);
+  local_event = NULL;
+  close(local_listener);
+  local_listener = -1;
+  unlink(local_path);
+}
@@ -0,0 +1,38 @@
+/*
+ * Author: Konrad Słoniewski
+ * Date:   18 August 2013
+ */
+
+#ifndef _SHMPORT_H
+#define _SHMPORT_H
+
+#include <errno.h>
+#include <event2/event.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "ports.h"
+#include "framebuf.h"
+#include "forward.h"
+#include "planes.h"
+#include "shmring.h"
+#include "err.h"
+
+/* Definitions */
+#define SHM_ATTACH_TIMEOUT_SEC 1     /* for the request of a client */
+#define SHM_SOCKET_MODE 0660         /* clients of the switch's user or group */
+
+/* Functions */
+int init_shm_port(int port_num);
+void listen_local_clients(const char* path, struct event_base* base);
+void stop_local_clients();
+
+#endif
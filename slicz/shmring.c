@@ -0,0 +1,239 @@
+/*
+ * Author: Konrad Słoniewski
+ * Date:   18 August 2013
+ */
+
+#define _GNU_SOURCE        /* memfd_create */
+
+#include "shmring.h"
+
+
+/* Functions */
+
+/* Producer: slot for the next frame, NULL if the ring is full */
+char* ring_slot(struct shm_ring* ring) {
+  uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+  if (ring->head - tail >= SHM_RING_SLOTS)
+    return NULL;
+  return ring->slots[ring->head % SHM_RING_SLOTS].data;
+}
+
+
+/* Producer: publishes frame written to ring_slot() */
+void ring_push(struct shm_ring* ring, int len) {
+  ring->slots[ring->head % SHM_RING_SLOTS].len = len;
+  __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+
+/* Producer, after pushing frames: 1 if the consumer sleeps and its eventfd
+ * has to be written */
+int ring_wake_consumer(struct shm_ring* ring) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  return __atomic_load_n(&ring->consumer_sleeping, __ATOMIC_RELAXED);
+}
+
+
+/* Producer, ring is full: asks the consumer for a wakeup. Returns 0 if
+ * room appeared meanwhile */
+int ring_wait_room(struct shm_ring* ring) {
+  __atomic_store_n(&ring->producer_waiting, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (ring_slot(ring) != NULL) {
+    __atomic_store_n(&ring->producer_waiting, 0, __ATOMIC_RELAXED);
+    return 0;
+  }
+  return 1;
+}
+
+
+/* Consumer: the oldest frame, NULL if the ring is empty */
+char* ring_peek(struct shm_ring* ring, int* len) {
+  struct shm_slot* slot;
+
+  if (ring->tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+    return NULL;
+  slot = &ring->slots[ring->tail % SHM_RING_SLOTS];
+  *len = (slot->len <= SHM_SLOT_DATA) ? slot->len : SHM_SLOT_DATA;
+  return slot->data;
+}
+
+
+/* Consumer: frees slot of ring_peek() */
+void ring_pop(struct shm_ring* ring) {
+  __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+
+/* Consumer, after popping frames: 1 if the producer waits for room and
+ * its eventfd has to be written */
+int ring_wake_producer(struct shm_ring* ring) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (!__atomic_load_n(&ring->producer_waiting, __ATOMIC_RELAXED))
+    return 0;
+  __atomic_store_n(&ring->producer_waiting, 0, __ATOMIC_RELAXED);
+  return 1;
+}
+
+
+/* Consumer, nothing to read for a while: returns 1 if it may wait for its
+ * eventfd, 0 if a frame came meanwhile */
+int ring_sleep(struct shm_ring* ring) {
+  int len;
+
+  __atomic_store_n(&ring->consumer_sleeping, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (ring_peek(ring, &len) != NULL) {
+    ring_awake(ring);
+    return 0;
+  }
+  return 1;
+}
+
+
+/* Consumer polls, producer need not write eventfd */
+void ring_awake(struct shm_ring* ring) {
+  if (__atomic_load_n(&ring->consumer_sleeping, __ATOMIC_RELAXED))
+    __atomic_store_n(&ring->consumer_sleeping, 0, __ATOMIC_RELAXED);
+}
+
+
+/* Consumer, after a poll that got frames or none: returns 1 if it should
+ * poll again, or 0 if it sleeps until eventfd fd is written. It sleeps
+ * after SHM_POLL_IDLE empty polls in a row, counted in idle */
+int ring_keep_polling(struct shm_ring* ring, int* idle, int got, int fd) {
+  *idle = got ? 0 : *idle + 1;
+  if (*idle >= SHM_POLL_IDLE) {
+    clear_fd(fd);
+    if (ring_sleep(ring)) {
+      *idle = 0;
+      return 0;
+    }
+  }
+  ring_awake(ring);
+  return 1;
+}
+
+
+/* Empty ring, nobody waiting, for a new client */
+void ring_reset(struct shm_ring* ring) {
+  ring->head = 0;
+  ring->tail = 0;
+  ring->producer_waiting = 0;
+  ring->consumer_sleeping = 1;
+}
+
+
+void signal_fd(int fd) {
+  uint64_t one = 1;
+
+  if (write(fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+    perror("Writing eventfd");
+}
+
+
+void clear_fd(int fd) {
+  uint64_t count;
+
+  if (read(fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+    perror("Reading eventfd");
+}
+
+
+/* Switch: new region with empty rings, fd is its memfd */
+struct shm_region* create_region(int* fd) {
+  struct shm_region* region;
+
+  *fd = memfd_create("slicz-port", MFD_CLOEXEC);
+  if (*fd == -1)
+    return NULL;
+  if (ftruncate(*fd, sizeof(struct shm_region)) == -1) {
+    close(*fd);
+    return NULL;
+  }
+  region = mmap(NULL, sizeof(struct shm_region), PROT_READ | PROT_WRITE,
+    MAP_SHARED, *fd, 0);
+  if (region == MAP_FAILED) {
+    close(*fd);
+    return NULL;
+  }
+
+  region->magic = SHM_MAGIC;
+  region->version = SHM_VERSION;
+  ring_reset(&region->to_switch);
+  ring_reset(&region->to_client);
+  return region;
+}
+
+
+/* Client: attaches to a port of the switch listening on a Unix socket.
+ * Returns mapped region and its SHM_FDS descriptors, fatal on errors */
+struct shm_region* attach_region(const char* path, int port, int* fds) {
+  struct shm_region* region;
+  struct shm_attach request;
+  struct shm_answer answer;
+  struct sockaddr_un addr;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr* cmsg;
+  char control[CMSG_SPACE(SHM_FDS * sizeof(int))];
+  int sock;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path))
+    fatal("Too long socket path %s.", path);
+  strcpy(addr.sun_path, path);
+
+  sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock == -1)
+    syserr("socket");
+  if (connect(sock, (struct sockaddr*) &addr, sizeof(addr)) == -1)
+    syserr("Connecting to switch %s", path);
+
+  request.magic = SHM_MAGIC;
+  request.version = SHM_VERSION;
+  request.port = port;
+  if (write(sock, &request, sizeof(request)) != sizeof(request))
+    syserr("Sending attach request");
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = &answer;
+  iov.iov_len = sizeof(answer);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  if (recvmsg(sock, &msg, MSG_WAITALL) != sizeof(answer) ||
+      answer.magic != SHM_MAGIC)
+    fatal("No answer of switch %s.", path);
+
+  /* The connection is not closed, the switch detaches the client when it
+   * ends with this process */
+  if (answer.status == SHM_NO_PORT)
+    fatal("Port %d of switch %s is not a shm port.", port, path);
+  if (answer.status == SHM_BUSY)
+    fatal("Port %d of switch %s has a client already.", port, path);
+  if (answer.status == SHM_DENIED)
+    fatal("Switch %s does not allow this user.", path);
+  if (answer.status == SHM_FAILED)
+    fatal("Switch %s has no region for port %d now.", path, port);
+  if (answer.status != SHM_ATTACHED)
+    fatal("Switch %s does not support this client version.", path);
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(SHM_FDS * sizeof(int)))
+    fatal("Switch %s sent no descriptors.", path);
+  memcpy(fds, CMSG_DATA(cmsg), SHM_FDS * sizeof(int));
+
+  region = mmap(NULL, sizeof(struct shm_region), PROT_READ | PROT_WRITE,
+    MAP_SHARED, fds[SHM_FD_REGION], 0);
+  if (region == MAP_FAILED)
+    syserr("Mapping port region");
+  if (region->magic != SHM_MAGIC || region->version != SHM_VERSION)
+    fatal("Wrong port region of switch %s.", path);
+
+  return region;
+}
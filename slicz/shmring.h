@@ -0,0 +1,102 @@
+/*
+ * Author: Konrad Słoniewski
+ * Date:   18 August 2013
+ */
+
+#ifndef _SHMRING_H
+#define _SHMRING_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "err.h"
+
+/* Frames of a local client and its switch port go through two
+ * single-producer single-consumer rings in a memfd region instead of UDP.
+ * The client gets the region and four eventfds from the switch over a Unix
+ * socket (slicz -L). A consumer that has nothing to read sets sleeping and
+ * waits for its eventfd, which the producer writes only then; a producer
+ * that finds the ring full sets waiting and waits for the other one. */
+
+/* Definitions */
+#define SHM_MAGIC 0x52435a53         /* "SZCR" */
+#define SHM_VERSION 1
+#define SHM_RING_SLOTS 1024          /* power of two */
+#define SHM_SLOT_DATA 2044           /* biggest frame, with a tag */
+#define SHM_POLL_IDLE 64             /* empty polls before sleeping */
+#define SHM_FDS 5                    /* region and eventfds, in this order */
+#define SHM_FD_REGION 0
+#define SHM_FD_SWITCH_RX 1           /* frames in to_switch */
+#define SHM_FD_SWITCH_TX 2           /* room in to_client */
+#define SHM_FD_CLIENT_RX 3           /* frames in to_client */
+#define SHM_FD_CLIENT_TX 4           /* room in to_switch */
+#define SHM_ATTACHED 0               /* answers */
+#define SHM_NO_PORT 1
+#define SHM_WRONG_VERSION 2
+#define SHM_BUSY 3                   /* port has a client already */
+#define SHM_DENIED 4                 /* user of the client is not allowed */
+#define SHM_FAILED 5                 /* switch has no region for the client */
+
+/* Structures */
+struct shm_slot {
+  uint32_t len;
+  char data[SHM_SLOT_DATA];
+};
+
+/* Indexes only grow, slot of an index is index % SHM_RING_SLOTS. Fields
+ * written by the producer and by the consumer are on separate lines */
+struct shm_ring {
+  uint64_t head __attribute__((aligned(64)));  /* next slot to fill */
+  uint32_t producer_waiting;
+  uint64_t tail __attribute__((aligned(64)));  /* next slot to read */
+  uint32_t consumer_sleeping;
+  struct shm_slot slots[SHM_RING_SLOTS] __attribute__((aligned(64)));
+};
+
+struct shm_region {
+  uint32_t magic;
+  uint32_t version;
+  struct shm_ring to_switch __attribute__((aligned(64)));
+  struct shm_ring to_client;
+};
+
+/* Client to switch over the Unix socket. The client keeps the connection
+ * open while it is attached */
+struct shm_attach {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t port;
+};
+
+/* Switch to client, with SHM_FDS descriptors if status is SHM_ATTACHED */
+struct shm_answer {
+  uint32_t magic;
+  uint32_t status;
+};
+
+/* Functions */
+char* ring_slot(struct shm_ring* ring);
+void ring_push(struct shm_ring* ring, int len);
+int ring_wake_consumer(struct shm_ring* ring);
+int ring_wait_room(struct shm_ring* ring);
+char* ring_peek(struct shm_ring* ring, int* len);
+void ring_pop(struct shm_ring* ring);
+int ring_wake_producer(struct shm_ring* ring);
+int ring_sleep(struct shm_ring* ring);
+void ring_awake(struct shm_ring* ring);
+int ring_keep_polling(struct shm_ring* ring, int* idle, int got, int fd);
+void ring_reset(struct shm_ring* ring);
+void signal_fd(int fd);
+void clear_fd(int fd);
+struct shm_region* create_region(int* fd);
+struct shm_region* attach_region(const char* path, int port, int* fds);
+
+#endif
@@ -0,0 +1,204 @@
+/*
+ * Author: Konrad Słoniewski
+ * Date:   18 August 2013
+ */
+
+/* Prints rates of slicz counters from its shared memory region (slicz -S),
+ * without using the control connection:
+ *   slicz-stat [-a] [-i <ms>] [-n <count>] [<name>]
+ * Every interval one summary line and one line of every port that
+ * received or sent frames (of every port with -a). */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+
+#include "stats.h"
+#include "err.h"
+
+/* Definitions */
+#define READ_RETRIES 1000          /* of a copy torn by the writer */
+#define RETRY_USEC 100
+
+/* Global variables */
+static struct stats_region previous;
+static struct stats_region current;
+static ino_t region_inode;         /* of the mapped region */
+
+
+/* Functions */
+
+/* Copies region to copy under its seqlock */
+static void read_region(const struct stats_region* region,
+  struct stats_region* copy) {
+  uint64_t before, after;
+  int i;
+
+  for (i = 0; i < READ_RETRIES; i += 1) {
+    before = __atomic_load_n(&region->seq, __ATOMIC_ACQUIRE);
+    if (before % 2 == 0) {
+      memcpy(copy, region, sizeof(*copy));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      after = __atomic_load_n(&region->seq, __ATOMIC_RELAXED);
+      if (before == after)
+        return;
+    }
+    usleep(RETRY_USEC);
+  }
+  fatal("Statistics region is being written for too long.");
+}
+
+
+/* Maps region of the name. Returns NULL if the name refers to the mapped
+ * region still, or to nothing and fail is 0 */
+static struct stats_region* open_region(const char* name, int fail) {
+  struct stats_region* region;
+  struct stat info;
+  int fd;
+
+  fd = shm_open(name, O_RDONLY, 0);
+  if (fd == -1 && !fail)
+    return NULL;
+  if (fd == -1)
+    syserr("Opening statistics region %s.", name);
+  if (fstat(fd, &info) == -1)
+    syserr("Reading size of statistics region.");
+  if (!fail && info.st_ino == region_inode) {
+    close(fd);
+    return NULL;
+  }
+  if (info.st_size < (off_t) sizeof(struct stats_region))
+    fatal("Statistics region %s is too small.", name);
+  region = mmap(NULL, sizeof(struct stats_region), PROT_READ, MAP_SHARED,
+    fd, 0);
+  if (region == MAP_FAILED)
+    syserr("Mapping statistics region.");
+  close(fd);
+  region_inode = info.st_ino;
+
+  read_region(region, &current);
+  if (current.magic != STATS_MAGIC || current.version != STATS_VERSION ||
+      current.size != sizeof(struct stats_region))
+    fatal("%s is not a statistics region of this version.", name);
+  return region;
+}
+
+
+/* Change of a counter per second */
+static double rate(uint64_t now, uint64_t then, double seconds) {
+  if (now < then)               /* port was created again */
+    return now / seconds;
+  return (now - then) / seconds;
+}
+
+
+/* Prints rates between previous and current copies */
+static void print_rates(int all) {
+  const struct stats_port* now;
+  const struct stats_port* then;
+  double seconds;
+  int i;
+
+  seconds = (current.updated_ns - previous.updated_ns) / 1e9;
+  if (seconds <= 0) {
+    printf("no update (switch %llu stopped?)\n",
+      (unsigned long long) current.pid);
+    return;
+  }
+
+  printf("ports %llu  macs %llu/%llu  learned/s %.0f  evicted/s %.0f  "
+    "free buffers %llu  loop lag avg %.1f max %.1f us\n",
+    (unsigned long long) current.ports,
+    (unsigned long long) current.mac_entries,
+    (unsigned long long) current.mac_capacity,
+    rate(current.mac_learned, previous.mac_learned, seconds),
+    rate(current.mac_evicted, previous.mac_evicted, seconds),
+    (unsigned long long) current.frame_pool_free,
+    (current.loop_ticks > previous.loop_ticks) ?
+      (current.loop_lag_sum_ns - previous.loop_lag_sum_ns) / 1e3 /
+      (current.loop_ticks - previous.loop_ticks) : 0.0,
+    current.loop_lag_max_ns / 1e3);
+
+  for (i = 0; i < STATS_PORTS; i += 1) {
+    now = &current.port[i];
+    then = &previous.port[i];
+    if (now->number == 0)
+      continue;
+    if (then->number != now->number)
+      then = &current.port[i];  /* new port, rates from the next line */
+    if (!all && now->rx_frames == then->rx_frames &&
+        now->tx_frames == then->tx_frames)
+      continue;
+    printf("  %5llu  rx %9.0f f/s %9.3f Mb/s  tx %9.0f f/s %9.3f Mb/s"
+      "  errs/s %.0f  drops/s %.0f  flood/s %.0f\n",
+      (unsigned long long) now->number,
+      rate(now->rx_frames, then->rx_frames, seconds),
+      rate(now->rx_bytes, then->rx_bytes, seconds) * 8 / 1e6,
+      rate(now->tx_frames, then->tx_frames, seconds),
+      rate(now->tx_bytes, then->tx_bytes, seconds) * 8 / 1e6,
+      rate(now->errors, then->errors, seconds),
+      rate(now->egress_drops, then->egress_drops, seconds),
+      rate(now->flooded, then->flooded, seconds));
+  }
+  fflush(stdout);
+}
+
+
+int main(int argc, char* argv[]) {
+  const char* name;
+  struct stats_region* region;
+  struct stats_region* newer;
+  int interval;                 /* ms */
+  int count;                    /* of printed intervals, 0 for no limit */
+  int all;
+  int c;
+
+  name = STATS_DEFAULT_NAME;
+  interval = 1000;
+  count = 0;
+  all = 0;
+  opterr = 0;
+  while ((c = getopt(argc, argv, "ai:n:")) != -1) {
+    switch (c) {
+      case 'a':
+        all = 1;
+        break;
+      case 'i':
+        interval = atoi(optarg);
+        if (interval <= 0)
+          fatal("Wrong interval.");
+        break;
+      case 'n':
+        count = atoi(optarg);
+        break;
+      default:
+        fatal("Usage: %s [-a] [-i <ms>] [-n <count>] [<name>]", argv[0]);
+    }
+  }
+  if (optind < argc)
+    name = argv[optind];
+
+  region = open_region(name, 1);
+  if (kill(current.pid, 0) == -1 && errno == ESRCH)
+    fprintf(stderr, "Switch %llu is not running.\n",
+      (unsigned long long) current.pid);
+
+  for (c = 0; count == 0 || c < count; c += 1) {
+    previous = current;
+    usleep(interval * 1000);
+
+    /* A new switch of an upgrade has its own region, counted from zero */
+    newer = open_region(name, 0);
+    if (newer != NULL) {
+      munmap(region, sizeof(struct stats_region));
+      region = newer;
+      printf("switch %llu took over\n", (unsigned long long) current.pid);
+      continue;
+    }
+    read_region(region, &current);
+    print_rates(all);
+  }
+
+  munmap(region, sizeof(struct stats_region));
+  return 0;
+}
@@ -14,11 +14,31 @@
 #include <stdlib.h>        /* atoi */
 #include <string.h>        /* memset */
 #include <unistd.h>        /* getopt */
+#include <pthread.h>       /* pthread_create */
+#include <sys/resource.h>  /* setrlimit */
 
 #include "err.h"           /* syserr, fatal */
 #include "control.h"
 #include "ports.h"         /* port_t type, clean_ports() */
 #include "macs.h"          /* clean_mac_map() */ 
+#include "metrics.h"       /* init_metrics() */
+#include "framebuf.h"      /* init_frame_pool() */
+#include "config.h"        /* struct transaction */
+#include "resolve.h"       /* init_resolver() */
+#include "planes.h"        /* start_data_plane() */
+#include "snapshot.h"      /* read_snapshot() */
+#include "stats.h"         /* init_stats() */
+#include "upgrade.h"       /* take_over() */
+#include "shmport.h"       /* listen_local_clients() */
+
+
+/* Control thread, serves control connections and metrics */
+static void* serve_control(void* arg) {
+  if (event_base_dispatch(control_base) == -1)
+    syserr("Control connections.");
+  return NULL;
+}
+
 
 
 /*****************************************************************************
@@ -27,10 +47,21 @@
 int main(int argc, char *argv[]) {
   int c;                            /* used as getopt return */
   int console_port;                 /* switch control port */
+  int metrics_port;                 /* HTTP metrics port, 0 if disabled */
+  pthread_t control_thread;         /* control service */
+  int queue_len;                    /* egress queue length, frames */
+  int drop_policy;                  /* DROP_TAIL or DROP_HEAD */
   evutil_socket_t listener_socket;  /* socket for TCP control service client */
   struct sockaddr_in listener_addr; /* addres of client on console service */
-  int sock;                         /* server socket */
-  port_t *port;
+  struct transaction* startup;      /* ports of -p and -f options */
+  const char* snapshot_file;        /* warm restart file, NULL if none */
+  const char* upgrade_path;         /* handoff socket, NULL if none */
+  const char* stats_name;           /* shared memory statistics, or NULL */
+  const char* local_path;           /* socket of shm clients, or NULL */
+  int taken_over;                   /* state came from a running switch */
+  evutil_socket_t metrics_listener; /* handed over, -1 if none */
+  const char* error;
+  struct rlimit files;
   opterr = 0;
 
   /* SIG_INT handle registration */
@@ -38,20 +69,48 @@ int main(int argc, char *argv[]) {
   if (signal(SIGINT, handle_sigint) == SIG_ERR)
     syserr("Signal handler overwrite.");
 
-  /* Creating new base event */
+  /* Control client may close before reading all replies */
+  if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+    syserr("Ignoring SIGPIPE.");
+
+  /* Creating new base events, forwarding and control run in two threads */
+  if (evthread_use_pthreads() == -1)
+    fatal("Libevent without threads.");
   base = event_base_new();
-  if (!base)
+  control_base = event_base_new();
+  if (!base || !control_base)
     syserr("Creating new base event.");
+  init_planes(base);
 
   /* Initialize data structures */
   init_arrays();
+  init_frame_pool();
+  init_resolver(control_base);
+  init_watch(control_base);
+  startup = new_transaction();
+
+  /* Every port is a socket, thousands of them need more descriptors */
+  if (getrlimit(RLIMIT_NOFILE, &files) == 0 &&
+      files.rlim_cur < files.rlim_max) {
+    files.rlim_cur = files.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &files) == -1)
+      fprintf(stderr, "Raising open files limit (%s).\n", strerror(errno));
+  }
 
   /* Setting default console port */
   console_port = 42420;
+  metrics_port = 0;
+  queue_len = EGRESS_QUEUE_DEFAULT;
+  drop_policy = DROP_TAIL;
+  snapshot_file = NULL;
+  upgrade_path = NULL;
+  stats_name = NULL;
+  local_path = NULL;
+  taken_over = 0;
 
   /* Reading arguments */
   printf("LOADING: Reading arguments.\n");
-  while ((c = getopt(argc, argv, "c:p:")) != -1) {
+  while ((c = getopt(argc, argv, "c:d:f:L:m:p:q:s:S:u:")) != -1) {
     switch (c)
     {
       case 'c':
@@ -62,13 +121,43 @@ int main(int argc, char *argv[]) {
           fprintf(stderr, "Port number: %d.\n", console_port);
         }
         break;
+      case 'd':
+        if (!strcmp(optarg, "tail"))
+          drop_policy = DROP_TAIL;
+        else if (!strcmp(optarg, "head"))
+          drop_policy = DROP_HEAD;
+        else
+          fatal("Drop policy must be tail or head.");
+        set_egress_queue(queue_len, drop_policy);
+        break;
+      case 'q':
+        queue_len = atoi(optarg);
+        set_egress_queue(queue_len, drop_policy);
+        break;
+      case 'L':
+        local_path = optarg;
+        break;
+      case 'm':
+        metrics_port = atoi(optarg);
+        if (metrics_port == 0)
+          fatal("Wrong metrics port number.");
+        break;
+      case 'f':
+        if (stage_file(startup, optarg, &error) == -1)
+          fatal("Configuration file %s: %s.", optarg, error);
+        break;
       case 'p':
-        fprintf(stderr, "%s\n", optarg);
-        port = parse_port(optarg);
-        sock = init_socket(port->number);
-        fprintf(stderr, "%d\n", sock);
-        ports[sock] = port->number;
-        start_event(sock, base, udp_manage);
+        if (stage_port(startup, optarg, &error) == -1)
+          fatal("Port %s: %s.", optarg, error);
+        break;
+      case 's':
+        snapshot_file = optarg;
+        break;
+      case 'S':
+        stats_name = optarg;
+        break;
+      case 'u':
+        upgrade_path = optarg;
         break;
       default:
         abort();
@@ -76,42 +165,101 @@ int main(int argc, char *argv[]) {
     }
   }
 
+  /* Ports of all -p and -f options and the rest of the snapshot are
+   * created together */
+  printf("LOADING: Creating ports.\n");
+  while (startup->pending > 0)
+    event_base_loop(control_base, EVLOOP_ONCE);
+  init_snapshot(snapshot_file);
+  if (upgrade_path != NULL)
+    taken_over = take_over(upgrade_path, startup);
+  if (!taken_over)
+    read_snapshot(startup);
+  if (commit_transaction(startup, &error) == -1)
+    fatal("%s.", error);
+  free_transaction(startup);
+  restore_snapshot();
+
   /* Switch's control service via TCP */
   printf("LOADING: Initialize control service.\n");
   init_clients();
-  listener_socket = socket(PF_INET, SOCK_STREAM, 0);
-  if (listener_socket == -1)
-    syserr("Creating socket.");
-  if (evutil_make_listen_socket_reuseable(listener_socket))
-    syserr("Making listen socket reuseable.");
-  if (evutil_make_socket_nonblocking(listener_socket))
-    syserr("Making socket nonblocking.");
-  
-  listener_addr.sin_family = AF_INET;
-  listener_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-  listener_addr.sin_port = htons(console_port);
-  
-  if (bind(listener_socket, (struct sockaddr *) &listener_addr, 
-      sizeof(listener_addr)) == -1)
-    syserr("Binding socket.");
-  
-  if (listen(listener_socket, 5) == -1)
-    syserr("listen"); 
-  
-  listener_socket_event = event_new(base, listener_socket, EV_READ|EV_PERSIST, 
-    listener_manage, (void *) base);
+  listener_socket = upgrade_socket(UPGRADE_CONTROL);
+  if (listener_socket == -1) {
+    listener_socket = socket(PF_INET, SOCK_STREAM, 0);
+    if (listener_socket == -1)
+      syserr("Creating socket.");
+    if (evutil_make_listen_socket_reuseable(listener_socket))
+      syserr("Making listen socket reuseable.");
+    if (evutil_make_socket_nonblocking(listener_socket))
+      syserr("Making socket nonblocking.");
+
+    listener_addr.sin_family = AF_INET;
+    listener_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    listener_addr.sin_port = htons(console_port);
+
+    if (bind(listener_socket, (struct sockaddr *) &listener_addr,
+        sizeof(listener_addr)) == -1)
+      syserr("Binding socket.");
+
+    if (listen(listener_socket, 5) == -1)
+      syserr("listen");
+  }
+
+  listener_socket_event = event_new(control_base, listener_socket,
+    EV_READ|EV_PERSIST, listener_manage, (void *) control_base);
   if (!listener_socket_event)
     syserr("Error creating event for a listener socket.");
 
   if (event_add(listener_socket_event, NULL) == -1)
     syserr("Adding new control service event.");
 
+  /* Prometheus metrics on localhost, on the same socket after upgrade */
+  metrics_listener = upgrade_socket(UPGRADE_METRICS);
+  if (metrics_port != 0 || metrics_listener != -1) {
+    printf("LOADING: Metrics on http://127.0.0.1:%d/metrics.\n",
+      metrics_port);
+    init_metrics(base, control_base, metrics_port, metrics_listener);
+  }
+
+  /* Counters in shared memory for slicz-stat */
+  if (stats_name != NULL) {
+    printf("LOADING: Statistics in shared memory %s.\n", stats_name);
+    init_stats(stats_name, base);
+  }
+
+  /* Local clients of shm ports */
+  if (local_path != NULL) {
+    printf("LOADING: Local clients on %s.\n", local_path);
+    listen_local_clients(local_path, control_base);
+  }
+
+  /* The old switch stops before this one serves anything */
+  finish_take_over();
+
+  start_snapshots(control_base);
   printf("Waiting for control connections...\n");
-  if (event_base_dispatch(base) == -1)
-    syserr("Control connections.");
+  fflush(stdout);
+  start_data_plane();
+  if (pthread_create(&control_thread, NULL, serve_control, NULL) != 0)
+    syserr("Starting control thread.");
+
+  if (upgrade_path != NULL)
+    listen_upgrades(upgrade_path, control_base);
+
+  /* Forwarding until shutdown!, even without ports */
+  if (event_base_loop(base, EVLOOP_NO_EXIT_ON_EMPTY) == -1)
+    syserr("Forwarding.");
+  if (pthread_join(control_thread, NULL) != 0)
+    syserr("Waiting for control thread.");
   printf("Control connections closed.\n");
  
-  event_free(listener_socket_event); /* ??? */
+  if (listener_socket_event != NULL)    /* not freed by shutdown! */
+    event_free(listener_socket_event);
+  clean_metrics();
+  clean_stats();
+  clean_resolver();
+  clean_planes();
+  event_base_free(control_base);
   event_base_free(base); 
 
   clean_ports();
@@ -0,0 +1,357 @@
+/*
+ * Author: Konrad Słoniewski
+ * Date:   18 August 2013
+ */
+
+#include "snapshot.h"
+
+/* Attributes */
+
+static const char* snapshot_path = NULL;
+static void* image = NULL;               /* snapshot being restored */
+static size_t image_size;
+static int image_mapped;                 /* image is a mapped file */
+static struct event* snapshot_event = NULL;
+
+
+/* Functions */
+
+static void release_image() {
+  if (image != NULL && image_mapped)
+    munmap(image, image_size);
+  else
+    free(image);
+  image = NULL;
+}
+
+
+/* Fletcher-like sums of 32-bit words, records are whole words */
+static uint32_t checksum(const void* data, size_t size) {
+  const uint32_t* word = (const uint32_t*) data;
+  uint64_t sum1 = 0, sum2 = 0;
+  size_t i;
+
+  for (i = 0; i < size / 4; i += 1) {
+    sum1 += word[i];
+    sum2 += sum1;
+  }
+  return (uint32_t) (sum1 ^ (sum1 >> 32) ^ (sum2 << 7) ^ (sum2 >> 25));
+}
+
+
+/* Records of a mapped snapshot */
+static struct snapshot_port* snapshot_ports(struct snapshot_header* header) {
+  return (struct snapshot_port*) (header + 1);
+}
+
+
+static struct snapshot_mac* snapshot_macs(struct snapshot_header* header) {
+  return (struct snapshot_mac*) (snapshot_ports(header) + header->ports);
+}
+
+
+/* Snapshot was written by this version and is complete */
+static int valid_snapshot(struct snapshot_header* header, size_t size) {
+  size_t records;
+
+  if (size < sizeof(*header) ||
+      memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) ||
+      header->version != SNAPSHOT_VERSION ||
+      header->port_size != sizeof(struct snapshot_port) ||
+      header->mac_size != sizeof(struct snapshot_mac) ||
+      header->ports > MAX_SOCKETS || header->macs > MAC_MAX_CAP)
+    return 0;
+
+  records = header->ports * sizeof(struct snapshot_port) +
+    header->macs * sizeof(struct snapshot_mac);
+  return size == sizeof(*header) + records &&
+    header->checksum == checksum(header + 1, records);
+}
+
+
+/* Record of a port, -1 if it cannot be configured */
+static int read_record(const struct snapshot_port* record, port_t* port) {
+  if (record->number == 0 || record->untagged_vlan < -1 ||
+      record->untagged_vlan >= MAX_VLANS || record->default_pcp > 7)
+    return -1;
+
+  init_port(port, record->number);
+  if (record->status == ACTIVE)
+    activate_port(port, record->sender_addr, record->sender_port);
+  port->untagged_vlan = record->untagged_vlan;
+  memcpy(port->vlans, record->vlans, sizeof(port->vlans));
+  return port_removed(port) ? -1 : 0;
+}
+
+
+/* Stages ports of a snapshot image that are not configured in the
+ * transaction yet. The image is kept for restore_snapshot() */
+static int stage_snapshot(struct transaction* tx) {
+  struct snapshot_header* header = (struct snapshot_header*) image;
+  struct snapshot_port* records;
+  uint8_t* staged;
+  port_t port;
+  int i;
+
+  /* Ports given at startup take precedence */
+  staged = calloc(MAX_PORT_NUMBER + 1, 1);
+  if (staged == NULL)
+    syserr("Reading snapshot.");
+  for (i = 0; i < tx->count; i += 1)
+    staged[tx->ports[i].number] = 1;
+
+  records = snapshot_ports(header);
+  for (i = 0; i < header->ports; i += 1) {
+    if (staged[records[i].number])
+      continue;
+    if (read_record(&records[i], &port) == -1) {
+      fprintf(stderr, "Skipping port %d of snapshot.\n", records[i].number);
+      continue;
+    }
+    stage_entry(tx, &port);
+  }
+
+  free(staged);
+  return 0;
+}
+
+
+/* Snapshots are saved to path, NULL if they are not */
+void init_snapshot(const char* path) {
+  snapshot_path = path;
+}
+
+
+/* Maps the snapshot file and stages its ports. Returns 0, or -1 if there
+ * is no valid snapshot */
+int read_snapshot(struct transaction* tx) {
+  struct stat info;
+  int fd;
+
+  if (snapshot_path == NULL)
+    return -1;
+  fd = open(snapshot_path, O_RDONLY);
+  if (fd == -1) {
+    fprintf(stderr, "No snapshot %s (%s).\n", snapshot_path,
+      strerror(errno));
+    return -1;
+  }
+  if (fstat(fd, &info) == -1 || info.st_size == 0) {
+    close(fd);
+    fprintf(stderr, "Snapshot %s is empty.\n", snapshot_path);
+    return -1;
+  }
+  image_size = info.st_size;
+  image = mmap(NULL, image_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE,
+    fd, 0);
+  close(fd);
+  if (image == MAP_FAILED)
+    syserr("Mapping snapshot.");
+  image_mapped = 1;
+
+  if (!valid_snapshot((struct snapshot_header*) image, image_size)) {
+    fprintf(stderr, "Snapshot %s is damaged or of another version.\n",
+      snapshot_path);
+    release_image();
+    return -1;
+  }
+  return stage_snapshot(tx);
+}
+
+
+/* Stages ports of a snapshot image in memory, made by build_snapshot().
+ * The image is freed later. Returns 0, or -1 if it is not valid */
+int load_snapshot(void* data, size_t size, struct transaction* tx) {
+  image = data;
+  image_size = size;
+  image_mapped = 0;
+  if (!valid_snapshot((struct snapshot_header*) image, image_size)) {
+    fprintf(stderr, "Handed over state is damaged or of another version.\n");
+    release_image();
+    return -1;
+  }
+  return stage_snapshot(tx);
+}
+
+
+/* Priorities and MAC table of the read snapshot, once its ports are
+ * committed and before forwarding starts. MACs of ports that are gone and
+ * MAC tables saved more than SNAPSHOT_MAC_AGING ago are not restored */
+void restore_snapshot() {
+  struct snapshot_header* header = (struct snapshot_header*) image;
+  struct snapshot_port* records;
+  struct snapshot_mac* macs;
+  struct ether_addr mac;
+  port_t* port;
+  long long age;
+  int i, restored = 0;
+
+  if (image == NULL)
+    return;
+
+  records = snapshot_ports(header);
+  for (i = 0; i < header->ports; i += 1) {
+    port = get_port(records[i].number);
+    if (port != NULL && records[i].default_pcp <= 7)
+      port->default_pcp = records[i].default_pcp;
+  }
+
+  age = (long long) time(NULL) - (long long) header->written;
+  if (age < 0)
+    age = 0;
+  if (age > SNAPSHOT_MAC_AGING) {
+    fprintf(stderr, "Snapshot is %lld s old, MAC table is not restored.\n",
+      age);
+  } else {
+    /* Records are in the order of changes, later ones win */
+    macs = snapshot_macs(header);
+    for (i = 0; i < header->macs; i += 1) {
+      port = get_port(macs[i].port);
+      if (port == NULL || macs[i].vlan >= MAX_VLANS ||
+          !valid_vlan(port, macs[i].vlan))
+        continue;
+      memcpy(mac.ether_addr_octet, macs[i].mac, ETHER_ADDR_LEN);
+      if (load_mac(mac, macs[i].vlan, macs[i].port, macs[i].is_tagged) == 0)
+        restored += 1;
+    }
+  }
+  fprintf(stderr, "Restored %d ports and %d MACs.\n", header->ports,
+    restored);
+
+  release_image();
+}
+
+
+/* Image of configuration and MAC table, on control thread. MACs are
+ * copied in pages, so forwarding waits only for short copies. Returns
+ * malloc'ed image */
+void* build_snapshot(size_t* size) {
+  struct snapshot_header* header;
+  struct snapshot_port* records;
+  struct snapshot_mac* macs;
+  struct mac_query query;
+  port_t* port;
+  unsigned long sender_addr;
+  int count = 0, i, status, sender_port;
+
+  /* Ports change only on forwarding thread, when this one waits or, for
+   * a client of a port, under its client_seq. Ports of
+   * local transports are not saved, their clients attach anew */
+  for (port = get_head(); port != NULL; port = port->next)
+    if (port->type == PORT_UDP)
+      count += 1;
+  header = calloc(1, sizeof(*header) + count * sizeof(*records) +
+    MAC_MAX_CAP * sizeof(*macs));
+  query.result = malloc(SNAPSHOT_PAGE * sizeof(mac_t));
+  if (header == NULL || query.result == NULL)
+    syserr("Saving snapshot.");
+  records = snapshot_ports(header);
+  macs = (struct snapshot_mac*) (records + count);
+
+  for (port = get_head(), i = 0; port != NULL; port = port->next) {
+    if (port->type != PORT_UDP)
+      continue;
+    port_client(port, &status, &sender_addr, &sender_port);
+    records[i].number = port->number;
+    records[i].sender_addr = sender_addr;
+    records[i].sender_port = sender_port;
+    records[i].untagged_vlan = port->untagged_vlan;
+    records[i].status = status;
+    records[i].default_pcp = port->default_pcp;
+    memcpy(records[i].vlans, port->vlans, sizeof(records[i].vlans));
+    i += 1;
+  }
+
+  query.vlan = -1;
+  query.port = -1;
+  query.cursor = 0;
+  query.limit = SNAPSHOT_PAGE;
+  do {
+    data_plane_call(query_macs, &query);
+    for (i = 0; i < query.count && header->macs < MAC_MAX_CAP; i += 1) {
+      memcpy(macs[header->macs].mac, query.result[i].mac.ether_addr_octet,
+        ETHER_ADDR_LEN);
+      macs[header->macs].vlan = query.result[i].vlan;
+      macs[header->macs].port = query.result[i].port;
+      macs[header->macs].is_tagged = query.result[i].is_tagged;
+      header->macs += 1;
+    }
+  } while (query.cursor != 0 && header->macs < MAC_MAX_CAP);
+  free(query.result);
+
+  memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic));
+  header->version = SNAPSHOT_VERSION;
+  header->written = time(NULL);
+  header->ports = count;
+  header->port_size = sizeof(struct snapshot_port);
+  header->mac_size = sizeof(struct snapshot_mac);
+  *size = count * sizeof(*records) + header->macs * sizeof(*macs);
+  header->checksum = checksum(header + 1, *size);
+  *size += sizeof(*header);
+  return header;
+}
+
+
+/* Writes a new snapshot file that replaces the old one. Returns 0, or -1
+ * if it cannot be written */
+int save_snapshot() {
+  void* data;
+  char* temporary;
+  FILE* file;
+  size_t size;
+  int result = 0;
+
+  if (snapshot_path == NULL)
+    return 0;
+  data = build_snapshot(&size);
+
+  /* Renamed into place, a crash never leaves half a snapshot */
+  if (asprintf(&temporary, "%s.new", snapshot_path) == -1)
+    syserr("Saving snapshot.");
+  file = fopen(temporary, "w");
+  if (file == NULL ||
+      fwrite(data, size, 1, file) != 1 ||
+      fflush(file) != 0 || fsync(fileno(file)) == -1) {
+    fprintf(stderr, "Writing snapshot %s (%s).\n", temporary,
+      strerror(errno));
+    result = -1;
+  }
+  if (file != NULL && fclose(file) != 0)
+    result = -1;
+  if (result == 0 && rename(temporary, snapshot_path) == -1) {
+    fprintf(stderr, "Replacing snapshot %s (%s).\n", snapshot_path,
+      strerror(errno));
+    result = -1;
+  }
+  if (result == -1)
+    unlink(temporary);
+
+  free(temporary);
+  free(data);
+  return result;
+}
+
+
+static void snapshot_timer(evutil_socket_t sock, short ev, void* arg) {
+  save_snapshot();
+}
+
+
+/* Saves snapshots periodically on base, the control thread */
+void start_snapshots(struct event_base* base) {
+  struct timeval period = { SNAPSHOT_PERIOD_SEC, 0 };
+
+  if (snapshot_path == NULL)
+    return;
+  snapshot_event = event_new(base, -1, EV_PERSIST, snapshot_timer, NULL);
+  if (snapshot_event == NULL || event_add(snapshot_event, &period) == -1)
+    syserr("Adding snapshot event.");
+}
+
+
+/* No more periodic snapshots */
+void stop_snapshots() {
+  if (snapshot_event != NULL)
+    event_free(snapshot_event);
+  snapshot_event = NULL;
+}
@@ -0,0 +1,76 @@
+/*
+ * Author: Konrad Słoniewski
+ * Date:   18 August 2013
+ */
+
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+
+#include <errno.h>
+#include <event2/event.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ports.h"
+#include "macs.h"
+#include "config.h"
+#include "planes.h"
+#include "err.h"
+
+/* Definitions */
+#define SNAPSHOT_MAGIC "SLICZSNP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_PERIOD_SEC 30     /* how often the switch is saved */
+#define SNAPSHOT_MAC_AGING 300     /* older MAC table is not restored, s */
+#define SNAPSHOT_PAGE 4096         /* MACs copied from forwarding at once */
+
+/* Structures */
+
+/* Snapshot file is the header, port records and MAC records, in the byte
+ * order of the host. The checksum covers the records */
+struct snapshot_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t checksum;
+  uint64_t written;          /* wall clock, seconds */
+  uint32_t ports;            /* number of records */
+  uint32_t macs;
+  uint32_t port_size;        /* size of a record */
+  uint32_t mac_size;
+};
+
+struct snapshot_port {
+  uint32_t sender_addr;      /* network byte order */
+  uint16_t number;
+  uint16_t sender_port;
+  int16_t untagged_vlan;     /* -1 if none */
+  uint8_t status;            /* ACTIVE or INACTIVE */
+  uint8_t default_pcp;
+  uint8_t vlans[MAX_VLANS / 8];
+};
+
+struct snapshot_mac {
+  uint8_t mac[ETHER_ADDR_LEN];
+  uint16_t vlan;
+  uint16_t port;
+  uint16_t is_tagged;
+};
+
+/* Functions */
+void init_snapshot(const char* path);
+int read_snapshot(struct transaction* tx);
+int load_snapshot(void* data, size_t size, struct transaction* tx);
+void restore_snapshot();
+void* build_snapshot(size_t* size);
+void start_snapshots(struct event_base* base);
+int save_snapshot();
+void stop_snapshots();
+
+#endif
@@ -0,0 +1,174 @@
+/*
+ * Author: Konrad Słoniewski
+ * Date:   18 August 2013
+ */
+
+#include "stats.h"
+#include "ports.h"
+#include "macs.h"
+#include "framebuf.h"
+#include "err.h"
+
+#if STATS_PORTS != MAX_SOCKETS
+#error "STATS_PORTS must be MAX_SOCKETS"
+#endif
+
+/* Global variables */
+static struct stats_region* region = NULL;
+static const char* region_name = NULL;
+static ino_t region_inode;                /* tells own region from newer */
+static struct event* publisher = NULL;
+static struct timespec publish_expected;  /* when the timer should run */
+static int published[MAX_SOCKETS];        /* socket indexes of used slots */
+static int published_count = 0;
+static uint64_t published_tick[MAX_SOCKETS]; /* last update of a slot */
+
+
+/* Functions */
+
+/* Nanoseconds of a monotonic time */
+static uint64_t to_ns(const struct timespec* time) {
+  return (uint64_t) time->tv_sec * 1000000000ULL + time->tv_nsec;
+}
+
+
+/* Timer handler, copies counters of the forwarding thread to the region.
+ * Only plain stores between the two seq increments. Slots of ports are
+ * written, and cleared once their socket is gone; ports change only on
+ * this thread */
+static void publish_stats(evutil_socket_t sock, short ev, void* arg) {
+  struct timespec now;
+  struct stats_port* slot;
+  port_t* port;
+  uint64_t lag, tick;
+  int i, count = 0, index;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  lag = (to_ns(&now) > to_ns(&publish_expected)) ?
+    to_ns(&now) - to_ns(&publish_expected) : 0;
+  publish_expected = now;
+  publish_expected.tv_nsec += STATS_PERIOD_MSEC * 1000000L;
+  if (publish_expected.tv_nsec >= 1000000000L) {
+    publish_expected.tv_sec += 1;
+    publish_expected.tv_nsec -= 1000000000L;
+  }
+
+  region->seq += 1;
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  region->updated_ns = to_ns(&now);
+  region->mac_entries = mac_table_size();
+  region->mac_learned = mac_table_learned();
+  region->mac_evicted = mac_table_evicted();
+  region->frame_pool_free = frame_pool_available();
+  region->loop_ticks += 1;
+  region->loop_lag_ns = lag;
+  if (lag > region->loop_lag_max_ns)
+    region->loop_lag_max_ns = lag;
+  region->loop_lag_sum_ns += lag;
+  tick = region->loop_ticks;
+
+  for (port = get_head(); port != NULL; port = port->next) {
+    i = port->index;
+    if (i == -1)
+      continue;
+    slot = &region->port[i];
+    if (slot->number == 0)
+      published[published_count++] = i;
+    slot->number = port->number;
+    slot->rx_frames = (unsigned) udp_recv[i];
+    slot->tx_frames = (unsigned) udp_sent[i];
+    slot->rx_bytes = udp_recv_bytes[i];
+    slot->tx_bytes = udp_sent_bytes[i];
+    slot->errors = (unsigned) udp_errs[i];
+    slot->egress_drops = tx_drops[i];
+    slot->flooded = udp_flood[i];
+    published_tick[i] = tick;
+  }
+
+  /* Keeps slots still used, clears the rest */
+  for (i = 0; i < published_count; i += 1) {
+    index = published[i];
+    if (published_tick[index] == tick)
+      published[count++] = index;
+    else
+      memset(&region->port[index], 0, sizeof(region->port[index]));
+  }
+  published_count = count;
+  region->ports = count;
+
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  region->seq += 1;
+}
+
+
+/* Creates shared memory region of the name and its publishing timer on
+ * the forwarding base. A region left by a previous switch, which may
+ * still write it during an upgrade, is replaced by a new one */
+void init_stats(const char* name, struct event_base* base) {
+  struct timeval period = { 0, STATS_PERIOD_MSEC * 1000 };
+  struct stat info;
+  int fd;
+
+  if (shm_unlink(name) == -1 && errno != ENOENT)
+    syserr("Removing old statistics region %s.", name);
+  fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+  if (fd == -1)
+    syserr("Opening statistics region %s.", name);
+  if (ftruncate(fd, sizeof(struct stats_region)) == -1 ||
+      fstat(fd, &info) == -1)
+    syserr("Sizing statistics region.");
+  region = mmap(NULL, sizeof(struct stats_region), PROT_READ | PROT_WRITE,
+    MAP_SHARED, fd, 0);
+  if (region == MAP_FAILED)
+    syserr("Mapping statistics region.");
+  close(fd);
+  region_name = name;
+  region_inode = info.st_ino;
+
+  /* The region is zeroed, readers wait until the header is written */
+  region->seq = 1;
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  region->magic = STATS_MAGIC;
+  region->version = STATS_VERSION;
+  region->size = sizeof(struct stats_region);
+  region->pid = getpid();
+  region->mac_capacity = MAC_MAX_CAP;
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  region->seq += 1;
+
+  publisher = event_new(base, -1, EV_PERSIST, publish_stats, NULL);
+  if (!publisher)
+    syserr("Creating statistics timer.");
+  clock_gettime(CLOCK_MONOTONIC, &publish_expected);
+  if (event_add(publisher, &period) == -1)
+    syserr("Adding statistics timer.");
+  publish_expected.tv_nsec += STATS_PERIOD_MSEC * 1000000L;
+  if (publish_expected.tv_nsec >= 1000000000L) {
+    publish_expected.tv_sec += 1;
+    publish_expected.tv_nsec -= 1000000000L;
+  }
+}
+
+
+/* Stops publishing; the region is removed unless a newer switch has
+ * replaced it under the name */
+void clean_stats() {
+  struct stat info;
+  int fd;
+
+  if (publisher != NULL)
+    event_free(publisher);
+  publisher = NULL;
+  if (region == NULL)
+    return;
+
+  fd = shm_open(region_name, O_RDONLY, 0);
+  if (fd != -1) {
+    if (fstat(fd, &info) == 0 && info.st_ino == region_inode)
+      shm_unlink(region_name);
+    close(fd);
+  }
+  munmap(region, sizeof(struct stats_region));
+  region = NULL;
+}
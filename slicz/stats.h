@@ -0,0 +1,78 @@
+/*
+ * Author: Konrad Słoniewski
+ * Date:   18 August 2013
+ */
+
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <errno.h>
+#include <event2/event.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Counters of slicz in POSIX shared memory (shm_open name given with -S),
+ * read by slicz-stat. The layout below is stable for one STATS_VERSION:
+ * all fields are 64-bit little-endian words of the host, new fields are
+ * only appended with a new version.
+ *
+ * The forwarding thread rewrites the region every STATS_PERIOD_MSEC under
+ * a seqlock: seq is odd while it writes. A reader copies the region while
+ * seq is even and the same before and after the copy. Every switch creates
+ * a new region under the name, so after an upgrade readers open it again
+ * when the name refers to another region; the old one is left to the old
+ * switch. Slots of unused socket indexes are zero. */
+
+/* Definitions */
+#define STATS_MAGIC 0x54535a53       /* "SZST" */
+#define STATS_VERSION 1
+#define STATS_PORTS 8192             /* MAX_SOCKETS, slots by socket index */
+#define STATS_PERIOD_MSEC 10
+#define STATS_DEFAULT_NAME "/slicz"
+
+/* Structures */
+
+/* Counters of one port since it was created */
+struct stats_port {
+  uint64_t number;                   /* UDP port number, 0 if slot unused */
+  uint64_t rx_frames;
+  uint64_t tx_frames;
+  uint64_t rx_bytes;
+  uint64_t tx_bytes;
+  uint64_t errors;                   /* frames dropped on receive */
+  uint64_t egress_drops;             /* full egress queue */
+  uint64_t flooded;                  /* received frames flooded to VLAN */
+};
+
+struct stats_region {
+  uint64_t magic;
+  uint64_t version;
+  uint64_t size;                     /* of the region, bytes */
+  uint64_t pid;                      /* writer, the only one */
+  uint64_t seq;                      /* seqlock */
+  uint64_t updated_ns;               /* CLOCK_MONOTONIC of the update */
+  uint64_t mac_entries;
+  uint64_t mac_capacity;
+  uint64_t mac_learned;
+  uint64_t mac_evicted;
+  uint64_t frame_pool_free;
+  uint64_t loop_ticks;               /* updates so far */
+  uint64_t loop_lag_ns;              /* delay of the last update */
+  uint64_t loop_lag_max_ns;
+  uint64_t loop_lag_sum_ns;
+  uint64_t ports;                    /* configured ports */
+  struct stats_port port[STATS_PORTS];
+};
+
+/* Functions of slicz, the region is written by the forwarding thread */
+void init_stats(const char* name, struct event_base* base);
+void clean_stats();
+
+#endif
@@ -8,13 +8,23 @@
  * Program tworzy wirtualny interfejs sieciowy o nazwie 'siktap',
  * który działa tak, że wszystkie pakiety wysyłane do tego interfejsu
  * są z powrotem przezeń odbierane, jak gdyby podłączona była do niego pętla.
+ *
+ * Jeden proces może obsługiwać wiele par interfejs/port przełącznika
+ * (-i nazwa=host:port lub plik -f). Wszystkie pary dzielą wątki robocze,
+ * a każdy wątek ma jedno gniazdo UDP dla wszystkich interfejsów.
  */
 
+#define _GNU_SOURCE        /* sendmmsg, recvmmsg */
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
 #include <event2/event.h>
 #include <event2/util.h>
 #include <stdio.h>
 #include <string.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
@@ -25,26 +35,287 @@
 #include <net/ethernet.h>
 #include <stdint.h>
 #include <netdb.h>
+#include <sys/uio.h>
 
 #include "err.h"
 #include "ports.h"
+#include "offload.h"
+#include "loadgen.h"
+#include "backend.h"
+#include "shmring.h"
 
 # define BUF_SIZE 1518
+# define BATCH_SIZE 32     /* frames moved per sendmmsg/recvmmsg call */
+# define MAX_QUEUES 16     /* maximum number of TAP queues (and threads) */
+# define MAX_IFACES 1024   /* maximum number of served TAP interfaces */
+# define REPLAY_BURST 256  /* pcap frames sent before other events run */
+# define DROP_REPORT_SEC 10  /* new drops are reported at most this often */
+# define MAX_COMMAND_LEN 256 /* of a control connection line */
+
+/* Counters of a queue are written only by its worker; others read them,
+ * so both sides use relaxed atomic accesses instead of locked adds */
+# define STAT_ADD(field, n) \
+  __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+# define STAT_READ(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+/* Batch of frames together with its sendmmsg/recvmmsg descriptors */
+struct frame_batch {
+  char bufs[BATCH_SIZE][BUF_SIZE + 1];
+  struct iovec iovs[BATCH_SIZE];
+  struct mmsghdr msgs[BATCH_SIZE];
+  struct sockaddr_in addrs[BATCH_SIZE];  /* sources of received frames */
+  struct tap_queue* queues[BATCH_SIZE];  /* owners of frames to send */
+};
+
+/* Per-queue counters, summed over queues when printed */
+struct iface_stats {
+  unsigned long long tx_frames;  /* TAP -> switch */
+  unsigned long long tx_bytes;
+  unsigned long long rx_frames;  /* switch -> TAP */
+  unsigned long long rx_bytes;
+  unsigned long long drops;
+  int last_error;                /* errno of the last failed write */
+};
+
+/* One queue of a TAP interface, owned by one worker */
+struct tap_queue {
+  int fd;                        /* TAP queue descriptor */
+  struct event* ev;
+  struct tap_iface* iface;
+  struct worker* worker;
+  struct iface_stats stats;
+};
+
+/* TAP interface, or other frame backend, connected to one switch port */
+struct tap_iface {
+  char name[PATH_MAX];
+  struct sockaddr_in switch_addr;
+  struct tap_queue queues[MAX_QUEUES];
+  struct frame_backend backend;  /* kind BACKEND_TAP for a TAP */
+  int replay_started;            /* pcap times are relative to the first */
+  uint64_t replay_first_ns;      /* of the capture */
+  uint64_t replay_start_ns;      /* CLOCK_MONOTONIC */
+  struct shm_region* shm;        /* shm port of a local switch, or NULL */
+  int shm_fds[SHM_FDS];
+  struct event* shm_event;       /* frames from the switch */
+  struct event* room_event;      /* room for a waiting replay */
+  int shm_idle;                  /* empty polls in a row */
+  unsigned long long reported_drops;  /* by the last drop report */
+};
+
+/* Worker thread with its own event base and UDP socket, serving one queue
+ * of every interface */
+struct worker {
+  int index;                 /* worker number, also queue number */
+  int sock;                  /* UDP socket to the switch */
+  pthread_t thread;          /* serving thread */
+  struct event_base* base;   /* per-thread event base */
+  struct event* udp_event;
+  struct frame_batch tx;     /* TAP -> switch */
+  int tx_count;              /* frames waiting in tx batch */
+  struct tap_queue* tx_queue; /* queue the next tx frame comes from */
+  char* shm_slot;            /* ring slot of the next tx frame, or NULL */
+  int shm_pushed;            /* frames pushed since the switch was woken */
+  struct frame_batch rx;     /* switch -> TAP */
+  char* super_buf;           /* virtio-net header + GSO superframe */
+};
 
 /* Network data */
-int sock, fd;
-struct sockaddr_in my_address;
+struct worker workers[MAX_QUEUES];
+struct tap_iface* ifaces[MAX_IFACES];
+struct tap_iface* ifaces_by_addr[MAX_IFACES];  /* sorted for demux */
+int iface_count = 0;
+int queue_count = 1;
+int offload = 0;           /* TAP opened with IFF_VNET_HDR */
+int replay_fast = 0;       /* pcap files are sent as fast as possible */
+int backend_count = 0;     /* interfaces that are not TAPs */
+int shm_count = 0;         /* interfaces on shm ports */
+evutil_socket_t control_listener = -1;  /* -c, counters of interfaces */
+
+
+/* Orders interfaces by switch address */
+static int compare_addrs(const struct sockaddr_in* a,
+  const struct sockaddr_in* b) {
+  if (a->sin_addr.s_addr != b->sin_addr.s_addr)
+    return a->sin_addr.s_addr < b->sin_addr.s_addr ? -1 : 1;
+  if (a->sin_port != b->sin_port)
+    return a->sin_port < b->sin_port ? -1 : 1;
+  return 0;
+}
+
+
+static int compare_ifaces(const void* a, const void* b) {
+  return compare_addrs(&(*(struct tap_iface**) a)->switch_addr,
+    &(*(struct tap_iface**) b)->switch_addr);
+}
+
+
+/* Returns interface attached to the switch port with a given address */
+static struct tap_iface* find_iface(const struct sockaddr_in* addr) {
+  int low = 0, high = iface_count - 1, mid, cmp;
+
+  while (low <= high) {
+    mid = (low + high) / 2;
+    cmp = compare_addrs(addr, &ifaces_by_addr[mid]->switch_addr);
+    if (cmp == 0)
+      return ifaces_by_addr[mid];
+    if (cmp < 0)
+      high = mid - 1;
+    else
+      low = mid + 1;
+  }
+
+  return NULL;
+}
+
+
+/* Prepares batch descriptors, received frames remember their source */
+static void init_batch(struct frame_batch* batch, int receive) {
+  int i;
+
+  memset(batch->msgs, 0, sizeof(batch->msgs));
+  for (i = 0; i < BATCH_SIZE; i += 1) {
+    batch->iovs[i].iov_base = batch->bufs[i];
+    batch->iovs[i].iov_len = BUF_SIZE + 1;
+    batch->msgs[i].msg_hdr.msg_iov = &batch->iovs[i];
+    batch->msgs[i].msg_hdr.msg_iovlen = 1;
+    if (receive) {
+      batch->msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+      batch->msgs[i].msg_hdr.msg_namelen = sizeof(batch->addrs[i]);
+    }
+  }
+}
+
+
+/* Sends frames waiting in the tx batch to their switch ports */
+static void flush_batch(struct worker* worker) {
+  int sent, r;
+
+  sent = 0;
+  while (sent < worker->tx_count) {
+    r = sendmmsg(worker->sock, worker->tx.msgs + sent,
+      worker->tx_count - sent, 0);
+    if (r < 0) {
+      /* Socket buffer is full - dropping the rest of the batch */
+      for (; sent < worker->tx_count; sent += 1) {
+        STAT_ADD(worker->tx.queues[sent]->stats.drops, 1);
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS)
+          __atomic_store_n(&worker->tx.queues[sent]->stats.last_error, errno,
+            __ATOMIC_RELAXED);
+      }
+      break;
+    }
+    sent += r;
+  }
+  worker->tx_count = 0;
+}
+
+
+/* Wakes the switch for frames pushed to shm ring of the current queue */
+static void flush_shm(struct worker* worker) {
+  struct tap_iface* iface = worker->tx_queue->iface;
+
+  if (worker->shm_pushed > 0 && ring_wake_consumer(&iface->shm->to_switch))
+    signal_fd(iface->shm_fds[SHM_FD_SWITCH_RX]);
+  worker->shm_pushed = 0;
+}
+
+
+/* Returns buffer for the next outgoing frame, flushing a full batch.
+ * Frames to a shm port are written right into its ring; when the ring is
+ * full, the frame goes to a batch buffer and is dropped */
+static char* tx_slot(void* arg) {
+  struct worker* worker = (struct worker*) arg;
+  struct tap_iface* iface = worker->tx_queue->iface;
+
+  if (iface->shm != NULL) {
+    if (worker->shm_pushed == BATCH_SIZE)
+      flush_shm(worker);
+    worker->shm_slot = ring_slot(&iface->shm->to_switch);
+    if (worker->shm_slot != NULL)
+      return worker->shm_slot;
+  } else if (worker->tx_count == BATCH_SIZE) {
+    flush_batch(worker);
+  }
+  return worker->tx.bufs[worker->tx_count];
+}
+
+
+/* Queues frame stored by the last tx_slot() */
+static void tx_commit(void* arg, int len) {
+  struct worker* worker = (struct worker*) arg;
+  struct tap_queue* queue = worker->tx_queue;
+  int i = worker->tx_count;
+
+  if (queue->iface->shm != NULL) {
+    if (worker->shm_slot == NULL || len > SHM_SLOT_DATA) {
+      STAT_ADD(queue->stats.drops, 1);
+      return;
+    }
+    ring_push(&queue->iface->shm->to_switch, len);
+    worker->shm_pushed += 1;
+    STAT_ADD(queue->stats.tx_frames, 1);
+    STAT_ADD(queue->stats.tx_bytes, len);
+    return;
+  }
+
+  worker->tx.iovs[i].iov_len = len;
+  worker->tx.msgs[i].msg_hdr.msg_name = &queue->iface->switch_addr;
+  worker->tx.msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+  worker->tx.queues[i] = queue;
+  worker->tx_count += 1;
+
+  STAT_ADD(queue->stats.tx_frames, 1);
+  STAT_ADD(queue->stats.tx_bytes, len);
+}
+
+
+/* Writes one frame from the switch to a TAP queue */
+static void tap_write(struct tap_queue* queue, char* frame, int len) {
+  struct virtio_net_hdr vnet_hdr;
+  struct iovec iov[2];
+  int wbytes;
+
+  /* Other backends record frames, or only count them */
+  if (queue->iface->backend.kind != BACKEND_TAP) {
+    if (queue->iface->backend.writer != NULL &&
+        pcap_write(queue->iface->backend.writer, frame, len) == -1) {
+      STAT_ADD(queue->stats.drops, 1);
+      __atomic_store_n(&queue->stats.last_error, EAGAIN, __ATOMIC_RELAXED);
+      return;
+    }
+    STAT_ADD(queue->stats.rx_frames, 1);
+    STAT_ADD(queue->stats.rx_bytes, len);
+    return;
+  }
+
+  if (offload) {
+    /* Frames from the switch are plain, no GSO and no checksum work */
+    memset(&vnet_hdr, 0, sizeof(vnet_hdr));
+    iov[0].iov_base = &vnet_hdr;
+    iov[0].iov_len = sizeof(vnet_hdr);
+    iov[1].iov_base = frame;
+    iov[1].iov_len = len;
+    wbytes = writev(queue->fd, iov, 2);
+  } else {
+    wbytes = write(queue->fd, frame, len);
+  }
+
+  if (wbytes < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      __atomic_store_n(&queue->stats.last_error, errno, __ATOMIC_RELAXED);
+    STAT_ADD(queue->stats.drops, 1);
+  } else {
+    STAT_ADD(queue->stats.rx_frames, 1);
+    STAT_ADD(queue->stats.rx_bytes, len);
+  }
+}
 
-/* Event data */
-struct event_base* base;
-struct event* udp_event;
-struct event* tun_event;
 
 void udp_response(evutil_socket_t socket, short event, void *arg) {
-  struct sockaddr_in switch_address;
-  char buf[BUF_SIZE + 1];
-  int rbytes, wbytes;
-  ssize_t length = sizeof(switch_address);
+  struct worker* worker = (struct worker*) arg;
+  struct tap_iface* iface;
+  int received, i;
 
    /* Każdy odczyt z deskryptora fd zwróci nam jedną ramkę Ethernet, którą
     * system chciałby wysłać przez stworzony interfejs sieciowy. Bufor musi
@@ -59,107 +330,840 @@ void udp_response(evutil_socket_t socket, short event, void *arg) {
     * Poza tym deskryptor fd zachowuje się bardzo podobnie jak inne
     * deskryptory. W szczególności można go użyć w select/poll.
     */
-  rbytes = recvfrom((int) sock, buf, sizeof(buf), 0,
-    (struct sockaddr*)&switch_address, (socklen_t*) &length);
-  if (rbytes < 0) {
-    perror("reading data");
-    return;
-  }
+  do {
+    for (i = 0; i < BATCH_SIZE; i += 1)
+      worker->rx.msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    received = recvmmsg(worker->sock, worker->rx.msgs, BATCH_SIZE,
+      MSG_DONTWAIT, NULL);
+    if (received < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        perror("reading data");
+      return;
+    }
 
-  fprintf(stderr, "%d bytes received via UDP.\n", rbytes);
     /* Format ramek: Ethernet II (także zwany DIX), proszę poszukać, z tym że
      * bez preambuły i sumy kontrolnej (FCF). Można też się przyjrzeć
      * w Wiresharku plikowi example-capture.pcap. Też takie ramki należy
      * przekazywać do serwera po UDP.
+     *
+     * Interfejs docelowy rozpoznajemy po adresie portu przełącznika.
      */
+    for (i = 0; i < received; i += 1) {
+      iface = find_iface(&worker->rx.addrs[i]);
+      if (iface != NULL)
+        tap_write(&iface->queues[worker->index], worker->rx.bufs[i],
+          worker->rx.msgs[i].msg_len);
+    }
+  } while (received == BATCH_SIZE);
 
-  wbytes = write(fd, buf, rbytes);
-  if (wbytes < 0) {
-    perror("writing data");
-    return;
+  /* Readers of pcap streams see frames of every batch at once */
+  if (backend_count > 0)
+    for (i = 0; i < iface_count; i += 1)
+      if (ifaces[i]->backend.writer != NULL &&
+          ifaces[i]->backend.writer->is_stream &&
+          ifaces[i]->backend.writer->dirty)
+        pcap_flush(ifaces[i]->backend.writer);
+}
+
+
+/* Frames of the switch from shm ring, polled again while they come and
+ * waited for on the eventfd afterwards */
+void shm_response(evutil_socket_t fd, short event, void* arg) {
+  struct tap_queue* queue = (struct tap_queue*) arg;
+  struct tap_iface* iface = queue->iface;
+  struct shm_ring* ring = &iface->shm->to_client;
+  char* frame;
+  int len, n;
+
+  for (n = 0; n < BATCH_SIZE && (frame = ring_peek(ring, &len)) != NULL;
+       n += 1) {
+    tap_write(queue, frame, len);
+    ring_pop(ring);
   }
+  if (n > 0 && ring_wake_producer(ring))
+    signal_fd(iface->shm_fds[SHM_FD_SWITCH_TX]);
+  if (ring_keep_polling(ring, &iface->shm_idle, n > 0, fd))
+    event_active(iface->shm_event, EV_READ, 0);
+
+  if (iface->backend.writer != NULL && iface->backend.writer->is_stream &&
+      iface->backend.writer->dirty)
+    pcap_flush(iface->backend.writer);
 }
 
+
+/* Drains TAP queue until EAGAIN, forwarding frames in batches. With
+ * offload a read may return a GSO superframe, which is cut into MTU-sized
+ * segments here, since the switch forwards only regular frames */
 void tun_read(evutil_socket_t socket, short event, void* arg) {
-  char buf[BUF_SIZE + 1];
+  struct tap_queue* queue = (struct tap_queue*) arg;
+  struct worker* worker = queue->worker;
+  struct segment_sink sink = { tx_slot, tx_commit, worker };
+  int hdr_size = sizeof(struct virtio_net_hdr);
   ssize_t rbytes;
-  int sflags = 0;
-  int length = sizeof(struct sockaddr_in);
 
-  rbytes = read(fd, buf, sizeof(buf));
-  if (rbytes < 0) {
-    perror("reading data");
-    return;
+  worker->tx_queue = queue;
+  for (;;) {
+    if (offload)
+      rbytes = read(queue->fd, worker->super_buf, hdr_size + GSO_MAX_FRAME);
+    else
+      rbytes = read(queue->fd, tx_slot(worker), BUF_SIZE + 1);
+
+    if (rbytes < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        perror("reading data");
+      break;
+    }
+
+    if (!offload) {
+      tx_commit(worker, rbytes);
+    } else if (rbytes < hdr_size ||
+               offload_frame((struct virtio_net_hdr*) worker->super_buf,
+                 worker->super_buf + hdr_size, rbytes - hdr_size, BUF_SIZE,
+                 &sink) < 0) {
+      /* Reported with other drops, not per frame */
+      __atomic_store_n(&queue->stats.last_error, EOPNOTSUPP,
+        __ATOMIC_RELAXED);
+      STAT_ADD(queue->stats.drops, 1);
+    }
   }
 
-  fprintf(stderr, "Forwarded: %d bytes\n", 
-          (int) sendto(sock, buf, rbytes, sflags, 
-                       (struct sockaddr*) &my_address, length));
+  /* Nothing is held back in the batch between wakeups */
+  if (worker->tx_count > 0)
+    flush_batch(worker);
+  flush_shm(worker);
 }
 
-int main(int argc, char** argv)
-{
-  /* Default settings */
-  struct ifreq ifr;
-  int fd, err;
 
-  /* Interface name */
-  char* interface_name = "siktap";
+static uint64_t monotonic_ns() {
+  struct timespec now;
 
-  /* Switch data */
-  char** switch_data;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
 
-  /* Network connection data */
-  struct addrinfo addr_hints;
-  struct addrinfo* addr_result;
-  struct sockaddr_in server_addr;
 
-  /* Reading parameters from input */
-  char c;
-  fprintf(stderr, "Przed wczytywaniem parametrow\n");
-  while ((c = getopt(argc, argv, "d:")) != -1) {
-    switch (c) {
-      case 'd':
-        interface_name = optarg;
+/* Sends frames of a pcap file or stream to the switch. Files are not
+ * polled: the timer is set for the next frame at recorded speed, or
+ * right away after a burst of frames with -x */
+void backend_read(evutil_socket_t socket, short event, void* arg) {
+  struct tap_queue* queue = (struct tap_queue*) arg;
+  struct tap_iface* iface = queue->iface;
+  struct pcap_reader* reader = iface->backend.reader;
+  struct worker* worker = queue->worker;
+  struct timeval delay;
+  uint64_t time_ns, now, due;
+  char* frame;
+  int len, count;
+
+  worker->tx_queue = queue;
+  now = monotonic_ns();
+  for (count = 0; pcap_peek(reader, &frame, &len, &time_ns); count += 1) {
+    /* Replay to a full shm ring goes on when the switch makes room */
+    if (reader->is_file && iface->shm != NULL &&
+        ring_slot(&iface->shm->to_switch) == NULL) {
+      flush_shm(worker);
+      clear_fd(iface->shm_fds[SHM_FD_CLIENT_TX]);
+      if (ring_wait_room(&iface->shm->to_switch)) {
+        event_add(iface->room_event, NULL);
         break;
-      default:
-        abort();
+      }
+    }
+
+    if (reader->is_file && count == REPLAY_BURST) {
+      delay.tv_sec = 0;
+      delay.tv_usec = 0;
+      evtimer_add(queue->ev, &delay);
+      break;
+    }
+
+    if (reader->is_file && !replay_fast) {
+      if (!iface->replay_started) {
+        iface->replay_started = 1;
+        iface->replay_first_ns = time_ns;
+        iface->replay_start_ns = now;
+      }
+      due = iface->replay_start_ns;
+      if (time_ns > iface->replay_first_ns)
+        due += time_ns - iface->replay_first_ns;
+      if (due > now) {
+        delay.tv_sec = (due - now) / 1000000000ULL;
+        delay.tv_usec = (due - now) % 1000000000ULL / 1000;
+        evtimer_add(queue->ev, &delay);
+        break;
+      }
+    }
+
+    if (len > BUF_SIZE) {
+      STAT_ADD(queue->stats.drops, 1);
+    } else {
+      memcpy(tx_slot(worker), frame, len);
+      tx_commit(worker, len);
     }
+    pcap_consume(reader);
   }
 
-  /* Reading switch parameters from arguments */
-  switch_data = split(argv[optind], ":", 2);
-  fprintf(stderr, "Switch address is %s:%s\n", switch_data[0], switch_data[1]);
+  if (worker->tx_count > 0)
+    flush_batch(worker);
+  flush_shm(worker);
 
-  fprintf(stderr, "Przed otwieraniem deskryptora tun\n");
-  if ((fd = open("/dev/net/tun", O_RDWR)) < 0) {
-    perror("open(/dev/net/tun)");
-    return 1;
+  if (reader->eof && !pcap_peek(reader, &frame, &len, &time_ns)) {
+    fprintf(stderr, "%s: end of input after %llu frames.\n", iface->name,
+      reader->frames);
+    event_del(queue->ev);
   }
+}
+
+
+/* Opens one queue of the TAP interface, returns its descriptor */
+static int open_tap(const char* interface_name, int multi_queue) {
+  struct ifreq ifr;
+  int fd, hdr_size;
+
+  if ((fd = open("/dev/net/tun", O_RDWR)) < 0)
+    syserr("open(/dev/net/tun)");
 
   /* Po otwarciu urządzenia /dev/net/tun należy na otrzymanym deskryptorze
    * wykonać ioctl TUNSETIFF. W szczególności trzeba podać rodzaj interfejsu
-   * (my chcemy TAP; szczegóły: 
+   * (my chcemy TAP; szczegóły:
    *   https://www.kernel.org/doc/Documentation/networking/tuntap.txt).
    * Można też ustalić nazwę, jak poniżej.
    */
 
   memset(&ifr, 0, sizeof(ifr));
-  strncpy(ifr.ifr_name, interface_name, IFNAMSIZ);
+  strncpy(ifr.ifr_name, interface_name, IFNAMSIZ - 1);
 
   /* Ustawiamy następujące flagi:
    *  IFF_TAP   - urządzenie typu TAP, tzn. warstwa 2; wysyłane i odbierane
    *              będą ramki Ethernet
    *  IFF_NO_PI - nie dodawaj dodatkowych nagłówków (bez tego jest jeszcze
    *              czterobajtowy nagłówek dodawany przez kernel)
+   *  IFF_MULTI_QUEUE - każde kolejne otwarcie tej samej nazwy dodaje kolejkę;
+   *              kernel rozdziela ruch między kolejki według przepływów
    */
-  fprintf(stderr, "Przed ioctl\n");
   ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
-  if ((err = ioctl(fd, TUNSETIFF, (void *) &ifr)) < 0) {
-    perror("ioctl(TUNSETIFF)");
-    return 1;
+  if (multi_queue)
+    ifr.ifr_flags |= IFF_MULTI_QUEUE;
+  if (offload)
+    ifr.ifr_flags |= IFF_VNET_HDR;
+  if (ioctl(fd, TUNSETIFF, (void *) &ifr) < 0)
+    syserr("ioctl(TUNSETIFF) on %s", interface_name);
+
+  /* Z IFF_VNET_HDR każda ramka poprzedzona jest nagłówkiem virtio-net.
+   * TUNSETOFFLOAD pozwala stosowi sieciowemu oddawać nam ramki bez sum
+   * kontrolnych i niepodzielone segmenty TCP (do 64 KB) - dzielimy je sami.
+   */
+  if (offload) {
+    hdr_size = sizeof(struct virtio_net_hdr);
+    if (ioctl(fd, TUNSETVNETHDRSZ, &hdr_size) < 0)
+      syserr("ioctl(TUNSETVNETHDRSZ)");
+    if (ioctl(fd, TUNSETOFFLOAD, TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6) < 0)
+      syserr("ioctl(TUNSETOFFLOAD)");
+  }
+
+  if (evutil_make_socket_nonblocking(fd))
+    syserr("Making TAP descriptor nonblocking.");
+
+  return fd;
+}
+
+
+/* Resolves <host>:<port> of a switch port */
+static void resolve_switch(const char* spec, struct sockaddr_in* addr) {
+  struct addrinfo addr_hints;
+  struct addrinfo* addr_result;
+  char** switch_data;
+
+  if (count_occurrences(spec, ':') != 1)
+    fatal("Wrong switch address %s, expected <host>:<port>.", spec);
+  switch_data = split(spec, ":", 2);
+
+  (void) memset(&addr_hints, 0, sizeof(struct addrinfo));
+  addr_hints.ai_family = AF_INET;
+  addr_hints.ai_socktype = SOCK_DGRAM;
+  addr_hints.ai_protocol = IPPROTO_UDP;
+  addr_hints.ai_flags = 0;
+  addr_hints.ai_addrlen = 0;
+  addr_hints.ai_addr = NULL;
+  addr_hints.ai_canonname = NULL;
+  addr_hints.ai_next = NULL;
+  if (getaddrinfo(switch_data[0], NULL, &addr_hints, &addr_result) != 0)
+    fatal("Cannot resolve switch address %s.", switch_data[0]);
+
+  memset(addr, 0, sizeof(*addr));
+  addr->sin_family = AF_INET;
+  addr->sin_addr.s_addr =
+    ((struct sockaddr_in*)(addr_result->ai_addr))->sin_addr.s_addr;
+  addr->sin_port = htons(atoi(switch_data[1]));
+
+  freeaddrinfo(addr_result);
+  free_array(switch_data, 2);
+}
+
+
+/* Attaches interface to a port of a local switch, spec is
+ * <unix socket path>:<port> */
+static void attach_shm(struct tap_iface* iface, const char* spec) {
+  const char* colon;
+  char path[PATH_MAX];
+  int port;
+
+  colon = strrchr(spec, ':');
+  if (colon == NULL || colon == spec || colon - spec >= PATH_MAX ||
+      (port = atoi(colon + 1)) <= 0 || port > 65535)
+    fatal("Wrong shm port %s, expected shm:<path>:<port>.", spec);
+  memcpy(path, spec, colon - spec);
+  path[colon - spec] = '\0';
+
+  iface->shm = attach_region(path, port, iface->shm_fds);
+  /* Interfaces on shm ports are told apart by port number */
+  memset(&iface->switch_addr, 0, sizeof(iface->switch_addr));
+  iface->switch_addr.sin_family = AF_INET;
+  iface->switch_addr.sin_port = htons(port);
+  shm_count += 1;
+}
+
+
+/* Registers interface served by this process */
+static void add_iface(const char* name, const char* switch_spec) {
+  struct tap_iface* iface;
+
+  if (iface_count >= MAX_IFACES)
+    fatal("Too many interfaces, at most %d supported.", MAX_IFACES);
+  if (strlen(name) == 0 || strlen(name) >= PATH_MAX ||
+      (backend_kind(name) == BACKEND_TAP && strlen(name) >= IFNAMSIZ))
+    fatal("Wrong interface name %s.", name);
+
+  iface = calloc(1, sizeof(struct tap_iface));
+  if (!iface)
+    fatal("Allocating interface.");
+  strcpy(iface->name, name);
+  iface->backend.kind = backend_kind(name);
+  if (iface->backend.kind != BACKEND_TAP)
+    backend_count += 1;
+  if (!strncmp(switch_spec, "shm:", 4))
+    attach_shm(iface, switch_spec + 4);
+  else
+    resolve_switch(switch_spec, &iface->switch_addr);
+  fprintf(stderr, "Interface %s -> switch %s\n", name, switch_spec);
+
+  ifaces[iface_count] = iface;
+  iface_count += 1;
+}
+
+
+/* Parses <interface>=<host>:<port> */
+static void add_iface_spec(const char* spec) {
+  char** data;
+
+  if (count_occurrences(spec, '=') != 1)
+    fatal("Wrong interface %s, expected <interface>=<host>:<port>.", spec);
+  data = split(spec, "=", 2);
+  add_iface(data[0], data[1]);
+  free_array(data, 2);
+}
+
+
+/* Reads "<interface> <host>:<port>" lines, '#' starts a comment */
+static void read_config(const char* path) {
+  FILE* file;
+  char line[512];
+  char name[300], switch_spec[300];
+  int line_number = 0;
+
+  file = fopen(path, "r");
+  if (!file)
+    syserr("Opening config %s", path);
+
+  while (fgets(line, sizeof(line), file) != NULL) {
+    line_number += 1;
+    line[strcspn(line, "#\n")] = '\0';
+    if (strspn(line, " \t") == strlen(line))
+      continue;
+    if (sscanf(line, "%299s %299s", name, switch_spec) != 2)
+      fatal("%s:%d: expected <interface> <host>:<port>.", path, line_number);
+    add_iface(name, switch_spec);
+  }
+
+  fclose(file);
+}
+
+
+/* Creates UDP socket of a worker; all workers share one local port so that
+ * every switch port sees a single client address */
+static void init_worker_socket(struct worker* worker,
+  struct sockaddr_in* local_addr) {
+  socklen_t length = sizeof(*local_addr);
+  int one = 1;
+
+  worker->sock = socket(PF_INET, SOCK_DGRAM, 0);
+  if (worker->sock < 0)
+    syserr("socket");
+  if (setsockopt(worker->sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)))
+    syserr("setsockopt(SO_REUSEPORT)");
+  if (evutil_make_socket_nonblocking(worker->sock))
+    syserr("Making socket nonblocking.");
+  if (bind(worker->sock, (struct sockaddr*) local_addr, sizeof(*local_addr)))
+    syserr("bind");
+
+  /* First worker picks the port, the rest reuse it */
+  if (getsockname(worker->sock, (struct sockaddr*) local_addr, &length))
+    syserr("getsockname");
+}
+
+
+/* Worker thread main loop */
+static void* worker_loop(void* arg) {
+  struct worker* worker = (struct worker*) arg;
+
+  if (event_base_dispatch(worker->base) == -1)
+    syserr("Error running slijent dispatch loop.");
+
+  return NULL;
+}
+
+
+/* Counters of an interface summed over its queues, written meanwhile by
+ * the workers. Returns errno of the last failed write of any queue */
+static int sum_stats(struct tap_iface* iface, struct iface_stats* sum) {
+  int q, error = 0;
+
+  memset(sum, 0, sizeof(*sum));
+  for (q = 0; q < queue_count; q += 1) {
+    sum->tx_frames += STAT_READ(iface->queues[q].stats.tx_frames);
+    sum->tx_bytes += STAT_READ(iface->queues[q].stats.tx_bytes);
+    sum->rx_frames += STAT_READ(iface->queues[q].stats.rx_frames);
+    sum->rx_bytes += STAT_READ(iface->queues[q].stats.rx_bytes);
+    sum->drops += STAT_READ(iface->queues[q].stats.drops);
+    if (STAT_READ(iface->queues[q].stats.last_error) != 0)
+      error = STAT_READ(iface->queues[q].stats.last_error);
+  }
+  return error;
+}
+
+
+/* Prints counters of every interface on SIGUSR1 */
+static void print_stats(evutil_socket_t sig, short ev, void* arg) {
+  struct iface_stats sum;
+  int i;
+
+  for (i = 0; i < iface_count; i += 1) {
+    sum_stats(ifaces[i], &sum);
+    fprintf(stderr, "%s: sent:%llu/%lluB recvd:%llu/%lluB drops:%llu\n",
+      ifaces[i]->name, sum.tx_frames, sum.tx_bytes, sum.rx_frames,
+      sum.rx_bytes, sum.drops);
+  }
+}
+
+
+/* Reports interfaces that dropped frames since the last report, once every
+ * DROP_REPORT_SEC, instead of a line per frame on the data path */
+static void report_drops(evutil_socket_t sock, short ev, void* arg) {
+  struct iface_stats sum;
+  int i, error;
+
+  for (i = 0; i < iface_count; i += 1) {
+    error = sum_stats(ifaces[i], &sum);
+    if (sum.drops == ifaces[i]->reported_drops)
+      continue;
+    fprintf(stderr, "%s: %llu frames dropped in %d s%s%s.\n",
+      ifaces[i]->name, sum.drops - ifaces[i]->reported_drops,
+      DROP_REPORT_SEC, error != 0 ? ", last error: " : "",
+      error != 0 ? strerror(error) : "");
+    ifaces[i]->reported_drops = sum.drops;
+  }
+}
+
+
+/* Answers one line of a control connection */
+static void run_command(struct evbuffer* out, const char* line) {
+  struct iface_stats sum;
+  int i;
+
+  if (strcmp(line, "counters") != 0) {
+    evbuffer_add_printf(out, "ERR: Unknown command\n");
+    return;
+  }
+  for (i = 0; i < iface_count; i += 1) {
+    sum_stats(ifaces[i], &sum);
+    evbuffer_add_printf(out,
+      "%s: sent:%llu/%lluB recvd:%llu/%lluB drops:%llu\n", ifaces[i]->name,
+      sum.tx_frames, sum.tx_bytes, sum.rx_frames, sum.rx_bytes, sum.drops);
+  }
+  evbuffer_add_printf(out, "END\n");
+}
+
+
+static void control_flushed(struct bufferevent* bev, void* arg) {
+  bufferevent_free(bev);
+}
+
+
+/* Control connection is closed once its replies are sent */
+static void control_event(struct bufferevent* bev, short events, void* arg) {
+  if ((events & BEV_EVENT_EOF) &&
+      evbuffer_get_length(bufferevent_get_output(bev)) > 0) {
+    bufferevent_disable(bev, EV_READ);
+    bufferevent_setcb(bev, NULL, control_flushed, control_event, NULL);
+    return;
+  }
+  if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
+    bufferevent_free(bev);
+}
+
+
+/* Every complete line is a command */
+static void control_read(struct bufferevent* bev, void* arg) {
+  struct evbuffer* in = bufferevent_get_input(bev);
+  char* line;
+  size_t len;
+
+  while ((line = evbuffer_readln(in, &len, EVBUFFER_EOL_ANY)) != NULL) {
+    run_command(bufferevent_get_output(bev), line);
+    free(line);
+  }
+  if (evbuffer_get_length(in) > MAX_COMMAND_LEN)
+    bufferevent_free(bev);
+}
+
+
+static void control_accept(evutil_socket_t sock, short ev, void* arg) {
+  struct event_base* base = (struct event_base*) arg;
+  struct bufferevent* bev;
+  evutil_socket_t client;
+
+  client = accept(sock, NULL, NULL);
+  if (client == -1)
+    return;
+  if (evutil_make_socket_nonblocking(client)) {
+    close(client);
+    return;
+  }
+  bev = bufferevent_socket_new(base, client, BEV_OPT_CLOSE_ON_FREE);
+  if (!bev)
+    syserr("Creating bufferevent for control connection.");
+  bufferevent_setcb(bev, control_read, NULL, control_event, NULL);
+  if (bufferevent_enable(bev, EV_READ|EV_WRITE) == -1)
+    syserr("Enabling control connection.");
+  evbuffer_add_printf(bufferevent_get_output(bev), "SLIJENT\n");
+}
+
+
+/* Control service on localhost port, answering "counters" */
+static void open_control(int port) {
+  struct sockaddr_in addr;
+
+  control_listener = socket(PF_INET, SOCK_STREAM, 0);
+  if (control_listener == -1)
+    syserr("socket");
+  if (evutil_make_listen_socket_reuseable(control_listener) ||
+      evutil_make_socket_nonblocking(control_listener))
+    syserr("Setting up control socket.");
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  if (bind(control_listener, (struct sockaddr*) &addr, sizeof(addr)) == -1 ||
+      listen(control_listener, 5) == -1)
+    syserr("Binding control port %d", port);
+}
+
+
+/* Frames from the shm ring of an interface, and room in the ring for the
+ * replay of a pcap file */
+static void init_shm_queue(struct tap_queue* queue) {
+  struct tap_iface* iface = queue->iface;
+
+  iface->shm_event = event_new(queue->worker->base,
+    iface->shm_fds[SHM_FD_CLIENT_RX], EV_READ|EV_PERSIST, shm_response,
+    (void*) queue);
+  iface->room_event = event_new(queue->worker->base,
+    iface->shm_fds[SHM_FD_CLIENT_TX], EV_READ, backend_read, (void*) queue);
+  if (!iface->shm_event || !iface->room_event ||
+      event_add(iface->shm_event, NULL) == -1)
+    syserr("Error adding shm event.");
+}
+
+
+/* Opens pcap file, pipe or Unix socket of an interface; files are read
+ * on a timer, streams when readable */
+static void init_backend_queue(struct tap_queue* queue) {
+  struct tap_iface* iface = queue->iface;
+  struct timeval now = { 0, 0 };
+
+  open_backend(iface->name, &iface->backend);
+  queue->fd = -1;
+  queue->ev = NULL;
+  if (iface->backend.reader == NULL)
+    return;
+
+  queue->fd = iface->backend.reader->fd;
+  if (iface->backend.reader->is_file) {
+    queue->ev = evtimer_new(queue->worker->base, backend_read, queue);
+    if (!queue->ev || evtimer_add(queue->ev, &now) == -1)
+      syserr("Error adding replay timer.");
+  } else {
+    queue->ev = event_new(queue->worker->base, queue->fd,
+      EV_READ|EV_PERSIST, backend_read, (void*) queue);
+    if (!queue->ev || event_add(queue->ev, NULL) == -1)
+      syserr("Error adding pcap stream event.");
+  }
+}
+
+
+static void init_worker(struct worker* worker, int index,
+  struct sockaddr_in* local_addr) {
+  struct tap_queue* queue;
+  int i;
+
+  worker->index = index;
+  init_worker_socket(worker, local_addr);
+  init_batch(&worker->tx, 0);
+  init_batch(&worker->rx, 1);
+  worker->tx_count = 0;
+  worker->shm_pushed = 0;
+  worker->super_buf = NULL;
+  if (offload) {
+    worker->super_buf = malloc(sizeof(struct virtio_net_hdr) + GSO_MAX_FRAME);
+    if (!worker->super_buf)
+      fatal("Allocating superframe buffer.");
+  }
+
+  /* Creating events */
+  worker->base = event_base_new();
+  if (!worker->base)
+    syserr("Error creating base.");
+
+  worker->udp_event = event_new(worker->base, worker->sock,
+    EV_READ|EV_PERSIST, udp_response, (void*) worker);
+  if (!worker->udp_event)
+    syserr("Error creating event for a listener socket.");
+  if (event_add(worker->udp_event, NULL) == -1)
+    syserr("Error adding listener_socket event.");
+
+  /* Worker serves queue number index of every interface */
+  for (i = 0; i < iface_count; i += 1) {
+    queue = &ifaces[i]->queues[index];
+    queue->iface = ifaces[i];
+    queue->worker = worker;
+    if (ifaces[i]->shm != NULL)
+      init_shm_queue(queue);
+    if (ifaces[i]->backend.kind != BACKEND_TAP) {
+      init_backend_queue(queue);
+      continue;
+    }
+    queue->fd = open_tap(ifaces[i]->name, queue_count > 1);
+    queue->ev = event_new(worker->base, queue->fd, EV_READ|EV_PERSIST,
+      tun_read, (void*) queue);
+    if (!queue->ev)
+      syserr("Error creating event for a TAP queue.");
+    if (event_add(queue->ev, NULL) == -1)
+      syserr("Error adding TAP queue event.");
+  }
+}
+
+
+static void clean_worker(struct worker* worker) {
+  struct tap_queue* queue;
+  int i, c;
+
+  for (i = 0; i < iface_count; i += 1) {
+    queue = &ifaces[i]->queues[worker->index];
+    if (queue->ev != NULL)
+      event_free(queue->ev);
+    if (ifaces[i]->backend.kind != BACKEND_TAP)
+      close_backend(&ifaces[i]->backend);
+    else
+      close(queue->fd);
+    if (ifaces[i]->shm != NULL) {
+      event_free(ifaces[i]->shm_event);
+      event_free(ifaces[i]->room_event);
+      munmap(ifaces[i]->shm, sizeof(struct shm_region));
+      for (c = 0; c < SHM_FDS; c += 1)
+        close(ifaces[i]->shm_fds[c]);
+    }
+  }
+  event_free(worker->udp_event);
+  event_base_free(worker->base);
+  close(worker->sock);
+  free(worker->super_buf);
+}
+
+
+/* Ends slijent on SIGINT, so that recorded pcap files are complete */
+static void stop_slijent(evutil_socket_t sig, short ev, void* arg) {
+  int i;
+
+  print_stats(sig, ev, arg);
+  for (i = 0; i < iface_count; i += 1)
+    if (ifaces[i]->backend.writer != NULL)
+      pcap_flush(ifaces[i]->backend.writer);
+  if (queue_count == 1)
+    event_base_loopbreak(workers[0].base);
+  else
+    exit(0);
+}
+
+
+static void usage(const char* name) {
+  fatal("Usage: %s [-q queues] [-o] [-x] [-l port] [-c port] { -d interface <host>:<port> | "
+    "-i interface=<host>:<port> ... | -f config }\n"
+    "       (interface: TAP name, pcap:<in>[,<out>], pipe: or unix:<path>;\n"
+    "       <host>:<port> may be shm:<path>:<port> of a local switch)\n"
+    "       %s [-g <host>:<port>] [-r <host>:<port>] [-s size] [-t rate] "
+    "[-T seconds] [-v vlan] [-P pcp] [-b percent] [-a mac] [-A mac]",
+    name, name);
+}
+
+
+int main(int argc, char** argv)
+{
+  int i;
+  struct event* stats_event;
+  struct event* sigint_event;
+  struct event* report_event;
+  struct event* control_event = NULL;
+  struct timeval report_interval = { DROP_REPORT_SEC, 0 };
+
+  /* Load generator and reflector, no TAP */
+  struct load_options load;
+
+  /* Interface name for the single interface mode */
+  char* interface_name = "siktap";
+
+  /* Network connection data */
+  struct sockaddr_in local_addr;
+
+  /* Reading parameters from input */
+  int c;
+  int local_port = 0;              /* of UDP sockets, chosen by the kernel */
+  int control_port = 0;            /* none */
+  init_load_options(&load);
+  while ((c = getopt(argc, argv, "a:A:b:c:d:f:g:i:l:oP:q:r:s:t:T:v:x")) != -1) {
+    switch (c) {
+      case 'a':
+        read_load_mac(optarg, &load.src_mac);
+        break;
+      case 'A':
+        read_load_mac(optarg, &load.dst_mac);
+        break;
+      case 'b':
+        load.broadcast = atoi(optarg);
+        break;
+      case 'c':
+        control_port = atoi(optarg);
+        if (control_port <= 0 || control_port > 65535)
+          fatal("Wrong control port %s.", optarg);
+        break;
+      case 'g':
+        load.generate = 1;
+        resolve_switch(optarg, &load.generate_addr);
+        break;
+      case 'P':
+        load.pcp = atoi(optarg);
+        break;
+      case 'r':
+        load.reflect = 1;
+        resolve_switch(optarg, &load.reflect_addr);
+        break;
+      case 's':
+        load.frame_size = atoi(optarg);
+        break;
+      case 't':
+        load.rate = atol(optarg);
+        break;
+      case 'T':
+        load.duration = atoi(optarg);
+        break;
+      case 'v':
+        load.vlan = atoi(optarg);
+        break;
+      case 'x':
+        replay_fast = 1;
+        break;
+      case 'd':
+        interface_name = optarg;
+        break;
+      case 'f':
+        read_config(optarg);
+        break;
+      case 'i':
+        add_iface_spec(optarg);
+        break;
+      case 'l':
+        local_port = atoi(optarg);
+        if (local_port <= 0 || local_port > 65535)
+          fatal("Wrong local port %s.", optarg);
+        break;
+      case 'o':
+        offload = 1;
+        break;
+      case 'q':
+        queue_count = atoi(optarg);
+        if (queue_count < 1 || queue_count > MAX_QUEUES)
+          fatal("Number of queues must be between 1 and %d.", MAX_QUEUES);
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  /* Synthetic frames instead of TAP interfaces */
+  if (load.generate || load.reflect) {
+    run_load(&load);
+    return 0;
+  }
+
+  /* Single interface given as -d <interface> <host>:<port> */
+  if (optind < argc)
+    add_iface(interface_name, argv[optind]);
+  if (iface_count == 0)
+    usage(argv[0]);
+
+  /* Frames of files and streams keep their order on one queue */
+  if ((backend_count > 0 || shm_count > 0) && queue_count > 1)
+    fatal("pcap, pipe, unix and shm interfaces need a single queue.");
+
+  /* Replies are matched to interfaces by switch port address */
+  memcpy(ifaces_by_addr, ifaces, iface_count * sizeof(struct tap_iface*));
+  qsort(ifaces_by_addr, iface_count, sizeof(struct tap_iface*),
+    compare_ifaces);
+  for (i = 1; i < iface_count; i += 1)
+    if (!compare_addrs(&ifaces_by_addr[i - 1]->switch_addr,
+                       &ifaces_by_addr[i]->switch_addr))
+      fatal("Interfaces %s and %s use the same switch port.",
+        ifaces_by_addr[i - 1]->name, ifaces_by_addr[i]->name);
+
+  memset(&local_addr, 0, sizeof(local_addr));
+  local_addr.sin_family = AF_INET;
+  local_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  local_addr.sin_port = htons(local_port);
+
+  /* Each worker gets its own socket, event base and one queue of every
+   * interface */
+  for (i = 0; i < queue_count; i += 1)
+    init_worker(&workers[i], i, &local_addr);
+
+  fprintf(stderr, "Serving %d interface(s) with %d queue(s) each.\n",
+    iface_count, queue_count);
+
+  stats_event = evsignal_new(workers[0].base, SIGUSR1, print_stats, NULL);
+  if (!stats_event || event_add(stats_event, NULL) == -1)
+    syserr("Error adding SIGUSR1 event.");
+  sigint_event = evsignal_new(workers[0].base, SIGINT, stop_slijent, NULL);
+  if (!sigint_event || event_add(sigint_event, NULL) == -1)
+    syserr("Error adding SIGINT event.");
+  report_event = event_new(workers[0].base, -1, EV_PERSIST, report_drops,
+    NULL);
+  if (!report_event || event_add(report_event, &report_interval) == -1)
+    syserr("Error adding drop report event.");
+  if (control_port != 0) {
+    open_control(control_port);
+    control_event = event_new(workers[0].base, control_listener,
+      EV_READ|EV_PERSIST, control_accept, workers[0].base);
+    if (!control_event || event_add(control_event, NULL) == -1)
+      syserr("Error adding control event.");
   }
-  fprintf(stderr, "Po ioctl\n");
 
   /* Teraz już w systemie pojawił się interfejs 'siktap'. Możemy mu
    * skonfigurować adres IP ifconfigiem itp. Można też polecić systemowi jego
@@ -197,68 +1201,27 @@ int main(int argc, char** argv)
    * są przekazywane po usunięciu tagowania.
    */
 
-  /* Creating network connection */
-  (void) memset(&addr_hints, 0, sizeof(struct addrinfo));
-  addr_hints.ai_family = AF_INET;
-  addr_hints.ai_socktype = SOCK_DGRAM;
-  addr_hints.ai_protocol = IPPROTO_UDP;
-  addr_hints.ai_flags = 0;
-  addr_hints.ai_addrlen = 0;
-  addr_hints.ai_addr = NULL;
-  addr_hints.ai_canonname = NULL;
-  addr_hints.ai_next = NULL;
-  if (getaddrinfo(switch_data[0], NULL, &addr_hints, &addr_result) != 0) {
-    syserr("getaddrinfo");
-  }
+  /* stdout may carry frames of pipe: */
+  fprintf(stderr, "Slijent started.\n");
+  for (i = 1; i < queue_count; i += 1)
+    if (pthread_create(&workers[i].thread, NULL, worker_loop, &workers[i]))
+      fatal("Error creating worker thread.");
+  worker_loop(&workers[0]);
+  for (i = 1; i < queue_count; i += 1)
+    pthread_join(workers[i].thread, NULL);
+  fprintf(stderr, "Slijent closed.\n");
 
-  my_address.sin_family = AF_INET;
-  my_address.sin_addr.s_addr = 
-    ((struct sockaddr_in*)(addr_result->ai_addr))->sin_addr.s_addr;
-  my_address.sin_port = htons(atoi(switch_data[1]));
-
-  server_addr.sin_family = AF_INET;
-  server_addr.sin_addr.s_addr = 
-    ((struct sockaddr_in*)(addr_result->ai_addr))->sin_addr.s_addr;
-  server_addr.sin_port = htons(0);
-
-  freeaddrinfo(addr_result);
-
-  sock = socket(PF_INET, SOCK_DGRAM, 0);
-  if (sock < 0)
-    syserr("socket");
-  
-  bind(sock, (struct sockaddr*)&server_addr, sizeof(server_addr));
-
-  free_array(switch_data, 2);
-
-  /* Creating events */
-  base = event_base_new();
-  if (!base)
-    syserr("Error creating base.");
-
-  udp_event =
-    event_new(base, sock, EV_READ|EV_PERSIST, udp_response, (void*) base);
-  if (!udp_event) 
-    syserr("Error creating event for a listener socket.");
-  if (event_add(udp_event, NULL) == -1)
-    syserr("Error adding listener_socket event.");
-
-  tun_event =
-    event_new(base, fd, EV_READ|EV_PERSIST, tun_read, (void*) base);
-  if (!tun_event)
-    syserr("Error creating event for a listener socket.");
-  if (event_add(tun_event, NULL) == -1)
-    syserr("Error adding listener_socket event.");
-
-  printf("Slijent started.\n");
-  if (event_base_dispatch(base) == -1)
-    syserr("Error running slijent dispatch loop.");
-  printf("Slijent closed.\n");
-
-  event_free(udp_event);
-  event_free(tun_event);
-  event_base_free(base);
+  event_free(stats_event);
+  event_free(sigint_event);
+  event_free(report_event);
+  if (control_event != NULL) {
+    event_free(control_event);
+    close(control_listener);
+  }
+  for (i = 0; i < queue_count; i += 1)
+    clean_worker(&workers[i]);
+  for (i = 0; i < iface_count; i += 1)
+    free(ifaces[i]);
 
   return 0;
 }
-
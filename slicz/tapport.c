@@ -0,0 +1,109 @@
+/*
+ * Author: Konrad Słoniewski
+ * Date:   18 August 2013
+ */
+
+/* Ports that are TAP interfaces of the switch host, configured as
+ * "number/tap:<name>/VLANs". slicz opens the TAP itself, so frames of a
+ * local VM or namespace are read from and written to its descriptor in
+ * the forwarding loop, without a slijent process and two UDP hops. A
+ * wakeup drains up to a whole batch; one read or write moves one frame.
+ * While the interface is down, frames to it are dropped and counted. */
+
+#include "tapport.h"
+
+
+/* Attributes */
+
+static int link_errors[MAX_SOCKETS];  /* errno while TAP is down, or 0 */
+
+
+/* Functions */
+
+/* Frames the host sent through the TAP, until EAGAIN or count */
+static int tap_receive(int index, struct frame_buf** frames, int count) {
+  ssize_t r;
+  int n;
+
+  for (n = 0; n < count; n += 1) {
+    r = read(sockets[index], frames[n]->data, FRAME_SIZE);
+    if (r < 0)
+      break;
+    frames[n]->len = r;
+  }
+  return (n > 0) ? n : -1;
+}
+
+
+/* Logs a change of the interface state once */
+static void link_state(int index, int error) {
+  if (error == link_errors[index])
+    return;
+  if (error != 0)
+    fprintf(stderr, "TAP of port %d is down (%s).\n", ports[index],
+      strerror(error));
+  else
+    fprintf(stderr, "TAP of port %d is up again.\n", ports[index]);
+  link_errors[index] = error;
+}
+
+
+/* Frames to the host, until the TAP queue is full. While the interface
+ * is down (EIO) the rest of the batch is dropped */
+static int tap_send(int index, struct frame_buf** frames, int count) {
+  int n;
+
+  for (n = 0; n < count; n += 1)
+    if (write(sockets[index], frames[n]->data, frames[n]->len) < 0)
+      break;
+  if (n < count && errno != EAGAIN) {
+    tx_drops[index] += count - n;
+    link_state(index, errno);
+    return count;
+  }
+  if (n > 0)
+    link_state(index, 0);
+  return (n > 0) ? n : -1;
+}
+
+
+static const struct transport tap_transport = {
+  tap_receive, tap_send, NULL
+};
+
+
+/* Opens TAP interface of a new port, created if it does not exist.
+ * Returns socket index, or -1 */
+int init_tap_port(int port_num, const char* device) {
+  struct ifreq ifr;
+  int fd, index;
+
+  if (strlen(device) >= IFNAMSIZ) {
+    fprintf(stderr, "TAP name %s of port %d is too long.\n", device,
+      port_num);
+    return -1;
+  }
+  fd = open("/dev/net/tun", O_RDWR | O_CLOEXEC);
+  if (fd == -1) {
+    fprintf(stderr, "Opening /dev/net/tun (%s).\n", strerror(errno));
+    return -1;
+  }
+
+  memset(&ifr, 0, sizeof(ifr));
+  strcpy(ifr.ifr_name, device);
+  ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+  if (ioctl(fd, TUNSETIFF, (void*) &ifr) == -1 ||
+      evutil_make_socket_nonblocking(fd) == -1) {
+    fprintf(stderr, "Attaching TAP %s to port %d (%s).\n", device, port_num,
+      strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  index = claim_socket(port_num, fd, &tap_transport);
+  if (index == -1)
+    close(fd);
+  else
+    link_errors[index] = 0;
+  return index;
+}
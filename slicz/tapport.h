@@ -0,0 +1,27 @@
+/*
+ * Author: Konrad Słoniewski
+ * Date:   18 August 2013
+ */
+
+#ifndef _TAPPORT_H
+#define _TAPPORT_H
+
+#include <errno.h>
+#include <event2/event.h>
+#include <fcntl.h>
+#include <net/if.h>
+#include <linux/if_tun.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "ports.h"
+#include "framebuf.h"
+#include "forward.h"
+#include "err.h"
+
+/* Functions */
+int init_tap_port(int port_num, const char* device);
+
+#endif
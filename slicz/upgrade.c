@@ -0,0 +1,466 @@
+/*
+ * Author: Konrad Słoniewski
+ * Date:   18 August 2013
+ */
+
+#define _GNU_SOURCE          /* struct ucred */
+#include "upgrade.h"
+#include "control.h"
+
+/* Attributes */
+
+static const char* upgrade_path = NULL;
+static struct event_base* upgrade_base = NULL;  /* control thread */
+static evutil_socket_t upgrade_listener = -1;
+static struct event* listener_event = NULL;
+static struct event* successor_event = NULL;    /* answer of new process */
+static struct event* drain_event = NULL;
+static struct timespec drain_deadline;
+
+static evutil_socket_t predecessor = -1;        /* switch taken over */
+static evutil_socket_t control_listener = -1;   /* handed over */
+static evutil_socket_t metrics_listener = -1;
+
+
+/* Functions */
+
+static int write_all(evutil_socket_t sock, const void* data, size_t size) {
+  const char* p = (const char*) data;
+  ssize_t written;
+
+  while (size > 0) {
+    written = write(sock, p, size);
+    if (written == -1 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      return -1;
+    p += written;
+    size -= written;
+  }
+  return 0;
+}
+
+
+static int read_all(evutil_socket_t sock, void* data, size_t size) {
+  char* p = (char*) data;
+  ssize_t got;
+
+  while (size > 0) {
+    got = read(sock, p, size);
+    if (got == -1 && errno == EINTR)
+      continue;
+    if (got <= 0)
+      return -1;
+    p += got;
+    size -= got;
+  }
+  return 0;
+}
+
+
+static void set_timeout(evutil_socket_t sock, int option) {
+  struct timeval timeout = { UPGRADE_TIMEOUT_SEC, 0 };
+
+  if (setsockopt(sock, SOL_SOCKET, option, &timeout, sizeof(timeout)) == -1)
+    syserr("Setting upgrade timeout.");
+}
+
+
+/* Sends one batch of sockets */
+static int send_sockets(evutil_socket_t sock, struct upgrade_sockets* batch,
+  const int* fds) {
+  char control[CMSG_SPACE(UPGRADE_FDS * sizeof(int))];
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr* cmsg;
+
+  memset(&msg, 0, sizeof(msg));
+  memset(control, 0, sizeof(control));
+  iov.iov_base = batch;
+  iov.iov_len = sizeof(*batch);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = CMSG_SPACE(batch->count * sizeof(int));
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(batch->count * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, batch->count * sizeof(int));
+
+  return (sendmsg(sock, &msg, 0) == sizeof(*batch)) ? 0 : -1;
+}
+
+
+/* Receives one batch of sockets, count of fds must match */
+static int receive_sockets(evutil_socket_t sock, struct upgrade_sockets* batch,
+  int* fds) {
+  char control[CMSG_SPACE(UPGRADE_FDS * sizeof(int))];
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr* cmsg;
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = batch;
+  iov.iov_len = sizeof(*batch);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  if (recvmsg(sock, &msg, MSG_WAITALL) != sizeof(*batch) ||
+      (msg.msg_flags & MSG_CTRUNC) || batch->count > UPGRADE_FDS)
+    return -1;
+  cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+      cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(batch->count * sizeof(int)))
+    return -1;
+  memcpy(fds, CMSG_DATA(cmsg), batch->count * sizeof(int));
+  return 0;
+}
+
+
+/*                        New process taking over                          */
+
+/* Connects to a running switch and takes its state and sockets: ports are
+ * staged into the transaction and created on the sockets they had.
+ * Returns 1, or 0 if no switch listens on path */
+int take_over(const char* path, struct transaction* tx) {
+  struct sockaddr_un addr;
+  struct upgrade_hello hello;
+  struct upgrade_sockets batch;
+  int fds[UPGRADE_FDS];
+  evutil_socket_t sock;
+  void* image;
+  uint32_t got = 0, i;
+
+  sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock == -1)
+    syserr("Creating upgrade socket.");
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path))
+    fatal("Upgrade socket path %s is too long.", path);
+  strcpy(addr.sun_path, path);
+  if (connect(sock, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+    fprintf(stderr, "No switch to take over at %s (%s).\n", path,
+      strerror(errno));
+    close(sock);
+    return 0;
+  }
+  set_timeout(sock, SO_RCVTIMEO);
+  set_timeout(sock, SO_SNDTIMEO);
+
+  /* Anything wrong ends this process, the old one goes on then */
+  if (read_all(sock, &hello, sizeof(hello)) == -1 ||
+      hello.magic != UPGRADE_MAGIC || hello.version != UPGRADE_VERSION)
+    fatal("Switch at %s cannot be taken over.", path);
+  image = malloc(hello.size);
+  if (image == NULL)
+    syserr("Taking over.");
+  if (read_all(sock, image, hello.size) == -1)
+    fatal("Receiving state of the switch.");
+
+  while (got < hello.sockets) {
+    if (receive_sockets(sock, &batch, fds) == -1)
+      fatal("Receiving sockets of the switch.");
+    for (i = 0; i < batch.count; i += 1) {
+      if (batch.numbers[i] == UPGRADE_CONTROL)
+        control_listener = fds[i];
+      else if (batch.numbers[i] == UPGRADE_METRICS)
+        metrics_listener = fds[i];
+      else if (batch.numbers[i] > 0 && batch.numbers[i] <= MAX_PORT_NUMBER)
+        inherit_socket(batch.numbers[i], fds[i]);
+      else
+        close(fds[i]);
+    }
+    got += batch.count;
+  }
+
+  if (load_snapshot(image, hello.size, tx) == -1)
+    fatal("State of the switch at %s is damaged.", path);
+  fprintf(stderr, "Taking over switch at %s, %u sockets.\n", path, got);
+  predecessor = sock;
+  return 1;
+}
+
+
+/* Listening socket handed over, UPGRADE_CONTROL or UPGRADE_METRICS, -1 if
+ * there is none */
+evutil_socket_t upgrade_socket(int number) {
+  if (number == UPGRADE_CONTROL)
+    return control_listener;
+  if (number == UPGRADE_METRICS)
+    return metrics_listener;
+  return -1;
+}
+
+
+/* New switch is ready to forward. Waits until the old one stops for
+ * good; if it has gone on meanwhile, this process ends */
+void finish_take_over() {
+  char answer = UPGRADE_READY;
+
+  close_inherited();
+  if (predecessor == -1)
+    return;
+  if (write_all(predecessor, &answer, 1) == -1 ||
+      read_all(predecessor, &answer, 1) == -1 || answer != UPGRADE_GO)
+    fatal("Old switch has not handed over, it goes on.");
+  close(predecessor);
+  predecessor = -1;
+}
+
+
+/*                     Running switch handing over                         */
+
+/* Stops reading ports, on forwarding thread */
+static void pause_ports(void* arg) {
+  int i;
+
+  for (i = 0; i < MAX_SOCKETS; i += 1)
+    if (events[i] != NULL && event_del(events[i]) == -1)
+      syserr("Pausing port.");
+}
+
+
+static void resume_ports(void* arg) {
+  int i;
+
+  for (i = 0; i < MAX_SOCKETS; i += 1)
+    if (events[i] != NULL && event_add(events[i], NULL) == -1)
+      syserr("Resuming port.");
+}
+
+
+static void count_queued(void* arg) {
+  *(int*) arg = egress_queued();
+}
+
+
+/* Nothing changes while state is handed over */
+static void pause_switch() {
+  hold_clients(1);
+  if (listener_socket_event != NULL)
+    event_del(listener_socket_event);
+  stop_snapshots();
+  data_plane_call(pause_ports, NULL);
+}
+
+
+/* New process has failed, going on */
+static void resume_switch() {
+  data_plane_call(resume_ports, NULL);
+  start_snapshots(upgrade_base);
+  if (listener_socket_event != NULL &&
+      event_add(listener_socket_event, NULL) == -1)
+    syserr("Adding control service event.");
+  hold_clients(0);
+}
+
+
+/* State image and all listening sockets. Returns 0, or -1 on error */
+static int send_state(evutil_socket_t sock) {
+  struct upgrade_hello hello;
+  struct upgrade_sockets batch;
+  int fds[UPGRADE_FDS];
+  void* image;
+  size_t size;
+  port_t* port;
+  int result;
+
+  image = build_snapshot(&size);
+  memset(&hello, 0, sizeof(hello));
+  hello.magic = UPGRADE_MAGIC;
+  hello.version = UPGRADE_VERSION;
+  hello.size = size;
+  if (listener_socket_event != NULL)
+    hello.sockets += 1;
+  if (metrics_socket() != -1)
+    hello.sockets += 1;
+  for (port = get_head(); port != NULL; port = port->next)
+    if (port->index != -1 && port->type == PORT_UDP)
+      hello.sockets += 1;
+
+  result = write_all(sock, &hello, sizeof(hello));
+  if (result == 0)
+    result = write_all(sock, image, size);
+  free(image);
+
+  memset(&batch, 0, sizeof(batch));
+  if (listener_socket_event != NULL) {
+    batch.numbers[batch.count] = UPGRADE_CONTROL;
+    fds[batch.count++] = event_get_fd(listener_socket_event);
+  }
+  if (metrics_socket() != -1) {
+    batch.numbers[batch.count] = UPGRADE_METRICS;
+    fds[batch.count++] = metrics_socket();
+  }
+  for (port = get_head(); port != NULL && result == 0; port = port->next) {
+    if (port->index == -1 || port->type != PORT_UDP)
+      continue;
+    batch.numbers[batch.count] = port->number;
+    fds[batch.count++] = sockets[port->index];
+    if (batch.count == UPGRADE_FDS) {
+      result = send_sockets(sock, &batch, fds);
+      batch.count = 0;
+    }
+  }
+  if (result == 0 && batch.count > 0)
+    result = send_sockets(sock, &batch, fds);
+  return result;
+}
+
+
+/* Sends frames still queued, then leaves */
+static void drain_switch(evutil_socket_t sock, short ev, void* arg) {
+  struct timespec now;
+  int queued;
+
+  data_plane_call(count_queued, &queued);
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (queued > 0 && (now.tv_sec < drain_deadline.tv_sec ||
+      (now.tv_sec == drain_deadline.tv_sec &&
+       now.tv_nsec < drain_deadline.tv_nsec)))
+    return;
+
+  if (queued > 0)
+    fprintf(stderr, "Dropping %d queued frames.\n", queued);
+  event_free(drain_event);
+  drain_event = NULL;
+  leave_switch();
+}
+
+
+/* New process is ready or has failed. Once it is told to go, this one
+ * must not forward anymore; when it is not, it ends itself */
+static void successor_ready(evutil_socket_t sock, short ev, void* arg) {
+  struct timeval period = { 0, UPGRADE_POLL_MSEC * 1000 };
+  char answer = 0;
+
+  event_free(successor_event);
+  successor_event = NULL;
+  if ((ev & EV_TIMEOUT) || read(sock, &answer, 1) != 1 ||
+      answer != UPGRADE_READY) {
+    fprintf(stderr, "Upgrade failed, forwarding goes on.\n");
+    close(sock);
+    resume_switch();
+    return;
+  }
+  answer = UPGRADE_GO;
+  if (write_all(sock, &answer, 1) == -1) {
+    fprintf(stderr, "Upgrade failed (%s), forwarding goes on.\n",
+      strerror(errno));
+    close(sock);
+    resume_switch();
+    return;
+  }
+  close(sock);
+  fprintf(stderr, "Switch handed over, leaving.\n");
+
+  /* The path belongs to the new process now */
+  event_free(listener_event);
+  listener_event = NULL;
+  close(upgrade_listener);
+  upgrade_listener = -1;
+
+  clock_gettime(CLOCK_MONOTONIC, &drain_deadline);
+  drain_deadline.tv_sec += UPGRADE_DRAIN_MSEC / 1000;
+  drain_deadline.tv_nsec += (UPGRADE_DRAIN_MSEC % 1000) * 1000000L;
+  if (drain_deadline.tv_nsec >= 1000000000L) {
+    drain_deadline.tv_sec += 1;
+    drain_deadline.tv_nsec -= 1000000000L;
+  }
+  drain_event = event_new(upgrade_base, -1, EV_PERSIST, drain_switch, NULL);
+  if (drain_event == NULL || event_add(drain_event, &period) == -1)
+    syserr("Adding drain event.");
+}
+
+
+/* Only root and the user of the switch may take its sockets over */
+static int allowed(evutil_socket_t sock) {
+  struct ucred cred;
+  socklen_t size = sizeof(cred);
+
+  if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &size) == -1)
+    return 0;
+  return cred.uid == 0 || cred.uid == geteuid();
+}
+
+
+/* New process connects, one at a time */
+static void accept_successor(evutil_socket_t sock, short ev, void* arg) {
+  struct timeval timeout = { UPGRADE_TIMEOUT_SEC, 0 };
+  evutil_socket_t successor;
+
+  successor = accept(sock, NULL, NULL);
+  if (successor == -1)
+    return;
+  if (successor_event != NULL || drain_event != NULL) {
+    close(successor);
+    return;
+  }
+  if (!allowed(successor)) {
+    fprintf(stderr, "Refused to hand the switch over to another user.\n");
+    close(successor);
+    return;
+  }
+  set_timeout(successor, SO_SNDTIMEO);
+
+  fprintf(stderr, "Handing the switch over.\n");
+  pause_switch();
+  if (send_state(successor) == -1) {
+    fprintf(stderr, "Handing over failed (%s), forwarding goes on.\n",
+      strerror(errno));
+    close(successor);
+    resume_switch();
+    return;
+  }
+
+  successor_event = event_new(upgrade_base, successor, EV_READ,
+    successor_ready, NULL);
+  if (successor_event == NULL || event_add(successor_event, &timeout) == -1)
+    syserr("Adding upgrade event.");
+}
+
+
+/* New process may take the switch over through a Unix socket at path,
+ * served by base, the control thread */
+void listen_upgrades(const char* path, struct event_base* base) {
+  struct sockaddr_un addr;
+
+  upgrade_path = path;
+  upgrade_base = base;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path))
+    fatal("Upgrade socket path %s is too long.", path);
+  strcpy(addr.sun_path, path);
+
+  unlink(path);
+  upgrade_listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (upgrade_listener == -1 ||
+      bind(upgrade_listener, (struct sockaddr*) &addr, sizeof(addr)) == -1 ||
+      chmod(path, UPGRADE_SOCKET_MODE) == -1 ||
+      listen(upgrade_listener, 1) == -1 ||
+      evutil_make_socket_nonblocking(upgrade_listener) == -1)
+    syserr("Listening for upgrades on %s.", path);
+
+  listener_event = event_new(base, upgrade_listener, EV_READ|EV_PERSIST,
+    accept_successor, NULL);
+  if (listener_event == NULL || event_add(listener_event, NULL) == -1)
+    syserr("Adding upgrade event.");
+}
+
+
+/* Switch is shut down, no upgrades anymore */
+void stop_upgrades() {
+  if (listener_event == NULL)
+    return;
+  event_free(listener_event);
+  listener_event = NULL;
+  close(upgrade_listener);
+  upgrade_listener = -1;
+  unlink(upgrade_path);
+}
@@ -0,0 +1,65 @@
+/*
+ * Author: Konrad Słoniewski
+ * Date:   18 August 2013
+ */
+
+#ifndef _UPGRADE_H
+#define _UPGRADE_H
+
+#include <errno.h>
+#include <event2/event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "err.h"
+
+/* Definitions */
+#define UPGRADE_MAGIC 0x55435a53     /* "SZCU" */
+#define UPGRADE_VERSION 1
+#define UPGRADE_FDS 250              /* sockets in one message, at most 253 */
+#define UPGRADE_CONTROL -1           /* socket numbers that are not ports */
+#define UPGRADE_METRICS -2
+#define UPGRADE_TIMEOUT_SEC 5        /* for the other process */
+#define UPGRADE_DRAIN_MSEC 1000      /* egress queues are sent at most so long */
+#define UPGRADE_POLL_MSEC 10
+#define UPGRADE_SOCKET_MODE 0600     /* the user of the switch only */
+#define UPGRADE_READY 'R'
+#define UPGRADE_GO 'G'
+
+/* Structures */
+
+/* Running switch to the new one: hello, snapshot image (snapshot.h) and
+ * messages with sockets. The new one answers with UPGRADE_READY once it
+ * can forward, the old one confirms with UPGRADE_GO and leaves. The new
+ * one forwards only after UPGRADE_GO, so a late answer to an old switch
+ * that has gone on ends the new one */
+struct upgrade_hello {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t size;                     /* of the image */
+  uint32_t sockets;
+  uint32_t unused;
+};
+
+/* Port numbers of sockets passed with SCM_RIGHTS */
+struct upgrade_sockets {
+  uint32_t count;
+  int32_t numbers[UPGRADE_FDS];
+};
+
+/* Functions */
+int take_over(const char* path, struct transaction* tx);
+evutil_socket_t upgrade_socket(int number);
+void finish_take_over();
+void listen_upgrades(const char* path, struct event_base* base);
+void stop_upgrades();
+
+#endif
@@ -0,0 +1,422 @@
+/*
+ * Author: Konrad Słoniewski
+ * Date:   18 August 2013
+ */
+
+#include "watch.h"
+
+/* Structs */
+
+/* Counters of a socket when they were last sent */
+struct counter_snapshot {
+  int port;                          /* port number, 0 if not sent yet */
+  int recv;
+  int sent;
+  int errs;
+  unsigned long long drops;
+};
+
+/* Event kept for a backlogged subscriber */
+struct pending_event {
+  struct watch_event event;          /* type 0 if slot is free */
+  unsigned long long seq;            /* order of the last change */
+};
+
+/* Subscriber on a control connection. Events that do not fit into its
+ * output buffer are coalesced: last event of a MAC in a VLAN and of a
+ * port are kept in order of their last change and sent once the buffer
+ * drains */
+struct watcher {
+  struct bufferevent* bev;
+  int interval;                      /* counter deltas period, ms, 0 - none */
+  struct timespec next_counters;
+  struct counter_snapshot* counters; /* by socket index */
+  struct pending_event* pending;     /* WATCH_COALESCE slots */
+  int coalesced;                     /* used slots of pending */
+  unsigned long long seq;            /* order of coalesced events */
+  unsigned long long lost;           /* events that could not be kept */
+  struct watcher* next;
+};
+
+
+/* Attributes */
+
+/* Events of forwarding thread for control thread, single producer and
+ * single consumer */
+static struct watch_event ring[WATCH_RING];
+static unsigned ring_head = 0;       /* next to send, control thread */
+static unsigned ring_tail = 0;       /* next free, forwarding thread */
+static unsigned long long ring_lost = 0;
+static unsigned ring_gen = 0;        /* events of older periods are stale */
+
+static int watching = 0;             /* subscribers, read by forwarding */
+static struct watcher* watchers = NULL;
+static struct event* poll_event = NULL;
+
+
+/* Functions */
+
+static void print_mac(struct evbuffer* out, const struct ether_addr* mac) {
+  const uint8_t* octet = mac->ether_addr_octet;
+
+  evbuffer_add_printf(out, "%02x:%02x:%02x:%02x:%02x:%02x", octet[0],
+    octet[1], octet[2], octet[3], octet[4], octet[5]);
+}
+
+
+/* Prints current configuration of a port */
+static void print_port(struct evbuffer* out, const char* name, int number) {
+  port_t* port;
+  char* buf;
+  size_t size;
+  FILE* stream;
+
+  port = get_port(number);
+  if (port == NULL) {
+    evbuffer_add_printf(out, "EVENT port-removed %d\n", number);
+    return;
+  }
+
+  stream = open_memstream(&buf, &size);
+  if (stream == NULL)
+    syserr("Printing configuration.");
+  print_config(port, stream);
+  fclose(stream);
+  evbuffer_add_printf(out, "EVENT %s %s\n", name, buf);
+  free(buf);
+}
+
+
+static void print_event(struct evbuffer* out, const struct watch_event* event) {
+  static const char* names[] = { NULL, "mac-learned", "mac-moved",
+    "mac-evicted" };
+
+  switch (event->type) {
+    case WATCH_PORT_ACTIVATED:
+      print_port(out, "port-activated", event->port);
+      return;
+    case WATCH_PORT_CONFIG:
+      print_port(out, "config", event->port);
+      return;
+  }
+
+  evbuffer_add_printf(out, "EVENT %s ", names[event->type]);
+  print_mac(out, &event->mac);
+  evbuffer_add_printf(out, " vlan %d port %d", event->vlan, event->port);
+  if (event->type == WATCH_MAC_MOVED)
+    evbuffer_add_printf(out, " from %d", event->old_port);
+  evbuffer_add(out, "\n", 1);
+}
+
+
+static int backlogged(struct watcher* watcher) {
+  return evbuffer_get_length(bufferevent_get_output(watcher->bev)) >
+    WATCH_BUFFER_MAX;
+}
+
+
+static int is_port_event(const struct watch_event* event) {
+  return event->type == WATCH_PORT_ACTIVATED ||
+    event->type == WATCH_PORT_CONFIG;
+}
+
+
+/* Events of the same MAC in a VLAN or of the same port replace each other */
+static int same_subject(const struct watch_event* a,
+  const struct watch_event* b) {
+  if (is_port_event(a) || is_port_event(b))
+    return is_port_event(a) && is_port_event(b) && a->port == b->port;
+  return a->vlan == b->vlan && !memcmp(&a->mac, &b->mac, sizeof(a->mac));
+}
+
+
+/* Keeps event until the subscriber drains its buffer */
+static void coalesce(struct watcher* watcher,
+  const struct watch_event* event) {
+  struct pending_event* slot;
+  unsigned hash;
+
+  if (watcher->pending == NULL &&
+      (watcher->pending = calloc(WATCH_COALESCE, sizeof(*slot))) == NULL)
+    syserr("Allocating watch buffer.");
+
+  /* Open addressing by subject, at most half full */
+  if (is_port_event(event))
+    hash = event->port * 31;
+  else
+    hash = event->vlan * 31 + event->mac.ether_addr_octet[5] +
+      (event->mac.ether_addr_octet[4] << 8) +
+      (event->mac.ether_addr_octet[3] << 16);
+  for (;;) {
+    slot = &watcher->pending[hash & (WATCH_COALESCE - 1)];
+    if (slot->event.type == 0 || same_subject(&slot->event, event))
+      break;
+    hash += 1;
+  }
+
+  if (slot->event.type == 0) {
+    if (watcher->coalesced >= WATCH_COALESCE / 2) {
+      watcher->lost += 1;
+      return;
+    }
+    watcher->coalesced += 1;
+  }
+  slot->event = *event;
+  /* Port is printed as it is when sent, not as it was activated */
+  if (is_port_event(event))
+    slot->event.type = WATCH_PORT_CONFIG;
+  slot->seq = ++watcher->seq;
+}
+
+
+static void deliver(struct watcher* watcher, const struct watch_event* event) {
+  /* Once something waits, later events wait too to keep their order */
+  if (backlogged(watcher) || watcher->coalesced > 0)
+    coalesce(watcher, event);
+  else
+    print_event(bufferevent_get_output(watcher->bev), event);
+}
+
+
+static int by_seq(const void* a, const void* b) {
+  const struct pending_event* const* x = a;
+  const struct pending_event* const* y = b;
+
+  return ((*x)->seq > (*y)->seq) - ((*x)->seq < (*y)->seq);
+}
+
+
+/* Sends coalesced events if the subscriber has drained its buffer */
+static void flush(struct watcher* watcher) {
+  struct evbuffer* out = bufferevent_get_output(watcher->bev);
+  struct pending_event* order[WATCH_COALESCE / 2];
+  int i, count = 0;
+
+  if (backlogged(watcher))
+    return;
+
+  for (i = 0; count < watcher->coalesced && i < WATCH_COALESCE; i += 1)
+    if (watcher->pending[i].event.type != 0)
+      order[count++] = &watcher->pending[i];
+  qsort(order, count, sizeof(order[0]), by_seq);
+  for (i = 0; i < count; i += 1) {
+    print_event(out, &order[i]->event);
+    order[i]->event.type = 0;
+  }
+  watcher->coalesced = 0;
+
+  /* Subscriber has to read the tables again */
+  if (watcher->lost > 0) {
+    evbuffer_add_printf(out, "EVENT overflow %llu\n", watcher->lost);
+    watcher->lost = 0;
+  }
+}
+
+
+/* Takes current counters of a socket, returns 1 if they changed since the
+ * last time */
+static int take_counters(struct counter_snapshot* snapshot, int number,
+  int index, struct counter_snapshot* delta) {
+  int first = (snapshot->port != number);
+
+  delta->recv = udp_recv[index] - snapshot->recv;
+  delta->sent = udp_sent[index] - snapshot->sent;
+  delta->errs = udp_errs[index] - snapshot->errs;
+  delta->drops = tx_drops[index] - snapshot->drops;
+
+  snapshot->port = number;
+  snapshot->recv += delta->recv;
+  snapshot->sent += delta->sent;
+  snapshot->errs += delta->errs;
+  snapshot->drops += delta->drops;
+
+  return !first && (delta->recv != 0 || delta->sent != 0 ||
+    delta->errs != 0 || delta->drops != 0);
+}
+
+
+static void add_msec(struct timespec* ts, int msec) {
+  ts->tv_sec += msec / 1000;
+  ts->tv_nsec += (msec % 1000) * 1000000L;
+  if (ts->tv_nsec >= 1000000000L) {
+    ts->tv_sec += 1;
+    ts->tv_nsec -= 1000000000L;
+  }
+}
+
+
+/* Counter changes of all ports once per interval. A backlogged subscriber
+ * gets changes of a longer period later */
+static void send_counters(struct watcher* watcher, const struct timespec* now) {
+  struct evbuffer* out = bufferevent_get_output(watcher->bev);
+  struct counter_snapshot delta;
+  port_t* port;
+
+  if (watcher->interval == 0 || backlogged(watcher) ||
+      now->tv_sec < watcher->next_counters.tv_sec ||
+      (now->tv_sec == watcher->next_counters.tv_sec &&
+       now->tv_nsec < watcher->next_counters.tv_nsec))
+    return;
+  watcher->next_counters = *now;
+  add_msec(&watcher->next_counters, watcher->interval);
+
+  for (port = get_head(); port != NULL; port = port->next) {
+    if (port->index == -1 ||
+        !take_counters(&watcher->counters[port->index], port->number,
+          port->index, &delta))
+      continue;
+    evbuffer_add_printf(out,
+      "EVENT counters %d recvd:+%d sent:+%d errs:+%d drops:+%llu\n",
+      port->number, delta.recv, delta.sent, delta.errs, delta.drops);
+  }
+}
+
+
+/* Timer of control thread - sends events of forwarding thread */
+static void poll_watchers(evutil_socket_t sock, short ev, void* arg) {
+  struct watcher* watcher;
+  struct timespec now;
+  unsigned head, tail;
+  unsigned long long lost;
+
+  tail = __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE);
+  for (head = ring_head; head != tail; head += 1) {
+    if (ring[head & (WATCH_RING - 1)].gen != ring_gen)
+      continue;
+    for (watcher = watchers; watcher != NULL; watcher = watcher->next)
+      deliver(watcher, &ring[head & (WATCH_RING - 1)]);
+  }
+  __atomic_store_n(&ring_head, head, __ATOMIC_RELEASE);
+
+  lost = __sync_fetch_and_and(&ring_lost, 0);
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  for (watcher = watchers; watcher != NULL; watcher = watcher->next) {
+    watcher->lost += lost;
+    flush(watcher);
+    send_counters(watcher, &now);
+  }
+}
+
+
+/* Subscribers are served by base, the control thread */
+void init_watch(struct event_base* base) {
+  poll_event = event_new(base, -1, EV_PERSIST, poll_watchers, NULL);
+  if (poll_event == NULL)
+    syserr("Creating watch event.");
+}
+
+
+/* New subscriber, counter deltas every interval ms if it is not 0 */
+struct watcher* watch_start(struct bufferevent* bev, int interval) {
+  struct timeval period = { 0, WATCH_POLL_MSEC * 1000 };
+  struct counter_snapshot delta;
+  struct watcher* watcher;
+  port_t* port;
+
+  watcher = calloc(1, sizeof(*watcher));
+  if (watcher == NULL ||
+      (watcher->counters = calloc(MAX_SOCKETS, sizeof(delta))) == NULL)
+    syserr("Allocating watcher.");
+  watcher->bev = bev;
+  watcher->interval = interval;
+  clock_gettime(CLOCK_MONOTONIC, &watcher->next_counters);
+  add_msec(&watcher->next_counters, interval);
+  for (port = get_head(); port != NULL; port = port->next)
+    if (port->index != -1)
+      take_counters(&watcher->counters[port->index], port->number,
+        port->index, &delta);
+
+  watcher->next = watchers;
+  watchers = watcher;
+
+  /* Events left from the previous subscribers are skipped. Forwarding may
+   * still be posting one of them, so they are told apart by generation */
+  if (watchers->next == NULL) {
+    __atomic_store_n(&ring_gen, ring_gen + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&ring_head,
+      __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+    __sync_fetch_and_and(&ring_lost, 0);
+  }
+  if (__sync_fetch_and_add(&watching, 1) == 0 &&
+      event_add(poll_event, &period) == -1)
+    syserr("Adding watch event.");
+  return watcher;
+}
+
+
+void watch_stop(struct watcher* watcher) {
+  struct watcher** node;
+
+  for (node = &watchers; *node != watcher; node = &(*node)->next)
+    ;
+  *node = watcher->next;
+
+  /* Without subscribers forwarding posts nothing, the rest is dropped by
+   * the next watch_start() */
+  if (__sync_sub_and_fetch(&watching, 1) == 0)
+    event_del(poll_event);
+
+  free(watcher->counters);
+  free(watcher->pending);
+  free(watcher);
+}
+
+
+/* Configuration of a port changed, on control thread */
+void watch_config(int number) {
+  struct watch_event event;
+  struct watcher* watcher;
+
+  if (watchers == NULL)
+    return;
+  memset(&event, 0, sizeof(event));
+  event.type = WATCH_PORT_CONFIG;
+  event.port = number;
+  for (watcher = watchers; watcher != NULL; watcher = watcher->next)
+    deliver(watcher, &event);
+}
+
+
+/* Event for subscribers, on forwarding thread. Nothing is done without
+ * them, a full ring drops the event */
+void watch_post(const struct watch_event* event) {
+  unsigned tail, gen;
+
+  if (__atomic_load_n(&watching, __ATOMIC_ACQUIRE) == 0)
+    return;
+  gen = __atomic_load_n(&ring_gen, __ATOMIC_RELAXED);
+
+  tail = ring_tail;
+  if (tail - __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE) >= WATCH_RING) {
+    __sync_fetch_and_add(&ring_lost, 1);
+    return;
+  }
+  ring[tail & (WATCH_RING - 1)] = *event;
+  ring[tail & (WATCH_RING - 1)].gen = gen;
+  __atomic_store_n(&ring_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+
+void watch_mac(int type, struct ether_addr mac, int vlan, int port,
+  int old_port) {
+  struct watch_event event;
+
+  if (__atomic_load_n(&watching, __ATOMIC_RELAXED) == 0)
+    return;
+  event.type = type;
+  event.mac = mac;
+  event.vlan = vlan;
+  event.port = port;
+  event.old_port = old_port;
+  watch_post(&event);
+}
+
+
+void watch_port_activated(int number) {
+  struct watch_event event;
+
+  memset(&event, 0, sizeof(event));
+  event.type = WATCH_PORT_ACTIVATED;
+  event.port = number;
+  watch_post(&event);
+}
@@ -0,0 +1,56 @@
+/*
+ * Author: Konrad Słoniewski
+ * Date:   18 August 2013
+ */
+
+#ifndef _WATCH_H
+#define _WATCH_H
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <net/ethernet.h>    /* struct ether_addr */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ports.h"
+#include "err.h"
+
+/* Definitions */
+#define WATCH_RING 16384         /* events from forwarding, power of two */
+#define WATCH_POLL_MSEC 50       /* how often events are sent */
+#define WATCH_BUFFER_MAX 65536   /* unsent bytes before events coalesce */
+#define WATCH_COALESCE 2048      /* coalesced MAC events, power of two */
+#define WATCH_MAC_LEARNED 1
+#define WATCH_MAC_MOVED 2
+#define WATCH_MAC_EVICTED 3
+#define WATCH_PORT_ACTIVATED 4
+#define WATCH_PORT_CONFIG 5
+
+/* Structs */
+
+/* Event of forwarding thread */
+struct watch_event {
+  int type;                      /* WATCH_* */
+  struct ether_addr mac;
+  int vlan;
+  int port;                      /* port number */
+  int old_port;                  /* port before move */
+  unsigned gen;                  /* subscription period, set by watch_post() */
+};
+
+struct watcher;
+
+/* Functions */
+void init_watch(struct event_base* base);
+struct watcher* watch_start(struct bufferevent* bev, int interval);
+void watch_stop(struct watcher* watcher);
+void watch_config(int number);
+void watch_post(const struct watch_event* event);
+void watch_mac(int type, struct ether_addr mac, int vlan, int port,
+  int old_port);
+void watch_port_activated(int number);
+
+#endif